@@ -0,0 +1,545 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* clock_gettime, mkdtemp */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "co2mon.h"
+#include "co2mond.h"
+#include "archive.h"
+#include "buf.h"
+#include "datadir.h"
+#include "metrics.h"
+#include "rolling.h"
+
+/*
+ * Microbenchmarks of the per-frame path of co2mond.
+ *
+ * Each benchmark is run with a growing number of iterations until it takes
+ * at least the minimum time, and is reported per iteration. Allocations
+ * are counted by interposing malloc(), which is only done with glibc.
+ */
+
+#define FRAMES 4096
+#define CAPTURE_FRAMES (1 << 20)
+
+/* Globals of co2mond's main.c used by the built-in daemon code. */
+int print_unknown = 0;
+int multi_device = 0;
+struct device devices[DEVICES_MAX];
+int devices_count = 0;
+
+void
+devices_lock()
+{
+}
+
+void
+devices_unlock()
+{
+}
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *
+malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+#define ALLOCATIONS() __atomic_load_n(&allocations, __ATOMIC_RELAXED)
+#else
+#define ALLOCATIONS() 0
+#endif
+
+/* Timer that only runs between timer_resume() and timer_pause(), so that
+ * benchmarks can leave their setup out of the measurement. */
+static int64_t timer_ns;
+static int64_t timer_start;
+static unsigned long timer_allocations;
+static unsigned long timer_allocations_start;
+
+static void
+timer_resume()
+{
+    timer_allocations_start = ALLOCATIONS();
+    timer_start = monotonic_ns();
+}
+
+static void
+timer_pause()
+{
+    timer_ns += monotonic_ns() - timer_start;
+    timer_allocations += ALLOCATIONS() - timer_allocations_start;
+}
+
+static volatile unsigned int sink;
+
+static co2mon_data_t magic_table = { 0 };
+static co2mon_data_t frames[FRAMES];
+static co2mon_data_t scrambled[FRAMES];
+static char capture_old[PATH_MAX + 16];
+static char capture_new[PATH_MAX + 16];
+static char tmpdir[PATH_MAX];
+
+static void
+make_frame(co2mon_data_t frame, unsigned char code, uint16_t value)
+{
+    frame[0] = code;
+    frame[1] = value >> 8;
+    frame[2] = value & 0xff;
+    frame[3] = frame[0] + frame[1] + frame[2];
+    frame[4] = 0x0d;
+    frame[5] = frame[6] = frame[7] = 0;
+}
+
+/* Inverse of the decoding done for release 0x0100 devices. */
+static void
+scramble(const co2mon_data_t frame, co2mon_data_t out)
+{
+    static const unsigned char magic_word[8] = "Htemp99e";
+    unsigned char r[8], buf[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        r[i] = frame[i] + ((magic_word[i] << 4) | (magic_word[i] >> 4));
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        buf[i] = (unsigned char)(r[i] << 3) | (r[(i + 1) % 8] >> 5);
+        buf[i] ^= magic_table[i];
+    }
+    static const int swaps[8] = { 2, 4, 0, 7, 1, 6, 5, 3 };
+    for (int i = 0; i < 8; ++i)
+    {
+        out[i] = buf[swaps[i]];
+    }
+}
+
+static void
+write_capture(const char *path, int release_number, const co2mon_data_t *raw)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        err(EXIT_FAILURE, "%s", path);
+    }
+    unsigned char header[16] = "CO2CAP\0\1";
+    header[8] = release_number & 0xff;
+    header[9] = release_number >> 8;
+    fwrite(header, sizeof(header), 1, f);
+    for (int i = 0; i < CAPTURE_FRAMES; ++i)
+    {
+        putc(0, f); /* no delay */
+        fwrite(raw[i % FRAMES], sizeof(co2mon_data_t), 1, f);
+    }
+    if (fclose(f) != 0)
+    {
+        err(EXIT_FAILURE, "%s", path);
+    }
+}
+
+static void
+setup()
+{
+    const unsigned char codes[] = { CODE_TAMB, CODE_CNTR, 0x6d, 0x6e, 0x71, 0x41, 0x43, 0x44 };
+    for (int i = 0; i < FRAMES; ++i)
+    {
+        unsigned char code = codes[i % sizeof(codes)];
+        uint16_t value = code == CODE_TAMB ? 4700 + i % 64 : 400 + i % 1600;
+        make_frame(frames[i], code, value);
+        scramble(frames[i], scrambled[i]);
+    }
+
+    co2mon_data_t check[FRAMES];
+    co2mon_decode_frames(magic_table, scrambled[0], check[0], FRAMES);
+    if (memcmp(check, frames, sizeof(frames)) != 0)
+    {
+        errx(EXIT_FAILURE, "co2mon_decode_frames does not restore the scrambled frames");
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    snprintf(tmpdir, sizeof(tmpdir), "%s/co2mon_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(tmpdir))
+    {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+    snprintf(capture_old, sizeof(capture_old), "%s/old.cap", tmpdir);
+    snprintf(capture_new, sizeof(capture_new), "%s/new.cap", tmpdir);
+    write_capture(capture_old, 0x0100, scrambled);
+    write_capture(capture_new, 0x0200, frames);
+}
+
+static void
+bench_decode_batch(unsigned long n)
+{
+    co2mon_data_t out[FRAMES];
+    timer_resume();
+    for (unsigned long done = 0; done < n; done += FRAMES)
+    {
+        size_t count = n - done < FRAMES ? n - done : FRAMES;
+        co2mon_decode_frames(magic_table, scrambled[0], out[0], count);
+    }
+    timer_pause();
+    sink += out[0][0];
+}
+
+/* co2mon_read_data() on a replayed capture, which decodes each frame like
+ * a device of that release. */
+static void
+bench_read(const char *capture, unsigned long n)
+{
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "replay-fast:%s", capture);
+
+    co2mon_data_t result;
+    unsigned long done = 0;
+    while (done < n)
+    {
+        co2mon_device dev = co2mon_open_device_path(path);
+        if (!dev)
+        {
+            errx(EXIT_FAILURE, "cannot open %s", path);
+        }
+        timer_resume();
+        for (int i = 0; i < CAPTURE_FRAMES && done < n; ++i, ++done)
+        {
+            co2mon_read_data(dev, magic_table, result);
+        }
+        timer_pause();
+
+        // Keep the playback summary out of the report.
+        int saved = dup(STDERR_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        co2mon_close_device(dev);
+        dup2(saved, STDERR_FILENO);
+        close(null);
+        close(saved);
+    }
+    sink += result[0];
+}
+
+static void
+bench_read_old(unsigned long n)
+{
+    bench_read(capture_old, n);
+}
+
+static void
+bench_read_new(unsigned long n)
+{
+    bench_read(capture_new, n);
+}
+
+static void
+bench_validate(unsigned long n)
+{
+    unsigned int ok = 0;
+    timer_resume();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        ok += frame_check(frames[i % FRAMES]) == FRAME_OK;
+    }
+    timer_pause();
+    sink += ok;
+}
+
+static void
+fill_devices(struct device *copy, int count)
+{
+    memset(copy, 0, sizeof(*copy) * count);
+    for (int d = 0; d < count; ++d)
+    {
+        snprintf(copy[d].name, sizeof(copy[d].name), "_dev_hidraw%d", d);
+        copy[d].state.heatbeat = time(0);
+        for (int i = 0; i < FRAMES; ++i)
+        {
+            state_set_code(&copy[d].state, frames[i][0], (frames[i][1] << 8) | frames[i][2],
+                monotonic_ns(), realtime_ms());
+        }
+    }
+}
+
+static void
+bench_render_format(int count, enum expo_format format, unsigned long n)
+{
+    static struct device copy[8];
+    struct buf out = { 0 };
+    fill_devices(copy, count);
+    multi_device = count > 1;
+    timer_resume();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        struct expo e;
+        out.len = 0;
+        expo_init(&e, format, &out);
+        render_metrics(&e, copy, count);
+        expo_finish(&e);
+    }
+    timer_pause();
+    multi_device = 0;
+    sink += out.len;
+    buf_free(&out);
+}
+
+static void
+bench_render(int count, unsigned long n)
+{
+    bench_render_format(count, EXPO_TEXT, n);
+}
+
+static void
+bench_render_openmetrics(unsigned long n)
+{
+    bench_render_format(8, EXPO_OPENMETRICS, n);
+}
+
+static void
+bench_render_protobuf(unsigned long n)
+{
+    bench_render_format(8, EXPO_PROTOBUF, n);
+}
+
+static void
+bench_render_1(unsigned long n)
+{
+    bench_render(1, n);
+}
+
+static void
+bench_render_8(unsigned long n)
+{
+    bench_render(8, n);
+}
+
+/* The datadir writes done by device_loop() for each frame: the value when
+ * it has changed, and the heartbeat. */
+static void
+bench_datadir(unsigned long n)
+{
+    static struct device device;
+    datadir = tmpdir;
+    timer_resume();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        char buf[VALUE_MAX];
+        snprintf(buf, VALUE_MAX, "%d", 400 + (int)(i % 1600));
+        write_value(&device, "CntR", buf);
+        snprintf(buf, VALUE_MAX, "%lld", (long long)time(0));
+        write_value(&device, "heartbeat", buf);
+    }
+    timer_pause();
+    datadir = NULL;
+}
+
+/* The archive update done by device_loop() for a CO2 reading, with a
+ * reading every two seconds. */
+static void
+bench_archive(unsigned long n)
+{
+    static struct archive *archive;
+    static time_t now = 1700000000;
+    if (!archive)
+    {
+        char filename[PATH_MAX + 16];
+        snprintf(filename, sizeof(filename), "%s/co2mon.rra", tmpdir);
+        archive = archive_open(filename);
+        if (!archive)
+        {
+            exit(1);
+        }
+    }
+    timer_resume();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        archive_add(archive, CODE_CNTR, 400 + (i % 1600), now += 2);
+    }
+    timer_pause();
+}
+
+/* The rolling statistics of a CO2 reading every two seconds, over three
+ * windows. */
+static void
+bench_rolling(unsigned long n)
+{
+    rolling_parse_windows("1m,5m,1h");
+    struct rolling *rolling = rolling_new();
+    timer_resume();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        rolling_add(rolling, CODE_CNTR, 400 + (i % 1600), (int64_t)(i + 1) * 2000000000);
+    }
+    timer_pause();
+    free(rolling);
+    rolling_windows_count = 0;
+}
+
+struct bench {
+    const char *name;
+    void (*run)(unsigned long n);
+};
+
+static const struct bench benches[] = {
+    { "decode/0x0100/batch", bench_decode_batch },
+    { "read_data/0x0100", bench_read_old },
+    { "read_data/0x0200", bench_read_new },
+    { "validate", bench_validate },
+    { "render_metrics/1", bench_render_1 },
+    { "render_metrics/8", bench_render_8 },
+    { "render_metrics/8/openmetrics", bench_render_openmetrics },
+    { "render_metrics/8/protobuf", bench_render_protobuf },
+    { "datadir/frame", bench_datadir },
+    { "archive/frame", bench_archive },
+    { "rolling/frame", bench_rolling },
+};
+
+static void
+run_bench(const struct bench *bench, double min_time)
+{
+    unsigned long n = 1;
+    while (1)
+    {
+        timer_ns = 0;
+        timer_allocations = 0;
+        bench->run(n);
+        if (timer_ns >= min_time * 1e9 || n >= (1UL << 40))
+        {
+            break;
+        }
+        // Aim a bit past the minimum time, growing at most 100 times.
+        double next = timer_ns > 0 ? min_time * 1.2e9 / timer_ns * n : n * 100.0;
+        n = next > n * 100.0 ? n * 100 : next < n + 1 ? n + 1 : (unsigned long)next;
+    }
+
+    printf("%-30s %12lu %12.1f", bench->name, n, (double)timer_ns / n);
+#ifdef __GLIBC__
+    printf(" %12.2f\n", (double)timer_allocations / n);
+#else
+    printf(" %12s\n", "-");
+#endif
+    fflush(stdout);
+}
+
+static void
+cleanup()
+{
+    char path[PATH_MAX + 16];
+    const char *files[] = { "old.cap", "new.cap", "CntR", "heartbeat", "co2mon.rra" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%s", tmpdir, files[i]);
+        unlink(path);
+    }
+    rmdir(tmpdir);
+}
+
+int main(int argc, char *argv[])
+{
+    double min_time = 0.5;
+
+    int c;
+    int opterr = 0;
+    int show_help = 0;
+    while ((c = getopt(argc, argv, ":ht:")) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            show_help = 1;
+            break;
+        case 't':
+            min_time = atof(optarg);
+            break;
+        case ':':
+            fprintf(stderr, "Option -%c requires an operand\n", optopt);
+            opterr++;
+            break;
+        case '?':
+            fprintf(stderr, "Unrecognized option: -%c\n", optopt);
+            opterr++;
+        }
+    }
+    if (show_help || opterr || min_time <= 0)
+    {
+        fprintf(stderr, "usage: co2mon_bench [-h] [-t seconds] [filter]...\n");
+        if (show_help)
+        {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  -h    show this help message\n");
+            fprintf(stderr, "  -t seconds\n");
+            fprintf(stderr, "        minimum time to run each benchmark (default 0.5)\n");
+            fprintf(stderr, "  filter\n");
+            fprintf(stderr, "        only run benchmarks whose name contains filter\n");
+            fprintf(stderr, "\n");
+        }
+        exit(1);
+    }
+
+    if (co2mon_init(-1) < 0)
+    {
+        return 1;
+    }
+    setup();
+
+    printf("%-30s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i)
+    {
+        int selected = optind == argc;
+        for (int a = optind; a < argc && !selected; ++a)
+        {
+            selected = strstr(benches[i].name, argv[a]) != NULL;
+        }
+        if (selected)
+        {
+            run_bench(&benches[i], min_time);
+        }
+    }
+
+    cleanup();
+    co2mon_exit();
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "co2mon.h"
+
+#define CODE_TAMB 0x42 /* Ambient Temperature */
+#define CODE_CNTR 0x50 /* Relative Concentration of CO2 */
+
+int raw_values = 0;
+
+static void
+print_record(const struct co2mon_log_record *record)
+{
+    long long seconds = record->time / 1000;
+    int millis = record->time % 1000;
+    if (millis < 0)
+    {
+        seconds--;
+        millis += 1000;
+    }
+
+    if (!raw_values && record->code == CODE_TAMB)
+    {
+        printf("%lld.%03d\tTamb\t%.4f\n", seconds, millis, (double)record->value * 0.0625 - 273.15);
+    }
+    else if (!raw_values && record->code == CODE_CNTR)
+    {
+        printf("%lld.%03d\tCntR\t%d\n", seconds, millis, (int)record->value);
+    }
+    else
+    {
+        printf("%lld.%03d\t0x%02hhx\t%d\n", seconds, millis, record->code, (int)record->value);
+    }
+}
+
+static int
+dump(const char *path)
+{
+    co2mon_log_reader reader = co2mon_log_reader_open(path);
+    if (!reader)
+    {
+        return 0;
+    }
+
+    struct co2mon_log_record record;
+    int r;
+    while ((r = co2mon_log_read(reader, &record)) > 0)
+    {
+        print_record(&record);
+    }
+    co2mon_log_reader_close(reader);
+
+    if (r < 0)
+    {
+        fprintf(stderr, "%s: corrupted block at the end of the log\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int opterr = 0;
+    int show_help = 0;
+    while ((c = getopt(argc, argv, ":hr")) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            show_help = 1;
+            break;
+        case 'r':
+            raw_values = 1;
+            break;
+        case '?':
+            fprintf(stderr, "Unrecognized option: -%c\n", optopt);
+            opterr++;
+        }
+    }
+    if (show_help || opterr || optind == argc)
+    {
+        fprintf(stderr, "usage: co2log [-hr] logfile...\n");
+        if (show_help)
+        {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Print the samples stored by co2mond -L as tab separated\n");
+            fprintf(stderr, "time (seconds since the Epoch), name and value.\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  -h    show this help message\n");
+            fprintf(stderr, "  -r    print raw values with hexadecimal codes\n");
+            fprintf(stderr, "\n");
+        }
+        exit(1);
+    }
+
+    int ok = 1;
+    for (int i = optind; i < argc; ++i)
+    {
+        ok &= dump(argv[i]);
+    }
+    return ok ? 0 : 1;
+}
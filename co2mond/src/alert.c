@@ -0,0 +1,784 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <err.h>
+
+#include "alert.h"
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "history.h"
+#include "stats.h"
+
+/*
+ * Threshold alerts.
+ *
+ * The device threads check every accepted reading against the rules. A
+ * rule fires once the reading has stayed beyond its threshold for the hold
+ * time, and resolves once it has stayed on the other side of the clear
+ * level for as long. Changes are handed to the hook thread in a table that
+ * keeps the latest change of each rule and device: a slow hook delays only
+ * the notifications behind it, a rate-limited one is sent when its
+ * interval is over, and a change that was undone in the meantime is not
+ * sent at all.
+ */
+
+enum hook_kind {
+    HOOK_NONE,
+    HOOK_EXEC,
+    HOOK_UNIX,
+    HOOK_HTTP,
+};
+
+struct alert_rule {
+    char name[64]; /* as given, without the options */
+    unsigned int code;
+    int above; /* > rather than < */
+    double threshold;
+    double clear;
+    int64_t hold_ns;
+    int64_t interval_ns;
+};
+
+/* Only used by the thread of the device, apart from firing. */
+struct alert_state {
+    int firing;
+    int64_t since_ns; /* when the reading crossed towards the other state, 0 if it has not */
+};
+
+struct alert_event {
+    int pending;
+    int firing;
+    double value;
+    int64_t time_ns; /* monotonic time of the reading */
+    int64_t time_ms; /* the same, since the Epoch */
+};
+
+/* Only used by the hook thread. */
+struct alert_delivery {
+    int notified; /* state sent by the last hook */
+    int64_t last_ns; /* when it was sent, 0 if never */
+};
+
+static struct alert_rule rules[ALERT_RULES_MAX];
+static int rules_count;
+static struct alert_state states[DEVICES_MAX][ALERT_RULES_MAX];
+
+static enum hook_kind hook_kind = HOOK_NONE;
+static const char *hook_target; /* command, socket path or request path */
+static const char *hook_host; /* Host header */
+static struct addrinfo *hook_address;
+
+static pthread_mutex_t events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t events_cond = PTHREAD_COND_INITIALIZER;
+static struct alert_event events[DEVICES_MAX][ALERT_RULES_MAX];
+static int events_pending;
+
+static uint64_t transitions_total;
+static uint64_t hooks_ok_total;
+static uint64_t hooks_failed_total;
+static uint64_t hooks_coalesced_total;
+
+static int
+parse_duration(const char *s, int64_t *ns)
+{
+    char *end;
+    double value = strtod(s, &end);
+    double unit;
+    if (strcmp(end, "ms") == 0)
+    {
+        unit = 1e6;
+    }
+    else if (strcmp(end, "s") == 0 || *end == '\0')
+    {
+        unit = 1e9;
+    }
+    else if (strcmp(end, "m") == 0)
+    {
+        unit = 60e9;
+    }
+    else if (strcmp(end, "h") == 0)
+    {
+        unit = 3600e9;
+    }
+    else
+    {
+        return 0;
+    }
+    if (end == s || value < 0 || value > 86400)
+    {
+        return 0;
+    }
+    *ns = value * unit;
+    return 1;
+}
+
+static int
+parse_number(const char *s, double *value)
+{
+    char *end;
+    *value = strtod(s, &end);
+    return end != s && *end == '\0';
+}
+
+// Parses s, which is modified, into rule.
+static int
+parse_rule(char *s, struct alert_rule *rule)
+{
+    char *save;
+    char *condition = strtok_r(s, ",", &save);
+    char *op = condition ? strpbrk(condition, "<>") : NULL;
+    if (!op)
+    {
+        return 0;
+    }
+    snprintf(rule->name, sizeof(rule->name), "%s", condition);
+    rule->above = *op == '>';
+    *op = '\0';
+    if (!history_parse_code(condition, &rule->code) || !parse_number(op + 1, &rule->threshold))
+    {
+        return 0;
+    }
+    rule->clear = rule->threshold;
+    rule->hold_ns = 0;
+    rule->interval_ns = (int64_t)ALERT_INTERVAL_DEFAULT_MS * 1000000;
+
+    for (char *option; (option = strtok_r(NULL, ",", &save)) != NULL; )
+    {
+        int ok;
+        if (strncmp(option, "clear=", 6) == 0)
+        {
+            ok = parse_number(option + 6, &rule->clear);
+        }
+        else if (strncmp(option, "hold=", 5) == 0)
+        {
+            ok = parse_duration(option + 5, &rule->hold_ns);
+        }
+        else if (strncmp(option, "every=", 6) == 0)
+        {
+            ok = parse_duration(option + 6, &rule->interval_ns);
+        }
+        else
+        {
+            ok = 0;
+        }
+        if (!ok)
+        {
+            return 0;
+        }
+    }
+
+    // The clear level must leave a gap, not overlap the threshold.
+    return rule->above ? rule->clear <= rule->threshold : rule->clear >= rule->threshold;
+}
+
+int
+alert_add_rule(const char *s)
+{
+    if (rules_count == ALERT_RULES_MAX)
+    {
+        fprintf(stderr, "Too many alert rules, at most %d are supported\n", ALERT_RULES_MAX);
+        return 0;
+    }
+
+    char *copy = strdup(s);
+    if (!copy)
+    {
+        err(EXIT_FAILURE, "strdup");
+    }
+    int ok = parse_rule(copy, &rules[rules_count]);
+    free(copy);
+    if (!ok)
+    {
+        fprintf(stderr, "Invalid alert rule: %s\n", s);
+        return 0;
+    }
+    rules_count++;
+    return 1;
+}
+
+int
+alert_set_hook(const char *hook)
+{
+    if (strncmp(hook, "exec:", 5) == 0 && hook[5])
+    {
+        hook_kind = HOOK_EXEC;
+        hook_target = hook + 5;
+        return 1;
+    }
+
+    if (strncmp(hook, "unix:", 5) == 0 && hook[5])
+    {
+        struct sockaddr_un addr;
+        if (strlen(hook + 5) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "%s: path too long\n", hook);
+            return 0;
+        }
+        hook_kind = HOOK_UNIX;
+        hook_target = hook + 5;
+    }
+    else if (strncmp(hook, "http://", 7) == 0)
+    {
+        const char *rest = hook + 7;
+        const char *slash = strchr(rest, '/');
+        char *host = slash ? strndup(rest, slash - rest) : strdup(rest);
+        if (!host)
+        {
+            err(EXIT_FAILURE, "strdup");
+        }
+        hook_host = strdup(host);
+        hook_target = slash ? slash : "/";
+
+        const char *port = "80";
+        char *colon = strrchr(host, ':');
+        if (colon && !strchr(colon, ']'))
+        {
+            *colon = '\0';
+            port = colon + 1;
+        }
+        size_t hlen = strlen(host);
+        char *name = host;
+        if (name[0] == '[' && hlen > 1 && name[hlen - 1] == ']')
+        {
+            name[hlen - 1] = '\0';
+            name++;
+        }
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+
+        int gai_errno = getaddrinfo(name, port, &hints, &hook_address);
+        free(host);
+        if (gai_errno != 0)
+        {
+            fprintf(stderr, "getaddrinfo(%s): %s\n", hook, gai_strerror(gai_errno));
+            return 0;
+        }
+        hook_kind = HOOK_HTTP;
+    }
+    else
+    {
+        fprintf(stderr, "%s: expected exec:command, unix:path or http://host:port/path\n", hook);
+        return 0;
+    }
+
+    // A listener that goes away must not kill the daemon.
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE, SIG_IGN)");
+        return 0;
+    }
+    return 1;
+}
+
+void
+alert_reading(const struct device *device, unsigned char code, uint16_t w, int64_t time_ns, int64_t time_ms)
+{
+    const int d = device - devices;
+    const double value = code == CODE_TAMB ? decode_temperature(w) : w;
+
+    for (int i = 0; i < rules_count; ++i)
+    {
+        const struct alert_rule *rule = &rules[i];
+        struct alert_state *state = &states[d][i];
+        if (rule->code != code)
+        {
+            continue;
+        }
+
+        int crossed = state->firing ?
+            (rule->above ? value <= rule->clear : value >= rule->clear) :
+            (rule->above ? value > rule->threshold : value < rule->threshold);
+        if (!crossed)
+        {
+            state->since_ns = 0;
+            continue;
+        }
+        if (!state->since_ns)
+        {
+            state->since_ns = time_ns;
+        }
+        if (time_ns - state->since_ns < rule->hold_ns)
+        {
+            continue;
+        }
+
+        const int firing = !state->firing;
+        state->since_ns = 0;
+        __atomic_store_n(&state->firing, firing, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&transitions_total, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Alert %s %s%s%s (%g)\n", rule->name, firing ? "firing" : "resolved",
+            multi_device ? " on " : "", multi_device ? device->name : "", value);
+
+        if (hook_kind == HOOK_NONE)
+        {
+            continue;
+        }
+
+        if (pthread_mutex_lock(&events_mutex) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_mutex_lock");
+        }
+        struct alert_event *event = &events[d][i];
+        if (event->pending)
+        {
+            __atomic_add_fetch(&hooks_coalesced_total, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            events_pending++;
+        }
+        event->pending = 1;
+        event->firing = firing;
+        event->value = value;
+        event->time_ns = time_ns;
+        event->time_ms = time_ms;
+        if (pthread_cond_signal(&events_cond) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_cond_signal");
+        }
+        if (pthread_mutex_unlock(&events_mutex) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_mutex_unlock");
+        }
+    }
+}
+
+static void
+set_timeouts(int fd)
+{
+    struct timeval tv;
+    tv.tv_sec = ALERT_HOOK_TIMEOUT_MS / 1000;
+    tv.tv_usec = (ALERT_HOOK_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int
+send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+extern char **environ;
+
+// Runs the command with the alert in CO2MON_* variables, and waits for it
+// for at most ALERT_HOOK_TIMEOUT_MS.
+static int
+run_command(const struct alert_rule *rule, const char *device, const struct alert_event *event)
+{
+    char vars[5][DEVICE_PATH_MAX + 16];
+    snprintf(vars[0], sizeof(vars[0]), "CO2MON_RULE=%s", rule->name);
+    snprintf(vars[1], sizeof(vars[1]), "CO2MON_STATE=%s", event->firing ? "firing" : "resolved");
+    snprintf(vars[2], sizeof(vars[2]), "CO2MON_DEVICE=%s", device);
+    snprintf(vars[3], sizeof(vars[3]), "CO2MON_VALUE=%g", event->value);
+    snprintf(vars[4], sizeof(vars[4]), "CO2MON_TIME=%lld.%03d", (long long)(event->time_ms / 1000), (int)(event->time_ms % 1000));
+
+    // Built before fork(), the child may only exec.
+    int n = 0;
+    while (environ[n])
+    {
+        n++;
+    }
+    char **envp = malloc((n + 6) * sizeof(envp[0]));
+    if (!envp)
+    {
+        perror("malloc");
+        return 0;
+    }
+    int k = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (strncmp(environ[i], "CO2MON_", 7) != 0)
+        {
+            envp[k++] = environ[i];
+        }
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        envp[k++] = vars[i];
+    }
+    envp[k] = NULL;
+
+    char *argv[] = { "sh", "-c", (char *)hook_target, NULL };
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // co2mond blocks SIGTERM and SIGINT in its threads, see log_start().
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve("/bin/sh", argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    if (pid == -1)
+    {
+        perror("fork");
+        return 0;
+    }
+
+    const int64_t deadline = monotonic_ns() + (int64_t)ALERT_HOOK_TIMEOUT_MS * 1000000;
+    int status;
+    while (1)
+    {
+        pid_t r = waitpid(pid, &status, WNOHANG);
+        if (r == pid)
+        {
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (r == -1 && errno != EINTR)
+        {
+            perror("waitpid");
+            return 0;
+        }
+        if (monotonic_ns() > deadline)
+        {
+            fprintf(stderr, "Alert hook timed out: %s\n", hook_target);
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return 0;
+        }
+        struct timespec ts = { 0, 5000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Sends the body as one datagram, or as a line on a stream socket.
+static int
+send_unix(const struct buf *body)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, hook_target, sizeof(addr.sun_path) - 1);
+
+    const int types[] = { SOCK_DGRAM, SOCK_STREAM };
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); ++t)
+    {
+        int fd = socket(AF_UNIX, types[t], 0);
+        if (fd == -1)
+        {
+            perror("socket");
+            return 0;
+        }
+        set_timeouts(fd);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            int saved = errno;
+            close(fd);
+            if (saved == EPROTOTYPE)
+            {
+                continue;
+            }
+            return 0;
+        }
+        int ok = send_all(fd, body->data, body->len);
+        close(fd);
+        return ok;
+    }
+    return 0;
+}
+
+// POSTs the body and accepts any 2xx response.
+static int
+post_http(const struct buf *body)
+{
+    int fd = -1;
+    for (struct addrinfo *ai = hook_address; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        set_timeouts(fd);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1)
+    {
+        return 0;
+    }
+
+    struct buf request = { 0 };
+    buf_printf(&request,
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "User-Agent: co2mond\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        hook_target, hook_host, body->len);
+    buf_append(&request, body->data, body->len);
+    int ok = send_all(fd, request.data, request.len);
+    buf_free(&request);
+
+    char status[16];
+    size_t len = 0;
+    while (ok && len < 12)
+    {
+        ssize_t n = recv(fd, status + len, 12 - len, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    return ok && len == 12 && strncmp(status, "HTTP/1.", 7) == 0 && status[9] == '2';
+}
+
+static void
+deliver(int d, int i, const struct alert_event *event)
+{
+    const struct alert_rule *rule = &rules[i];
+    // Names never change once the device is listed.
+    const char *device = devices[d].name;
+
+    struct buf body = { 0 };
+    buf_printf(&body, "{\"rule\":\"%s\",\"state\":\"%s\",\"device\":\"%s\",\"value\":%g,\"time\":%lld.%03d}\n",
+        rule->name, event->firing ? "firing" : "resolved", device, event->value,
+        (long long)(event->time_ms / 1000), (int)(event->time_ms % 1000));
+
+    int ok = 0;
+    switch (hook_kind)
+    {
+    case HOOK_EXEC:
+        ok = run_command(rule, device, event);
+        break;
+    case HOOK_UNIX:
+        ok = send_unix(&body);
+        break;
+    case HOOK_HTTP:
+        ok = post_http(&body);
+        break;
+    case HOOK_NONE:
+        break;
+    }
+    buf_free(&body);
+
+    histogram_observe(&alert_hook_latency_histogram, monotonic_ns() - event->time_ns);
+    if (ok)
+    {
+        __atomic_add_fetch(&hooks_ok_total, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&hooks_failed_total, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Alert hook failed for %s\n", rule->name);
+    }
+}
+
+static void *
+alert_thread(void *arg)
+{
+    (void)arg;
+    static struct alert_delivery deliveries[DEVICES_MAX][ALERT_RULES_MAX];
+
+    if (pthread_mutex_lock(&events_mutex) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_mutex_lock");
+    }
+    while (1)
+    {
+        const int64_t now = monotonic_ns();
+        int64_t wake_ns = 0; // when the next rate-limited change is due
+        int found_d = -1, found_i = -1;
+        struct alert_event event;
+
+        for (int d = 0; d < DEVICES_MAX && events_pending && found_d < 0; ++d)
+        {
+            for (int i = 0; i < rules_count; ++i)
+            {
+                struct alert_event *pending = &events[d][i];
+                struct alert_delivery *delivery = &deliveries[d][i];
+                if (!pending->pending)
+                {
+                    continue;
+                }
+                if (pending->firing == delivery->notified)
+                {
+                    // Undone before it could be sent.
+                    pending->pending = 0;
+                    events_pending--;
+                    __atomic_add_fetch(&hooks_coalesced_total, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                const int64_t due = delivery->last_ns ? delivery->last_ns + rules[i].interval_ns : now;
+                if (due <= now)
+                {
+                    event = *pending;
+                    pending->pending = 0;
+                    events_pending--;
+                    found_d = d;
+                    found_i = i;
+                    break;
+                }
+                if (!wake_ns || due < wake_ns)
+                {
+                    wake_ns = due;
+                }
+            }
+        }
+
+        if (found_d >= 0)
+        {
+            if (pthread_mutex_unlock(&events_mutex) != 0)
+            {
+                err(EXIT_FAILURE, "pthread_mutex_unlock");
+            }
+            deliver(found_d, found_i, &event);
+            deliveries[found_d][found_i].notified = event.firing;
+            deliveries[found_d][found_i].last_ns = monotonic_ns();
+            if (pthread_mutex_lock(&events_mutex) != 0)
+            {
+                err(EXIT_FAILURE, "pthread_mutex_lock");
+            }
+            continue;
+        }
+
+        if (wake_ns)
+        {
+            // The condition variable uses CLOCK_REALTIME.
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            int64_t until = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + (wake_ns - now);
+            ts.tv_sec = until / 1000000000;
+            ts.tv_nsec = until % 1000000000;
+            int r = pthread_cond_timedwait(&events_cond, &events_mutex, &ts);
+            if (r != 0 && r != ETIMEDOUT)
+            {
+                errno = r;
+                err(EXIT_FAILURE, "pthread_cond_timedwait");
+            }
+        }
+        else if (pthread_cond_wait(&events_cond, &events_mutex) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_cond_wait");
+        }
+    }
+    return NULL;
+}
+
+void
+alert_start()
+{
+    if (!rules_count || hook_kind == HOOK_NONE)
+    {
+        return;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, alert_thread, NULL) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    if (pthread_detach(tid) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_detach");
+    }
+}
+
+void
+render_alert_stats(struct expo *e, int count)
+{
+    static const struct expo_label ok = { "result", "ok" };
+    static const struct expo_label failed = { "result", "failed" };
+    static const struct expo_label coalesced = { "result", "coalesced" };
+
+    if (!rules_count)
+    {
+        return;
+    }
+
+    expo_family(e, "co2mon_alert_firing", "Whether an alert rule is firing.", EXPO_GAUGE);
+    for (int d = 0; d < count; ++d)
+    {
+        for (int i = 0; i < rules_count; ++i)
+        {
+            struct expo_label labels[2];
+            int n = 0;
+            if (multi_device)
+            {
+                labels[n].name = "device";
+                labels[n].value = devices[d].name;
+                n++;
+            }
+            labels[n].name = "rule";
+            labels[n].value = rules[i].name;
+            n++;
+            expo_sample(e, labels, n, __atomic_load_n(&states[d][i].firing, __ATOMIC_RELAXED), 0);
+        }
+    }
+
+    expo_family(e, "co2mon_alert_transitions_total", "Alert rules that started firing or resolved.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&transitions_total, __ATOMIC_RELAXED), 0);
+
+    if (hook_kind == HOOK_NONE)
+    {
+        return;
+    }
+    expo_family(e, "co2mon_alert_hooks_total", "Alert changes by what became of their hook.", EXPO_COUNTER);
+    expo_sample(e, &ok, 1, __atomic_load_n(&hooks_ok_total, __ATOMIC_RELAXED), 0);
+    expo_sample(e, &failed, 1, __atomic_load_n(&hooks_failed_total, __ATOMIC_RELAXED), 0);
+    expo_sample(e, &coalesced, 1, __atomic_load_n(&hooks_coalesced_total, __ATOMIC_RELAXED), 0);
+}
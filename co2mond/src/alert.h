@@ -0,0 +1,53 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ALERT_H_INCLUDED_
+#define ALERT_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "co2mond.h"
+#include "expo.h"
+
+#define ALERT_RULES_MAX 16
+#define ALERT_INTERVAL_DEFAULT_MS 10000 /* between two hooks of a rule and device */
+#define ALERT_HOOK_TIMEOUT_MS 5000
+
+/* Parses a rule such as co2>1200,clear=1000,hold=30s,every=1m. The key is
+ * co2, temp or a code such as x6d, the threshold is in ppm or degrees
+ * Celsius. Returns 0 on error. */
+extern int
+alert_add_rule(const char *rule);
+
+/* Parses a hook: exec:command, unix:path or http://host[:port]/path.
+ * Returns 0 on error. */
+extern int
+alert_set_hook(const char *hook);
+
+/* Starts the thread that runs the hooks, if there are rules. */
+extern void
+alert_start();
+
+/* Checks an accepted reading against the rules. Only called by the thread
+ * of the device, never blocks on a hook. */
+extern void
+alert_reading(const struct device *device, unsigned char code, uint16_t value, int64_t time_ns, int64_t time_ms);
+
+extern void
+render_alert_stats(struct expo *e, int count);
+
+#endif
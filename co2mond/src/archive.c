@@ -0,0 +1,687 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 700 /* ftruncate, pread */
+
+#include <err.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "buf.h"
+#include "co2mond.h"
+#include "http.h"
+
+#define ARCHIVE_VERSION 1
+#define DUMP_ATTEMPTS 100 /* renderings that raced with a reading, before giving up */
+
+static const char archive_magic[8] = { 'C', 'O', '2', 'R', 'R', 'A', 0, 0 };
+
+enum archive_cf {
+    CF_AVERAGE,
+    CF_MIN,
+    CF_MAX,
+    CF_LAST,
+    CFS,
+};
+
+static const char *cf_names[CFS] = { "AVERAGE", "MIN", "MAX", "LAST" };
+
+static const struct {
+    unsigned int code;
+    const char *name;
+} sources[ARCHIVE_DS] = {
+    { CODE_CNTR, "CO2" },
+    { CODE_TAMB, "TEMP" },
+    { 0x6d, "x6d" },
+    { 0x56, "x56" },
+};
+
+struct archive_rra {
+    uint32_t cf;
+    uint32_t pdp_per_row;
+    uint32_t rows;
+    uint32_t cur_row; /* the newest row */
+    double xff;
+    uint64_t offset; /* of the rows, from the start of the file */
+    double cdp[ARCHIVE_DS]; /* the row being consolidated, NaN until a value is known */
+    uint32_t cdp_known[ARCHIVE_DS];
+};
+
+/* The file starts with the header, followed by the rows of each archive,
+ * oldest first from cur_row + 1, as ARCHIVE_DS doubles. */
+struct archive_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t seq; /* odd while the device thread updates the archive */
+    uint32_t step;
+    uint32_t rra_count;
+    int64_t last_update; /* end of the last primary data point, 0 before the first reading */
+    double pdp_sum[ARCHIVE_DS];
+    uint32_t pdp_count[ARCHIVE_DS];
+    double last_value[ARCHIVE_DS];
+    int64_t last_time[ARCHIVE_DS];
+    struct archive_rra rras[ARCHIVE_RRAS_MAX];
+};
+
+struct archive {
+    struct archive_header *header;
+    size_t size;
+    int dump_wanted; /* guarded by dump_mutex */
+    struct http_blob *dump_ready; /* rendered by dump_thread, guarded by dump_mutex */
+    unsigned int dump_ready_seq;
+    struct http_blob *dump; /* served by the HTTP thread, which alone touches it */
+    unsigned int dump_seq;
+};
+
+/* The dump takes tens of milliseconds to render, too long for the HTTP
+ * thread; dump_thread renders it on request. */
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+
+static struct archive_header config;
+
+int
+archive_parse(const char *spec)
+{
+    memset(&config, 0, sizeof(config));
+    config.step = 5;
+
+    char *copy = strdup(spec);
+    if (!copy)
+    {
+        err(EXIT_FAILURE, "strdup");
+    }
+    int ok = 1;
+    char *save;
+    for (char *item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save))
+    {
+        char *end;
+        if (strncmp(item, "step=", 5) == 0)
+        {
+            long step = strtol(item + 5, &end, 10);
+            ok = end != item + 5 && *end == '\0' && step > 0 && step <= 86400;
+            config.step = step;
+            continue;
+        }
+        if (config.rra_count == ARCHIVE_RRAS_MAX)
+        {
+            fprintf(stderr, "Too many archives, at most %d are supported\n", ARCHIVE_RRAS_MAX);
+            ok = 0;
+            break;
+        }
+
+        struct archive_rra *rra = &config.rras[config.rra_count++];
+        char *colon = strchr(item, ':');
+        ok = colon != NULL;
+        if (!ok)
+        {
+            break;
+        }
+        *colon = '\0';
+        rra->cf = CFS;
+        for (int cf = 0; cf < CFS; ++cf)
+        {
+            if (strcasecmp(item, cf_names[cf]) == 0)
+            {
+                rra->cf = cf;
+            }
+        }
+        rra->xff = strtod(colon + 1, &end);
+        ok = rra->cf != CFS && end != colon + 1 && *end == ':' && rra->xff >= 0 && rra->xff < 1;
+        if (!ok)
+        {
+            break;
+        }
+        unsigned long steps = strtoul(end + 1, &end, 10);
+        ok = *end == ':' && steps > 0 && steps <= 1000000;
+        if (!ok)
+        {
+            break;
+        }
+        unsigned long rows = strtoul(end + 1, &end, 10);
+        ok = *end == '\0' && rows > 0 && rows <= 10000000;
+        rra->pdp_per_row = steps;
+        rra->rows = rows;
+    }
+    free(copy);
+
+    if (!ok || !config.rra_count)
+    {
+        fprintf(stderr, "Invalid archives: %s\n", spec);
+        return 0;
+    }
+    return 1;
+}
+
+static double *
+row(struct archive_header *header, const struct archive_rra *rra, uint32_t index)
+{
+    return (double *)((char *)header + rra->offset) + (size_t)index * ARCHIVE_DS;
+}
+
+static void
+reset(struct archive_header *header)
+{
+    for (uint32_t r = 0; r < header->rra_count; ++r)
+    {
+        struct archive_rra *rra = &header->rras[r];
+        for (uint32_t i = 0; i < rra->rows; ++i)
+        {
+            double *values = row(header, rra, i);
+            for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+            {
+                values[ds] = NAN;
+            }
+        }
+        rra->cur_row = 0;
+        for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+        {
+            rra->cdp[ds] = NAN;
+            rra->cdp_known[ds] = 0;
+        }
+    }
+    for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+    {
+        header->pdp_sum[ds] = 0;
+        header->pdp_count[ds] = 0;
+        header->last_value[ds] = NAN;
+        header->last_time[ds] = 0;
+    }
+    header->last_update = 0;
+}
+
+// Whether the file was made with the same step and archives.
+static int
+matches(const struct archive_header *header)
+{
+    if (memcmp(header->magic, archive_magic, sizeof(archive_magic)) != 0 ||
+        header->version != ARCHIVE_VERSION || header->step != config.step ||
+        header->rra_count != config.rra_count)
+    {
+        return 0;
+    }
+    for (uint32_t r = 0; r < config.rra_count; ++r)
+    {
+        const struct archive_rra *a = &header->rras[r];
+        const struct archive_rra *b = &config.rras[r];
+        if (a->cf != b->cf || a->pdp_per_row != b->pdp_per_row || a->rows != b->rows ||
+            a->xff != b->xff || a->offset != b->offset || a->cur_row >= a->rows)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+struct archive *
+archive_open(const char *path)
+{
+    if (!config.rra_count && !archive_parse(ARCHIVE_DEFAULT))
+    {
+        return NULL;
+    }
+
+    size_t size = sizeof(struct archive_header);
+    for (uint32_t r = 0; r < config.rra_count; ++r)
+    {
+        config.rras[r].offset = size;
+        size += (size_t)config.rras[r].rows * ARCHIVE_DS * sizeof(double);
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    struct archive_header existing;
+    struct stat st;
+    int keep = fstat(fd, &st) == 0 && st.st_size == (off_t)size &&
+        pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+        matches(&existing);
+    if (!keep && st.st_size > 0)
+    {
+        fprintf(stderr, "%s: does not match the archives, starting over\n", path);
+    }
+    if (!keep && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0))
+    {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    struct archive *archive = calloc(1, sizeof(*archive));
+    if (!archive)
+    {
+        err(EXIT_FAILURE, "calloc");
+    }
+    archive->header = addr;
+    archive->size = size;
+
+    struct archive_header *header = archive->header;
+    if (keep)
+    {
+        // A crash in the middle of an update leaves the sequence odd.
+        header->seq &= ~1u;
+        return archive;
+    }
+    memcpy(header, &config, sizeof(*header));
+    header->version = ARCHIVE_VERSION;
+    reset(header);
+    memcpy(header->magic, archive_magic, sizeof(archive_magic));
+    return archive;
+}
+
+static void
+consolidate(struct archive_header *header, struct archive_rra *rra, const double *pdp, int64_t end)
+{
+    for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+    {
+        const double v = pdp[ds];
+        double *cdp = &rra->cdp[ds];
+        if (isnan(v))
+        {
+            continue;
+        }
+        if (!rra->cdp_known[ds]++)
+        {
+            *cdp = v;
+        }
+        else if (rra->cf == CF_AVERAGE)
+        {
+            *cdp += v;
+        }
+        else if (rra->cf == CF_MIN ? v < *cdp : rra->cf == CF_MAX ? v > *cdp : 1)
+        {
+            *cdp = v;
+        }
+    }
+
+    // Rows end on multiples of their length, as in rrdtool.
+    if (end % ((int64_t)header->step * rra->pdp_per_row) != 0)
+    {
+        return;
+    }
+    rra->cur_row = (rra->cur_row + 1) % rra->rows;
+    double *values = row(header, rra, rra->cur_row);
+    for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+    {
+        const uint32_t known = rra->cdp_known[ds];
+        if (!known || rra->pdp_per_row - known > rra->xff * rra->pdp_per_row)
+        {
+            values[ds] = NAN;
+        }
+        else
+        {
+            values[ds] = rra->cf == CF_AVERAGE ? rra->cdp[ds] / known : rra->cdp[ds];
+        }
+        rra->cdp[ds] = NAN;
+        rra->cdp_known[ds] = 0;
+    }
+}
+
+// Closes the primary data points that end at or before now.
+static void
+advance(struct archive_header *header, int64_t now)
+{
+    const int64_t step = header->step;
+    const int64_t boundary = now - now % step;
+    if (!header->last_update)
+    {
+        header->last_update = boundary;
+        return;
+    }
+    if (boundary <= header->last_update)
+    {
+        return;
+    }
+
+    // After a long gap, nothing that is kept would be known.
+    int64_t span = 0;
+    for (uint32_t r = 0; r < header->rra_count; ++r)
+    {
+        int64_t rra_span = step * header->rras[r].pdp_per_row * header->rras[r].rows;
+        span = rra_span > span ? rra_span : span;
+    }
+    if (boundary - header->last_update > span + ARCHIVE_HEARTBEAT)
+    {
+        reset(header);
+        header->last_update = boundary;
+        return;
+    }
+
+    while (header->last_update < boundary)
+    {
+        const int64_t end = header->last_update + step;
+        double pdp[ARCHIVE_DS];
+        for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+        {
+            if (header->pdp_count[ds])
+            {
+                pdp[ds] = header->pdp_sum[ds] / header->pdp_count[ds];
+            }
+            else if (header->last_time[ds] && end - header->last_time[ds] <= ARCHIVE_HEARTBEAT)
+            {
+                pdp[ds] = header->last_value[ds];
+            }
+            else
+            {
+                pdp[ds] = NAN;
+            }
+            header->pdp_sum[ds] = 0;
+            header->pdp_count[ds] = 0;
+        }
+        for (uint32_t r = 0; r < header->rra_count; ++r)
+        {
+            consolidate(header, &header->rras[r], pdp, end);
+        }
+        header->last_update = end;
+    }
+}
+
+void
+archive_add(struct archive *archive, unsigned int code, uint16_t value, time_t now)
+{
+    int ds = 0;
+    while (ds < ARCHIVE_DS && sources[ds].code != code)
+    {
+        ds++;
+    }
+    if (!archive || ds == ARCHIVE_DS)
+    {
+        return;
+    }
+
+    struct archive_header *header = archive->header;
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    advance(header, now);
+    const double v = code == CODE_TAMB ? decode_temperature(value) : value;
+    header->pdp_sum[ds] += v;
+    header->pdp_count[ds]++;
+    header->last_value[ds] = v;
+    header->last_time[ds] = now;
+
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+put_value(struct buf *out, double v)
+{
+    if (isnan(v))
+    {
+        buf_puts(out, "NaN");
+    }
+    else
+    {
+        buf_printf(out, "%.10e", v);
+    }
+}
+
+// Renders the archive as rrdtool dump XML, so that rrdtool restore turns
+// it into the graph.rrd of graph/rrd.
+static void
+dump(const struct archive_header *header, struct buf *out)
+{
+    buf_printf(out,
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<!DOCTYPE rrd SYSTEM \"http://oss.oetiker.ch/rrdtool/rrdtool.dtd\">\n"
+        "<rrd>\n"
+        "\t<version>0003</version>\n"
+        "\t<step>%u</step>\n"
+        "\t<lastupdate>%lld</lastupdate>\n",
+        header->step, (long long)header->last_update);
+    for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+    {
+        buf_printf(out,
+            "\t<ds>\n"
+            "\t\t<name> %s </name>\n"
+            "\t\t<type> GAUGE </type>\n"
+            "\t\t<minimal_heartbeat>%d</minimal_heartbeat>\n"
+            "\t\t<min>NaN</min>\n"
+            "\t\t<max>NaN</max>\n"
+            "\t\t<last_ds>U</last_ds>\n"
+            "\t\t<value>0.0000000000e+00</value>\n"
+            "\t\t<unknown_sec> 0 </unknown_sec>\n"
+            "\t</ds>\n",
+            sources[ds].name, ARCHIVE_HEARTBEAT);
+    }
+    for (uint32_t r = 0; r < header->rra_count; ++r)
+    {
+        const struct archive_rra *rra = &header->rras[r];
+        const int64_t length = (int64_t)header->step * rra->pdp_per_row;
+        buf_printf(out,
+            "\t<rra>\n"
+            "\t\t<cf>%s</cf>\n"
+            "\t\t<pdp_per_row>%u</pdp_per_row>\n"
+            "\t\t<params>\n"
+            "\t\t<xff>",
+            cf_names[rra->cf < CFS ? rra->cf : CF_AVERAGE], rra->pdp_per_row);
+        put_value(out, rra->xff);
+        buf_puts(out, "</xff>\n\t\t</params>\n\t\t<cdp_prep>\n");
+        for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+        {
+            buf_puts(out,
+                "\t\t\t<ds>\n"
+                "\t\t\t<primary_value>NaN</primary_value>\n"
+                "\t\t\t<secondary_value>NaN</secondary_value>\n"
+                "\t\t\t<value>NaN</value>\n"
+                "\t\t\t<unknown_datapoints>0</unknown_datapoints>\n"
+                "\t\t\t</ds>\n");
+        }
+        buf_puts(out, "\t\t</cdp_prep>\n\t\t<database>\n");
+        const int64_t newest = header->last_update - header->last_update % length;
+        for (uint32_t i = 1; i <= rra->rows; ++i)
+        {
+            const uint32_t index = (rra->cur_row + i) % rra->rows;
+            const double *values = (const double *)((const char *)header + rra->offset) + (size_t)index * ARCHIVE_DS;
+            buf_printf(out, "\t\t\t<!-- %lld --> <row>", (long long)(newest - (int64_t)(rra->rows - i) * length));
+            for (int ds = 0; ds < ARCHIVE_DS; ++ds)
+            {
+                buf_puts(out, "<v>");
+                put_value(out, values[ds]);
+                buf_puts(out, "</v>");
+            }
+            buf_puts(out, "</row>\n");
+        }
+        buf_puts(out, "\t\t</database>\n\t</rra>\n");
+    }
+    buf_puts(out, "</rrd>\n");
+}
+
+// Returns NULL if every attempt raced with a reading. The device thread
+// does not wait for the dump, which is rendered again if a reading came in
+// meanwhile.
+static struct http_blob *
+render_dump(const struct archive_header *header, unsigned int *seq)
+{
+    static struct buf out; // dump_thread only
+    int attempts = 0;
+    while (attempts < DUMP_ATTEMPTS)
+    {
+        unsigned int seq0 = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+        if (seq0 & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        out.len = 0;
+        dump(header, &out);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq0)
+        {
+            *seq = seq0;
+            return http_blob_new(out.data, out.len);
+        }
+        attempts++;
+    }
+    return NULL;
+}
+
+// A new blob is only handed over; the HTTP thread takes it, so that the
+// reference counts stay in that thread.
+static void*
+dump_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&dump_mutex);
+    while (1)
+    {
+        int count;
+        devices_lock();
+        count = devices_count;
+        devices_unlock();
+
+        struct archive *archive = NULL;
+        for (int d = 0; d < count && !archive; ++d)
+        {
+            if (devices[d].archive && devices[d].archive->dump_wanted)
+            {
+                archive = devices[d].archive;
+            }
+        }
+        if (!archive)
+        {
+            pthread_cond_wait(&dump_cond, &dump_mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&dump_mutex);
+        unsigned int seq = 0;
+        struct http_blob *blob = render_dump(archive->header, &seq);
+        pthread_mutex_lock(&dump_mutex);
+
+        archive->dump_wanted = 0;
+        if (blob)
+        {
+            // Not taken yet, so no other thread holds a reference.
+            if (archive->dump_ready)
+            {
+                http_blob_unref(archive->dump_ready);
+            }
+            archive->dump_ready = blob;
+            archive->dump_ready_seq = seq;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * GET /archive[?device=<name>]
+ *
+ * The archive of a device as rrdtool dump XML, for rrdtool restore. The
+ * last rendered dump is served while a newer one is rendered, it lags
+ * behind the readings by the time between two requests at most. The
+ * first request only starts the rendering and is answered with 503.
+ */
+void
+archive_handler(const struct http_request *req, struct http_response *resp)
+{
+    char param[DEVICE_PATH_MAX];
+    struct device *device = NULL;
+    int count;
+    devices_lock();
+    count = devices_count;
+    devices_unlock();
+    if (http_query_param(req, "device", param, sizeof(param)))
+    {
+        for (int d = 0; d < count; ++d)
+        {
+            if (strcmp(devices[d].name, param) == 0)
+            {
+                device = &devices[d];
+                break;
+            }
+        }
+    }
+    else if (count > 0)
+    {
+        device = &devices[0];
+    }
+    if (!device || !device->archive)
+    {
+        resp->status = 404;
+        buf_puts(&resp->body, device ? "No archive, use -R.\r\n" : "Unknown device.\r\n");
+        return;
+    }
+
+    static int started; // only used by the HTTP thread
+    if (!started)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, dump_thread, NULL) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_create");
+        }
+
+        if (pthread_detach(tid) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_detach");
+        }
+        started = 1;
+    }
+
+    struct archive *archive = device->archive;
+    pthread_mutex_lock(&dump_mutex);
+    if (archive->dump_ready)
+    {
+        if (archive->dump)
+        {
+            http_blob_unref(archive->dump);
+        }
+        archive->dump = archive->dump_ready;
+        archive->dump_seq = archive->dump_ready_seq;
+        archive->dump_ready = NULL;
+    }
+    if ((!archive->dump || archive->dump_seq != __atomic_load_n(&archive->header->seq, __ATOMIC_ACQUIRE)) &&
+        !archive->dump_wanted)
+    {
+        archive->dump_wanted = 1;
+        pthread_cond_signal(&dump_cond);
+    }
+    pthread_mutex_unlock(&dump_mutex);
+
+    if (!archive->dump)
+    {
+        resp->status = 503;
+        buf_puts(&resp->headers, "Retry-After: 1\r\n");
+        buf_puts(&resp->body, "Archive is being rendered.\r\n");
+        return;
+    }
+    resp->content_type = "application/xml";
+    resp->blob = http_blob_ref(archive->dump);
+}
@@ -0,0 +1,63 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ARCHIVE_H_INCLUDED_
+#define ARCHIVE_H_INCLUDED_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+/*
+ * Round-robin archive of the readings, in the manner of rrdtool, kept in
+ * one memory-mapped file per device and updated by the device thread.
+ *
+ * Every step, the readings of each data source are averaged into a
+ * primary data point; a step without readings repeats the last one if it
+ * is at most ARCHIVE_HEARTBEAT seconds old, and is unknown otherwise.
+ * Each archive consolidates a number of primary data points into a row
+ * with AVERAGE, MIN, MAX or LAST, and keeps a fixed number of rows. The
+ * data sources are those of graph/rrd: CO2, TEMP, x6d and x56.
+ */
+
+#define ARCHIVE_DS 4
+#define ARCHIVE_RRAS_MAX 8
+#define ARCHIVE_HEARTBEAT 60
+/* As graph/rrd/Makefile: 5 s steps for a day, and minutes for 30 days. */
+#define ARCHIVE_DEFAULT "step=5,AVERAGE:0:1:17280,AVERAGE:0.5:12:43200"
+
+struct archive;
+
+/* Parses the step and the archives, e.g. step=5,AVERAGE:0.5:12:43200,
+ * MAX:0.5:12:43200 (consolidation function, xff, steps per row, rows).
+ * Returns 0 on error. */
+extern int
+archive_parse(const char *spec);
+
+/* Maps the archive file, creating it or starting it over if it does not
+ * match the configuration. Returns NULL on error. */
+extern struct archive *
+archive_open(const char *path);
+
+extern void
+archive_add(struct archive *archive, unsigned int code, uint16_t value, time_t now);
+
+extern void
+archive_handler(const struct http_request *req, struct http_response *resp);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BUF_H_INCLUDED_
+#define BUF_H_INCLUDED_
+
+#include <stddef.h>
+
+/* Growable byte buffer used to assemble responses. */
+struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+extern void
+buf_reserve(struct buf *b, size_t len);
+
+extern void
+buf_append(struct buf *b, const void *data, size_t len);
+
+extern void
+buf_puts(struct buf *b, const char *s);
+
+extern void
+buf_printf(struct buf *b, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+extern void
+buf_consume(struct buf *b, size_t len);
+
+extern void
+buf_free(struct buf *b);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MOND_H_INCLUDED_
+#define CO2MOND_H_INCLUDED_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "co2mon.h"
+
+#define CODE_TAMB 0x42 /* Ambient Temperature */
+#define CODE_CNTR 0x50 /* Relative Concentration of CO2 */
+
+#define PATH_MAX 4096
+#define VALUE_MAX 20
+#define DEVICE_PATH_MAX 256
+#define DEVICES_MAX 64
+
+struct archive;
+struct history;
+struct rolling;
+
+enum device_error_kind {
+    ERROR_MAGIC_TABLE, /* the magic table could not be sent */
+    ERROR_READ, /* reading failed or timed out, the device is reopened */
+    ERROR_TRAILER, /* data[4] is not 0x0d */
+    ERROR_CHECKSUM,
+    ERROR_KINDS,
+};
+
+#define STATE_CODES_MAX 32 /* distinct codes kept per device, more are ignored */
+
+/* The last reading of a code. */
+struct code_state {
+    uint16_t value;
+    unsigned char code;
+    uint64_t count; /* readings since the device was opened */
+    int64_t time_ns; /* monotonic_ns() of the last reading */
+    int64_t time_ms; /* the same, since the Epoch */
+};
+
+struct co2mon_state {
+    time_t heatbeat;
+    unsigned int deverr; /* sum of errors */
+    unsigned int errors[ERROR_KINDS];
+    unsigned int reconnects;
+    int codes_count;
+    struct code_state codes[STATE_CODES_MAX]; /* sorted by code, only codes_count are copied */
+};
+
+struct device {
+    char path[DEVICE_PATH_MAX]; /* empty for the first matching device */
+    char name[DEVICE_PATH_MAX]; /* path with unsafe characters replaced */
+    int hotplug; /* found by enumeration, the thread exits when it is gone */
+    int active;
+    int opened; /* set once the device has been opened, reopening counts as a reconnect */
+    int64_t plugged_ns; /* monotonic time of the hotplug event that led to the open, or 0 */
+    unsigned int seq; /* seqlock for state, odd while the device thread updates it */
+    struct co2mon_state state;
+    struct history *history;
+    struct rolling *rolling; /* NULL unless -W is used */
+    co2mon_log log; /* NULL unless -L is used */
+    pthread_mutex_t log_mutex; /* the log is also flushed by the log thread */
+    struct archive *archive; /* NULL unless -R is used */
+    int shm_index; /* -1 unless -S is used */
+};
+
+extern int print_unknown;
+extern int multi_device;
+
+extern struct device devices[DEVICES_MAX];
+extern int devices_count;
+
+/* Guards devices_count and the hotplug/active flags. Device state is
+ * published through the per-device seqlock instead, so the device threads
+ * never wait for the readers. */
+extern void
+devices_lock();
+
+extern void
+devices_unlock();
+
+/* Only the thread that owns the device may update its state. */
+static inline void
+state_write_begin(struct device *device)
+{
+    __atomic_store_n(&device->seq, device->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+state_write_end(struct device *device)
+{
+    __atomic_store_n(&device->seq, device->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the sequence number of the copied state. Only the codes seen
+ * are copied. */
+static inline unsigned int
+state_read(const struct device *device, struct co2mon_state *copy)
+{
+    unsigned int seq0, seq1;
+    do
+    {
+        seq0 = __atomic_load_n(&device->seq, __ATOMIC_ACQUIRE);
+        int count = __atomic_load_n(&device->state.codes_count, __ATOMIC_RELAXED);
+        if (count < 0 || count > STATE_CODES_MAX)
+        {
+            count = 0; // torn, retried below
+        }
+        memcpy(copy, &device->state, offsetof(struct co2mon_state, codes) + count * sizeof(copy->codes[0]));
+        copy->codes_count = count;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq1 = __atomic_load_n(&device->seq, __ATOMIC_RELAXED);
+    } while ((seq0 & 1) || seq0 != seq1);
+    return seq0;
+}
+
+/* Returns the last reading of a code, or NULL if it has not been seen. */
+static inline const struct code_state *
+state_code(const struct co2mon_state *state, unsigned char code)
+{
+    for (int i = 0; i < state->codes_count && state->codes[i].code <= code; ++i)
+    {
+        if (state->codes[i].code == code)
+        {
+            return &state->codes[i];
+        }
+    }
+    return NULL;
+}
+
+/* Records a reading, between state_write_begin() and state_write_end(). */
+static inline void
+state_set_code(struct co2mon_state *state, unsigned char code, uint16_t value, int64_t time_ns, int64_t time_ms)
+{
+    int i = 0;
+    while (i < state->codes_count && state->codes[i].code < code)
+    {
+        i++;
+    }
+    if (i == state->codes_count || state->codes[i].code != code)
+    {
+        if (state->codes_count == STATE_CODES_MAX)
+        {
+            return;
+        }
+        memmove(&state->codes[i + 1], &state->codes[i], (state->codes_count - i) * sizeof(state->codes[0]));
+        memset(&state->codes[i], 0, sizeof(state->codes[i]));
+        state->codes[i].code = code;
+        state->codes_count++;
+    }
+    state->codes[i].value = value;
+    state->codes[i].count++;
+    state->codes[i].time_ns = time_ns;
+    state->codes[i].time_ms = time_ms;
+}
+
+/* Returns a number that changes whenever the state of the device changes. */
+static inline unsigned int
+state_seq(const struct device *device)
+{
+    return (__atomic_load_n(&device->seq, __ATOMIC_ACQUIRE) + 1) & ~1u;
+}
+
+static inline int
+bitarr_isset(const uint8_t* bitarr, unsigned int ndx)
+{
+    return bitarr[ndx >> 3] & (1u << (ndx & 0x07u)) ? 1 : 0;
+}
+
+static inline void
+bitarr_set(uint8_t* bitarr, unsigned int ndx)
+{
+    bitarr[ndx >> 3] |= 1u << (ndx & 0x07u);
+}
+
+static inline int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int64_t
+realtime_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+enum frame_status {
+    FRAME_OK,
+    FRAME_BAD_TRAILER, /* data[4] is not 0x0d */
+    FRAME_BAD_CHECKSUM,
+};
+
+static inline enum frame_status
+frame_check(const co2mon_data_t frame)
+{
+    if (frame[4] != 0x0d)
+    {
+        return FRAME_BAD_TRAILER;
+    }
+    if ((unsigned char)(frame[0] + frame[1] + frame[2]) != frame[3])
+    {
+        return FRAME_BAD_CHECKSUM;
+    }
+    return FRAME_OK;
+}
+
+static inline double
+decode_temperature(uint16_t w)
+{
+    return (double)w * 0.0625 - 273.15;
+}
+
+#endif
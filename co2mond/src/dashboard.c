@@ -0,0 +1,122 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 700
+
+#include "dashboard.h"
+#include "http.h"
+
+/* The page asks for one point per pixel of its canvases and redraws when
+ * new readings come in; the device is passed on from its own query, as in
+ * /dashboard?device=name. */
+static const char dashboard_page[] =
+    "<!DOCTYPE html>\n"
+    "<html>\n"
+    "<head>\n"
+    "<meta charset=\"utf-8\">\n"
+    "<title>co2mon</title>\n"
+    "<style>\n"
+    "body { font: 14px sans-serif; margin: 1em; }\n"
+    "canvas { display: block; width: 100%; height: 300px; margin-bottom: 1em; }\n"
+    "button.on { font-weight: bold; }\n"
+    "</style>\n"
+    "</head>\n"
+    "<body>\n"
+    "<div id=\"ranges\"></div>\n"
+    "<h2>CO2, ppm <span id=\"co2-now\"></span></h2>\n"
+    "<canvas id=\"co2\"></canvas>\n"
+    "<h2>Temperature, &deg;C <span id=\"temp-now\"></span></h2>\n"
+    "<canvas id=\"temp\"></canvas>\n"
+    "<script>\n"
+    "var ranges = { '1h': 3600, '1d': 86400, '1w': 604800, '31d': 2678400 };\n"
+    "var range = '1h';\n"
+    "var device = new URLSearchParams(location.search).get('device');\n"
+    "var charts = { co2: '#0000ff', temp: '#00a000' };\n"
+    "\n"
+    "function draw(code, data) {\n"
+    "  var canvas = document.getElementById(code);\n"
+    "  var w = canvas.width = canvas.clientWidth * devicePixelRatio;\n"
+    "  var h = canvas.height = canvas.clientHeight * devicePixelRatio;\n"
+    "  var c = canvas.getContext('2d');\n"
+    "  var p = data.points;\n"
+    "  c.clearRect(0, 0, w, h);\n"
+    "  if (!p.length) return;\n"
+    "  var lo = Math.min.apply(null, p.map(function (q) { return q[1]; }));\n"
+    "  var hi = Math.max.apply(null, p.map(function (q) { return q[2]; }));\n"
+    "  if (hi == lo) { hi += 1; lo -= 1; }\n"
+    "  var m = 40 * devicePixelRatio;\n"
+    "  function x(t) { return m + (t - data.from) / (data.to - data.from) * (w - m); }\n"
+    "  function y(v) { return (hi - v) / (hi - lo) * (h - m / 2) + m / 4; }\n"
+    "  c.font = 11 * devicePixelRatio + 'px sans-serif';\n"
+    "  c.fillStyle = '#666';\n"
+    "  c.fillText(hi.toFixed(1), 0, y(hi) + 4);\n"
+    "  c.fillText(lo.toFixed(1), 0, y(lo));\n"
+    "  c.globalAlpha = 0.3;\n"
+    "  c.fillStyle = charts[code];\n"
+    "  p.forEach(function (q) { c.fillRect(x(q[0]), y(q[2]), Math.max(1, devicePixelRatio), y(q[1]) - y(q[2]) + 1); });\n"
+    "  c.globalAlpha = 1;\n"
+    "  c.strokeStyle = charts[code];\n"
+    "  c.beginPath();\n"
+    "  p.forEach(function (q, i) { c[i ? 'lineTo' : 'moveTo'](x(q[0]), y(q[3])); });\n"
+    "  c.stroke();\n"
+    "  document.getElementById(code + '-now').textContent = p[p.length - 1][3].toFixed(code == 'co2' ? 0 : 1);\n"
+    "}\n"
+    "\n"
+    "function update() {\n"
+    "  Object.keys(charts).forEach(function (code) {\n"
+    "    var canvas = document.getElementById(code);\n"
+    "    var q = 'series?code=' + code + '&range=' + ranges[range] +\n"
+    "      '&width=' + Math.min(4096, Math.round(canvas.clientWidth * devicePixelRatio)) +\n"
+    "      (device ? '&device=' + encodeURIComponent(device) : '');\n"
+    "    fetch(q).then(function (r) { return r.json(); }).then(function (data) { draw(code, data); });\n"
+    "  });\n"
+    "}\n"
+    "\n"
+    "Object.keys(ranges).forEach(function (r) {\n"
+    "  var b = document.createElement('button');\n"
+    "  b.textContent = r;\n"
+    "  b.onclick = function () {\n"
+    "    range = r;\n"
+    "    document.querySelectorAll('button').forEach(function (o) { o.className = o == b ? 'on' : ''; });\n"
+    "    update();\n"
+    "  };\n"
+    "  b.className = r == range ? 'on' : '';\n"
+    "  document.getElementById('ranges').appendChild(b);\n"
+    "});\n"
+    "update();\n"
+    "setInterval(update, 5000);\n"
+    "window.onresize = update;\n"
+    "</script>\n"
+    "</body>\n"
+    "</html>\n";
+
+/*
+ * GET /dashboard[?device=<name>]
+ */
+void
+dashboard_handler(const struct http_request *req, struct http_response *resp)
+{
+    static struct http_blob *page; // only used by the HTTP thread
+    (void)req;
+    if (!page)
+    {
+        page = http_blob_new(dashboard_page, sizeof(dashboard_page) - 1);
+    }
+    resp->status = 200;
+    resp->content_type = "text/html; charset=utf-8";
+    resp->blob = http_blob_ref(page);
+}
@@ -0,0 +1,115 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* strnlen */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "co2mond.h"
+#include "datadir.h"
+#include "stats.h"
+
+char *datadir;
+
+static int
+lock(int fd, short int type)
+{
+    struct flock lock;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    lock.l_whence = SEEK_SET;
+    lock.l_type = type;
+    return fcntl(fd, F_SETLKW, &lock);
+}
+
+int
+write_data(int fd, const char *value)
+{
+    char data[VALUE_MAX + 1];
+    snprintf(data, VALUE_MAX + 1, "%s\n", value);
+
+    if (lock(fd, F_WRLCK) != 0)
+    {
+        perror("lock");
+        return 0;
+    }
+
+    if (ftruncate(fd, 0) != 0)
+    {
+        perror("ftruncate");
+        return 0;
+    }
+
+    ssize_t len = strnlen(data, VALUE_MAX + 1);
+    if (write(fd, data, len) != len)
+    {
+        perror("write");
+        return 0;
+    }
+
+    if (lock(fd, F_UNLCK) != 0)
+    {
+        perror("unlock");
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+write_value(struct device *device, const char *name, const char *value)
+{
+    if (!datadir)
+    {
+        return 1;
+    }
+
+    char filename[PATH_MAX];
+    if (multi_device)
+    {
+        snprintf(filename, PATH_MAX, "%s/%s", datadir, device->name);
+        if (mkdir(filename, 0777) != 0 && errno != EEXIST)
+        {
+            perror(filename);
+            return 0;
+        }
+        snprintf(filename, PATH_MAX, "%s/%s/%s", datadir, device->name, name);
+    }
+    else
+    {
+        snprintf(filename, PATH_MAX, "%s/%s", datadir, name);
+    }
+
+    const int64_t start = monotonic_ns();
+    int fd = open(filename, O_CREAT | O_WRONLY, 0666);
+    if (fd == -1)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    int result = write_data(fd, value);
+    close(fd);
+    histogram_observe(&datadir_write_histogram, monotonic_ns() - start);
+    return result;
+}
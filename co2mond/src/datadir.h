@@ -0,0 +1,34 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DATADIR_H_INCLUDED_
+#define DATADIR_H_INCLUDED_
+
+#include "co2mond.h"
+
+/* Absolute path of the -D directory, NULL if values are not stored. */
+extern char *datadir;
+
+/* Replaces the contents of fd with value under a write lock. */
+extern int
+write_data(int fd, const char *value);
+
+/* Stores a value of the device in datadir, if it is set. */
+extern int
+write_value(struct device *device, const char *name, const char *value);
+
+#endif
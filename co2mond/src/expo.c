@@ -0,0 +1,339 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <string.h>
+
+#include "buf.h"
+#include "expo.h"
+
+const char *expo_content_types[EXPO_FORMATS] = {
+    "text/plain; version=0.0.4; charset=utf-8",
+    "application/openmetrics-text; version=1.0.0; charset=utf-8",
+    "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited",
+};
+
+// Protocol buffers wire format, just enough for metrics.c.
+
+enum {
+    PB_VARINT = 0,
+    PB_FIXED64 = 1,
+    PB_BYTES = 2,
+};
+
+// MetricType of metrics.proto.
+static const int pb_types[] = {
+    [EXPO_COUNTER] = 0,
+    [EXPO_GAUGE] = 1,
+    [EXPO_HISTOGRAM] = 4,
+};
+
+static void
+pb_varint(struct buf *out, uint64_t value)
+{
+    unsigned char bytes[10];
+    int n = 0;
+    do
+    {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value)
+        {
+            bytes[n] |= 0x80;
+        }
+        n++;
+    } while (value);
+    buf_append(out, bytes, n);
+}
+
+static void
+pb_tag(struct buf *out, int field, int wire_type)
+{
+    pb_varint(out, (uint64_t)field << 3 | wire_type);
+}
+
+static void
+pb_bytes(struct buf *out, int field, const void *data, size_t len)
+{
+    pb_tag(out, field, PB_BYTES);
+    pb_varint(out, len);
+    buf_append(out, data, len);
+}
+
+static void
+pb_string(struct buf *out, int field, const char *s)
+{
+    pb_bytes(out, field, s, strlen(s));
+}
+
+static size_t
+pb_varint_size(uint64_t value)
+{
+    size_t n = 1;
+    while (value >>= 7)
+    {
+        n++;
+    }
+    return n;
+}
+
+static void
+encode_double(unsigned char *bytes, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; ++i)
+    {
+        bytes[i] = bits >> (8 * i);
+    }
+}
+
+static void
+pb_double(struct buf *out, int field, double value)
+{
+    unsigned char bytes[8];
+    encode_double(bytes, value);
+    pb_tag(out, field, PB_FIXED64);
+    buf_append(out, bytes, sizeof(bytes));
+}
+
+static void
+pb_uint(struct buf *out, int field, uint64_t value)
+{
+    pb_tag(out, field, PB_VARINT);
+    pb_varint(out, value);
+}
+
+static void
+pb_labels(struct buf *metric, const struct expo_label *labels, int nlabels)
+{
+    for (int i = 0; i < nlabels; ++i)
+    {
+        // LabelPair, written in place.
+        const size_t name_len = strlen(labels[i].name);
+        const size_t value_len = strlen(labels[i].value);
+        pb_tag(metric, 1, PB_BYTES);
+        pb_varint(metric, 1 + pb_varint_size(name_len) + name_len + 1 + pb_varint_size(value_len) + value_len);
+        pb_string(metric, 1, labels[i].name);
+        pb_string(metric, 2, labels[i].value);
+    }
+}
+
+// Writes the family that is being built, prefixed by its length. Families
+// without metrics are left out.
+static void
+pb_flush(struct expo *e)
+{
+    if (e->metrics > 0)
+    {
+        pb_varint(e->out, e->family.len);
+        buf_append(e->out, e->family.data, e->family.len);
+    }
+    e->family.len = 0;
+}
+
+// Text formats.
+
+static void
+text_labels(struct buf *out, const struct expo_label *labels, int nlabels, const char *le)
+{
+    if (nlabels == 0 && !le)
+    {
+        return;
+    }
+    buf_puts(out, "{");
+    for (int i = 0; i < nlabels; ++i)
+    {
+        if (i)
+        {
+            buf_puts(out, ",");
+        }
+        buf_puts(out, labels[i].name);
+        buf_puts(out, "=\"");
+        buf_puts(out, labels[i].value);
+        buf_puts(out, "\"");
+    }
+    if (le)
+    {
+        buf_puts(out, nlabels ? ",le=\"" : "le=\"");
+        buf_puts(out, le);
+        buf_puts(out, "\"");
+    }
+    buf_puts(out, "}");
+}
+
+static void
+text_timestamp(struct expo *e, int64_t timestamp_ms)
+{
+    // The Prometheus text format is left without timestamps, so that
+    // staleness handling is not changed for existing scrapers.
+    if (e->format == EXPO_OPENMETRICS && timestamp_ms)
+    {
+        buf_printf(e->out, " %lld.%03d", (long long)(timestamp_ms / 1000), (int)(timestamp_ms % 1000));
+    }
+}
+
+void
+expo_init(struct expo *e, enum expo_format format, struct buf *out)
+{
+    memset(e, 0, sizeof(*e));
+    e->format = format;
+    e->out = out;
+}
+
+void
+expo_family(struct expo *e, const char *name, const char *help, enum expo_type type)
+{
+    static const char *type_names[] = {
+        [EXPO_COUNTER] = "counter",
+        [EXPO_GAUGE] = "gauge",
+        [EXPO_HISTOGRAM] = "histogram",
+    };
+
+    e->name = name;
+    e->type = type;
+
+    if (e->format == EXPO_PROTOBUF)
+    {
+        pb_flush(e);
+        e->metrics = 0;
+        pb_string(&e->family, 1, name);
+        pb_string(&e->family, 2, help);
+        pb_uint(&e->family, 3, pb_types[type]);
+        return;
+    }
+
+    int len = strlen(name);
+    if (e->format == EXPO_OPENMETRICS && type == EXPO_COUNTER && len > 6 &&
+        strcmp(name + len - 6, "_total") == 0)
+    {
+        len -= 6;
+    }
+    buf_printf(e->out,
+        "# HELP %.*s %s\n"
+        "# TYPE %.*s %s\n",
+        len, name, help, len, name, type_names[type]);
+}
+
+void
+expo_sample(struct expo *e, const struct expo_label *labels, int nlabels, double value, int64_t timestamp_ms)
+{
+    if (e->format == EXPO_PROTOBUF)
+    {
+        struct buf *metric = &e->metric;
+        metric->len = 0;
+        pb_labels(metric, labels, nlabels);
+
+        // Counter or Gauge, with only their value.
+        unsigned char inner[9];
+        inner[0] = 1 << 3 | PB_FIXED64;
+        encode_double(inner + 1, value);
+        pb_bytes(metric, e->type == EXPO_COUNTER ? 3 : 2, inner, sizeof(inner));
+
+        if (timestamp_ms)
+        {
+            pb_uint(metric, 6, (uint64_t)timestamp_ms);
+        }
+        pb_bytes(&e->family, 4, metric->data, metric->len);
+        e->metrics++;
+        return;
+    }
+
+    buf_puts(e->out, e->name);
+    text_labels(e->out, labels, nlabels, NULL);
+    // Most values are integers, which are much cheaper to format.
+    if (value == (double)(long long)value && value > -1e15 && value < 1e15)
+    {
+        buf_printf(e->out, " %lld", (long long)value);
+    }
+    else
+    {
+        buf_printf(e->out, " %.15g", value);
+    }
+    text_timestamp(e, timestamp_ms);
+    buf_puts(e->out, "\n");
+}
+
+void
+expo_histogram(struct expo *e, const struct expo_label *labels, int nlabels,
+    const double *bounds, const uint64_t *counts, int nbuckets, uint64_t count, double sum)
+{
+    if (e->format == EXPO_PROTOBUF)
+    {
+        struct buf histogram = { 0 };
+        struct buf bucket = { 0 };
+        pb_uint(&histogram, 1, count);
+        pb_double(&histogram, 2, sum);
+        for (int i = 0; i < nbuckets; ++i)
+        {
+            bucket.len = 0;
+            pb_uint(&bucket, 1, counts[i]);
+            pb_double(&bucket, 2, bounds[i]);
+            pb_bytes(&histogram, 3, bucket.data, bucket.len);
+        }
+
+        struct buf *metric = &e->metric;
+        metric->len = 0;
+        pb_labels(metric, labels, nlabels);
+        pb_bytes(metric, 7, histogram.data, histogram.len);
+        pb_bytes(&e->family, 4, metric->data, metric->len);
+        e->metrics++;
+        buf_free(&histogram);
+        buf_free(&bucket);
+        return;
+    }
+
+    char le[32];
+    for (int i = 0; i <= nbuckets; ++i)
+    {
+        if (i < nbuckets)
+        {
+            snprintf(le, sizeof(le), "%g", bounds[i]);
+        }
+        else
+        {
+            strcpy(le, "+Inf");
+        }
+        buf_printf(e->out, "%s_bucket", e->name);
+        text_labels(e->out, labels, nlabels, le);
+        buf_printf(e->out, " %llu\n", (unsigned long long)(i < nbuckets ? counts[i] : count));
+    }
+    buf_printf(e->out, "%s_sum", e->name);
+    text_labels(e->out, labels, nlabels, NULL);
+    buf_printf(e->out, " %.9f\n", sum);
+    buf_printf(e->out, "%s_count", e->name);
+    text_labels(e->out, labels, nlabels, NULL);
+    buf_printf(e->out, " %llu\n", (unsigned long long)count);
+}
+
+void
+expo_finish(struct expo *e)
+{
+    if (e->format == EXPO_PROTOBUF)
+    {
+        pb_flush(e);
+    }
+    else if (e->format == EXPO_OPENMETRICS)
+    {
+        buf_puts(e->out, "# EOF\n");
+    }
+    buf_free(&e->family);
+    buf_free(&e->metric);
+}
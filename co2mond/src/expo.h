@@ -0,0 +1,82 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EXPO_H_INCLUDED_
+#define EXPO_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "buf.h"
+
+/*
+ * Metrics exposition in the Prometheus text format, OpenMetrics text and
+ * the Prometheus protobuf format (delimited io.prometheus.client.MetricFamily
+ * messages). The metrics are described once through these calls. Counter
+ * names end with _total, which OpenMetrics strips from the family name.
+ */
+
+enum expo_format {
+    EXPO_TEXT,
+    EXPO_OPENMETRICS,
+    EXPO_PROTOBUF,
+    EXPO_FORMATS,
+};
+
+enum expo_type {
+    EXPO_COUNTER,
+    EXPO_GAUGE,
+    EXPO_HISTOGRAM,
+};
+
+struct expo_label {
+    const char *name;
+    const char *value; /* not escaped, must not contain quotes, backslashes or newlines */
+};
+
+struct expo {
+    enum expo_format format;
+    struct buf *out;
+    const char *name;
+    enum expo_type type;
+    int metrics; /* in the current family */
+    struct buf family; /* protobuf: the current family, written once it is complete */
+    struct buf metric;
+};
+
+extern const char *expo_content_types[EXPO_FORMATS];
+
+extern void
+expo_init(struct expo *e, enum expo_format format, struct buf *out);
+
+extern void
+expo_family(struct expo *e, const char *name, const char *help, enum expo_type type);
+
+/* A counter or gauge sample. timestamp_ms is 0 for none; the Prometheus
+ * text format never has timestamps, as before. */
+extern void
+expo_sample(struct expo *e, const struct expo_label *labels, int nlabels, double value, int64_t timestamp_ms);
+
+/* counts are cumulative and bounds finite; the +Inf bucket is count. */
+extern void
+expo_histogram(struct expo *e, const struct expo_label *labels, int nlabels,
+    const double *bounds, const uint64_t *counts, int nbuckets, uint64_t count, double sum);
+
+/* Completes the output and frees the scratch buffers. */
+extern void
+expo_finish(struct expo *e);
+
+#endif
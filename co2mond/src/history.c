@@ -0,0 +1,730 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* clock_gettime */
+
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "buf.h"
+#include "co2mond.h"
+#include "history.h"
+#include "http.h"
+
+struct history *
+history_new()
+{
+    struct history *history = calloc(1, sizeof(*history));
+    if (!history)
+    {
+        err(EXIT_FAILURE, "calloc");
+    }
+    return history;
+}
+
+static struct history_series *
+series_for(struct history *history, unsigned int code)
+{
+    for (int i = 0; i < HISTORY_CODES; ++i)
+    {
+        struct history_series *series = history->series[i];
+        if (!series)
+        {
+            series = calloc(1, sizeof(*series));
+            if (!series)
+            {
+                perror("calloc");
+                return NULL;
+            }
+            series->code = code;
+            __atomic_store_n(&history->series[i], series, __ATOMIC_RELEASE);
+            return series;
+        }
+        if (series->code == code)
+        {
+            return series;
+        }
+    }
+    return NULL;
+}
+
+static void
+bucket_add(struct history_bucket *ring, unsigned int size, unsigned int *head, unsigned int *count,
+    int64_t start, uint16_t value)
+{
+    struct history_bucket *bucket = *count ? &ring[(*head + size - 1) % size] : NULL;
+    if (!bucket || bucket->time != start)
+    {
+        bucket = &ring[*head];
+        *head = (*head + 1) % size;
+        if (*count < size)
+        {
+            (*count)++;
+        }
+        bucket->time = start;
+        bucket->min = value;
+        bucket->max = value;
+        bucket->count = 0;
+        bucket->sum = 0;
+    }
+    if (value < bucket->min)
+    {
+        bucket->min = value;
+    }
+    if (value > bucket->max)
+    {
+        bucket->max = value;
+    }
+    bucket->count++;
+    bucket->sum += value;
+}
+
+void
+history_add(struct history *history, unsigned int code, uint16_t value, time_t now)
+{
+    struct history_series *series = series_for(history, code);
+    if (!series)
+    {
+        return;
+    }
+
+    const int64_t t = now;
+
+    __atomic_store_n(&series->seq, series->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    series->raw[series->raw_head].time = t;
+    series->raw[series->raw_head].value = value;
+    series->raw_head = (series->raw_head + 1) % HISTORY_RAW;
+    if (series->raw_count < HISTORY_RAW)
+    {
+        series->raw_count++;
+    }
+    bucket_add(series->minutes, HISTORY_MINUTES, &series->minutes_head, &series->minutes_count,
+        t - t % 60, value);
+    bucket_add(series->hours, HISTORY_HOURS, &series->hours_head, &series->hours_count,
+        t - t % 3600, value);
+
+    __atomic_store_n(&series->seq, series->seq + 1, __ATOMIC_RELEASE);
+}
+
+const struct history_series *
+history_find(const struct history *history, unsigned int code)
+{
+    for (int i = 0; i < HISTORY_CODES; ++i)
+    {
+        const struct history_series *series = __atomic_load_n(&history->series[i], __ATOMIC_ACQUIRE);
+        if (!series)
+        {
+            break;
+        }
+        if (series->code == code)
+        {
+            return series;
+        }
+    }
+    return NULL;
+}
+
+void
+history_copy(const struct history_series *series, struct history_series *copy)
+{
+    unsigned int seq0, seq1;
+    do
+    {
+        seq0 = __atomic_load_n(&series->seq, __ATOMIC_ACQUIRE);
+        memcpy(copy, series, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq1 = __atomic_load_n(&series->seq, __ATOMIC_RELAXED);
+    } while ((seq0 & 1) || seq0 != seq1);
+}
+
+int
+history_parse_code(const char *s, unsigned int *code)
+{
+    if (strcasecmp(s, "co2") == 0 || strcmp(s, "CntR") == 0)
+    {
+        *code = CODE_CNTR;
+        return 1;
+    }
+    if (strcasecmp(s, "temp") == 0 || strcmp(s, "Tamb") == 0)
+    {
+        *code = CODE_TAMB;
+        return 1;
+    }
+
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        s += 2;
+    }
+    else if (s[0] == 'x' || s[0] == 'X')
+    {
+        s += 1;
+    }
+    char *end;
+    unsigned long value = strtoul(s, &end, 16);
+    if (*s == '\0' || *end != '\0' || value > 0xff)
+    {
+        return 0;
+    }
+    *code = value;
+    return 1;
+}
+
+static double
+value_of(unsigned int code, double w)
+{
+    return code == CODE_TAMB ? decode_temperature(w) : w;
+}
+
+static void
+put_le(struct buf *out, uint64_t v, int bytes)
+{
+    unsigned char data[8];
+    for (int i = 0; i < bytes; ++i)
+    {
+        data[i] = v >> (8 * i);
+    }
+    buf_append(out, data, bytes);
+}
+
+static void
+put_float(struct buf *out, double value)
+{
+    float f = value;
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    put_le(out, u, 4);
+}
+
+enum tier {
+    TIER_RAW,
+    TIER_MINUTE,
+    TIER_HOUR,
+};
+
+static const char *tier_names[] = { "raw", "minute", "hour" };
+
+// A tier covers the range if it has never wrapped or its oldest entry is
+// not newer than the start of the range.
+static int
+covers(unsigned int count, unsigned int size, int64_t oldest, int64_t from)
+{
+    return count < size || oldest <= from;
+}
+
+static void
+render_raw(struct buf *out, const struct history_series *s, int64_t from, int64_t to, int binary)
+{
+    int first = 1;
+    for (unsigned int i = 0; i < s->raw_count; ++i)
+    {
+        const struct history_sample *p = &s->raw[(s->raw_head + HISTORY_RAW - s->raw_count + i) % HISTORY_RAW];
+        if (p->time < from || p->time > to)
+        {
+            continue;
+        }
+        if (binary)
+        {
+            put_le(out, p->time, 8);
+            put_float(out, value_of(s->code, p->value));
+        }
+        else
+        {
+            buf_printf(out, first ? "[%lld,%.6g]" : ",[%lld,%.6g]",
+                (long long)p->time, value_of(s->code, p->value));
+        }
+        first = 0;
+    }
+}
+
+static void
+render_buckets(struct buf *out, unsigned int code, const struct history_bucket *ring,
+    unsigned int size, unsigned int head, unsigned int count, int64_t width,
+    int64_t from, int64_t to, int binary)
+{
+    int first = 1;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        const struct history_bucket *b = &ring[(head + size - count + i) % size];
+        if (b->time + width <= from || b->time > to)
+        {
+            continue;
+        }
+        const double avg = (double)b->sum / b->count;
+        if (binary)
+        {
+            put_le(out, b->time, 8);
+            put_float(out, value_of(code, b->min));
+            put_float(out, value_of(code, b->max));
+            put_float(out, value_of(code, avg));
+            put_le(out, b->count, 4);
+        }
+        else
+        {
+            buf_printf(out, first ? "[%lld,%.6g,%.6g,%.6g,%lu]" : ",[%lld,%.6g,%.6g,%.6g,%lu]",
+                (long long)b->time, value_of(code, b->min), value_of(code, b->max),
+                value_of(code, avg), (unsigned long)b->count);
+        }
+        first = 0;
+    }
+}
+
+static int
+parse_tier(const char *s, enum tier *tier)
+{
+    for (int i = 0; i < (int)(sizeof(tier_names) / sizeof(tier_names[0])); ++i)
+    {
+        if (strcmp(s, tier_names[i]) == 0)
+        {
+            *tier = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+parse_time(const char *s, int64_t *t)
+{
+    char *end;
+    long long value = strtoll(s, &end, 10);
+    if (*s == '\0' || *end != '\0')
+    {
+        return 0;
+    }
+    *t = value;
+    return 1;
+}
+
+static void
+bad_request(struct http_response *resp, const char *message)
+{
+    resp->status = 400;
+    buf_puts(&resp->body, message);
+}
+
+// The device named by the device parameter, or the first one. Fills a 404
+// response if there is none.
+static struct device *
+find_device(const struct http_request *req, struct http_response *resp)
+{
+    char param[DEVICE_PATH_MAX];
+    struct device *device = NULL;
+    int count;
+    devices_lock();
+    count = devices_count;
+    devices_unlock();
+    if (http_query_param(req, "device", param, sizeof(param)))
+    {
+        for (int d = 0; d < count; ++d)
+        {
+            if (strcmp(devices[d].name, param) == 0)
+            {
+                device = &devices[d];
+                break;
+            }
+        }
+    }
+    else if (count > 0)
+    {
+        device = &devices[0];
+    }
+    if (!device)
+    {
+        resp->status = 404;
+        buf_puts(&resp->body, "Unknown device.\r\n");
+    }
+    return device;
+}
+
+static void
+copy_series(const struct device *device, unsigned int code, struct history_series *copy)
+{
+    const struct history_series *series = history_find(device->history, code);
+    if (series)
+    {
+        history_copy(series, copy);
+    }
+    else
+    {
+        memset(copy, 0, sizeof(*copy));
+        copy->code = code;
+    }
+}
+
+/*
+ * GET /history?code=co2&from=<unix time>&to=<unix time>
+ *     [&device=<name>][&tier=raw|minute|hour][&format=json|binary]
+ *
+ * Without tier, the finest tier that still covers `from` is used. JSON
+ * points are [time,value] for raw samples and [time,min,max,avg,count]
+ * for buckets. The binary format is a sequence of little-endian records:
+ * int64 time and float32 value for raw samples, int64 time, float32 min,
+ * max, avg and uint32 count for buckets; the X-History-Tier header tells
+ * which one it is.
+ */
+void
+history_handler(const struct http_request *req, struct http_response *resp)
+{
+    static struct history_series copy; // only used by the HTTP thread
+    char param[DEVICE_PATH_MAX];
+    unsigned int code;
+    int64_t to = time(NULL);
+    int64_t from = to - 3600;
+    int tier_set = 0;
+    enum tier tier = TIER_RAW;
+    int binary = 0;
+
+    if (!http_query_param(req, "code", param, sizeof(param)) || !history_parse_code(param, &code))
+    {
+        bad_request(resp, "Missing or invalid code, use e.g. code=co2, code=temp or code=x6d.\r\n");
+        return;
+    }
+    if (http_query_param(req, "from", param, sizeof(param)) && !parse_time(param, &from))
+    {
+        bad_request(resp, "Invalid from.\r\n");
+        return;
+    }
+    if (http_query_param(req, "to", param, sizeof(param)) && !parse_time(param, &to))
+    {
+        bad_request(resp, "Invalid to.\r\n");
+        return;
+    }
+    if (http_query_param(req, "tier", param, sizeof(param)))
+    {
+        if (!parse_tier(param, &tier))
+        {
+            bad_request(resp, "Invalid tier, use raw, minute or hour.\r\n");
+            return;
+        }
+        tier_set = 1;
+    }
+    if (http_query_param(req, "format", param, sizeof(param)))
+    {
+        if (strcmp(param, "binary") == 0)
+        {
+            binary = 1;
+        }
+        else if (strcmp(param, "json") != 0)
+        {
+            bad_request(resp, "Invalid format, use json or binary.\r\n");
+            return;
+        }
+    }
+
+    struct device *device = find_device(req, resp);
+    if (!device)
+    {
+        return;
+    }
+    copy_series(device, code, &copy);
+
+    if (!tier_set)
+    {
+        const struct history_sample *oldest_raw = &copy.raw[(copy.raw_head + HISTORY_RAW - copy.raw_count) % HISTORY_RAW];
+        const struct history_bucket *oldest_minute = &copy.minutes[(copy.minutes_head + HISTORY_MINUTES - copy.minutes_count) % HISTORY_MINUTES];
+        if (covers(copy.raw_count, HISTORY_RAW, oldest_raw->time, from))
+        {
+            tier = TIER_RAW;
+        }
+        else if (covers(copy.minutes_count, HISTORY_MINUTES, oldest_minute->time, from))
+        {
+            tier = TIER_MINUTE;
+        }
+        else
+        {
+            tier = TIER_HOUR;
+        }
+    }
+
+    resp->status = 200;
+    if (binary)
+    {
+        resp->content_type = "application/octet-stream";
+        buf_printf(&resp->headers, "X-History-Tier: %s\r\n", tier_names[tier]);
+    }
+    else
+    {
+        resp->content_type = "application/json";
+        buf_printf(&resp->body, "{\"device\":\"%s\",\"code\":\"x%02x\",\"tier\":\"%s\",\"points\":[",
+            device->name, code, tier_names[tier]);
+    }
+
+    switch (tier)
+    {
+    case TIER_RAW:
+        render_raw(&resp->body, &copy, from, to, binary);
+        break;
+    case TIER_MINUTE:
+        render_buckets(&resp->body, code, copy.minutes, HISTORY_MINUTES, copy.minutes_head,
+            copy.minutes_count, 60, from, to, binary);
+        break;
+    case TIER_HOUR:
+        render_buckets(&resp->body, code, copy.hours, HISTORY_HOURS, copy.hours_head,
+            copy.hours_count, 3600, from, to, binary);
+        break;
+    }
+
+    if (!binary)
+    {
+        buf_puts(&resp->body, "]}\n");
+    }
+}
+
+/*
+ * Downsampled series for the dashboard.
+ *
+ * The range is cut into one bucket per pixel, and each bucket gets the
+ * min, max and mean of the points that fall into it, so that spikes stay
+ * visible at any width. The points come from the coarsest tier that is
+ * finer than a pixel and covers the range: a week is read from 168 hour
+ * buckets rather than from raw samples. Responses are kept until the next
+ * reading of their code.
+ */
+
+#define SERIES_WIDTH_MAX 4096
+#define SERIES_RANGE_MAX ((int64_t)HISTORY_HOURS * 3600) /* what the hour tier holds, longer ranges are cut */
+#define SERIES_CACHE_SIZE 16
+
+struct series_point {
+    int64_t time;
+    uint16_t min;
+    uint16_t max;
+    uint32_t count;
+    uint64_t sum;
+};
+
+struct series_key {
+    const struct history_series *series;
+    unsigned int code;
+    int width;
+    int64_t range; /* ending at the last reading, or 0 for from and to */
+    int64_t from;
+    int64_t to;
+};
+
+static struct {
+    struct series_key key;
+    unsigned int seq;
+    unsigned long used;
+    struct http_blob *blob;
+} series_cache[SERIES_CACHE_SIZE]; // only used by the HTTP thread
+
+static void
+bucket_point(struct series_point *points, int width, int64_t from, int64_t to,
+    int64_t time, uint16_t min, uint16_t max, uint32_t count, uint64_t sum)
+{
+    if (time < from || time > to || !count)
+    {
+        return;
+    }
+    // The handler keeps to - from within SERIES_RANGE_MAX, the product fits.
+    const uint64_t index = (uint64_t)(time - from) * width / (uint64_t)(to - from + 1);
+    assert(index < (uint64_t)width);
+    struct series_point *p = &points[index];
+    if (!p->count)
+    {
+        p->time = time;
+        p->min = min;
+        p->max = max;
+    }
+    p->min = min < p->min ? min : p->min;
+    p->max = max > p->max ? max : p->max;
+    p->count += count;
+    p->sum += sum;
+}
+
+static void
+render_series(struct buf *out, const struct history_series *s, const struct series_key *key)
+{
+    static struct series_point points[SERIES_WIDTH_MAX];
+    int64_t from = key->from;
+    int64_t to = key->to;
+    if (key->range)
+    {
+        to = s->raw_count ? s->raw[(s->raw_head + HISTORY_RAW - 1) % HISTORY_RAW].time : time(NULL);
+        from = to - key->range;
+    }
+
+    const struct history_sample *oldest_raw = &s->raw[(s->raw_head + HISTORY_RAW - s->raw_count) % HISTORY_RAW];
+    const struct history_bucket *oldest_minute = &s->minutes[(s->minutes_head + HISTORY_MINUTES - s->minutes_count) % HISTORY_MINUTES];
+    const double pixel = (double)(to - from) / key->width;
+    enum tier tier;
+    if (pixel < 60 && covers(s->raw_count, HISTORY_RAW, oldest_raw->time, from))
+    {
+        tier = TIER_RAW;
+    }
+    else if (pixel < 3600 && covers(s->minutes_count, HISTORY_MINUTES, oldest_minute->time, from))
+    {
+        tier = TIER_MINUTE;
+    }
+    else
+    {
+        tier = TIER_HOUR;
+    }
+
+    memset(points, 0, key->width * sizeof(points[0]));
+    switch (tier)
+    {
+    case TIER_RAW:
+        for (unsigned int i = 0; i < s->raw_count; ++i)
+        {
+            const struct history_sample *p = &s->raw[(s->raw_head + HISTORY_RAW - s->raw_count + i) % HISTORY_RAW];
+            bucket_point(points, key->width, from, to, p->time, p->value, p->value, 1, p->value);
+        }
+        break;
+    case TIER_MINUTE:
+        for (unsigned int i = 0; i < s->minutes_count; ++i)
+        {
+            const struct history_bucket *b = &s->minutes[(s->minutes_head + HISTORY_MINUTES - s->minutes_count + i) % HISTORY_MINUTES];
+            bucket_point(points, key->width, from, to, b->time, b->min, b->max, b->count, b->sum);
+        }
+        break;
+    case TIER_HOUR:
+        for (unsigned int i = 0; i < s->hours_count; ++i)
+        {
+            const struct history_bucket *b = &s->hours[(s->hours_head + HISTORY_HOURS - s->hours_count + i) % HISTORY_HOURS];
+            bucket_point(points, key->width, from, to, b->time, b->min, b->max, b->count, b->sum);
+        }
+        break;
+    }
+
+    buf_printf(out, "{\"code\":\"x%02x\",\"tier\":\"%s\",\"from\":%lld,\"to\":%lld,\"points\":[",
+        key->code, tier_names[tier], (long long)from, (long long)to);
+    int first = 1;
+    for (int i = 0; i < key->width; ++i)
+    {
+        const struct series_point *p = &points[i];
+        if (!p->count)
+        {
+            continue;
+        }
+        buf_printf(out, first ? "[%lld,%.6g,%.6g,%.6g]" : ",[%lld,%.6g,%.6g,%.6g]",
+            (long long)p->time, value_of(key->code, p->min), value_of(key->code, p->max),
+            value_of(key->code, (double)p->sum / p->count));
+        first = 0;
+    }
+    buf_puts(out, "]}\n");
+}
+
+/*
+ * GET /series?code=co2[&device=<name>][&width=<pixels>]
+ *     [&range=<seconds>|&from=<unix time>[&to=<unix time>]]
+ *
+ * Points are [time,min,max,mean], at most one per pixel of the width (600
+ * by default). The range defaults to the hour up to the last reading, and
+ * is cut to the last 31 days (HISTORY_HOURS), which the history holds.
+ */
+void
+series_handler(const struct http_request *req, struct http_response *resp)
+{
+    static struct history_series copy; // only used by the HTTP thread
+    static unsigned long uses;
+    char param[32];
+    struct series_key key;
+    memset(&key, 0, sizeof(key)); // compared with memcmp()
+    key.width = 600;
+    key.range = 3600;
+
+    if (!http_query_param(req, "code", param, sizeof(param)) || !history_parse_code(param, &key.code))
+    {
+        bad_request(resp, "Missing or invalid code, use e.g. code=co2, code=temp or code=x6d.\r\n");
+        return;
+    }
+    if (http_query_param(req, "width", param, sizeof(param)))
+    {
+        int64_t width;
+        if (!parse_time(param, &width) || width < 1 || width > SERIES_WIDTH_MAX)
+        {
+            bad_request(resp, "Invalid width.\r\n");
+            return;
+        }
+        key.width = width;
+    }
+    if (http_query_param(req, "range", param, sizeof(param)) && (!parse_time(param, &key.range) || key.range <= 0))
+    {
+        bad_request(resp, "Invalid range.\r\n");
+        return;
+    }
+    if (key.range > SERIES_RANGE_MAX)
+    {
+        key.range = SERIES_RANGE_MAX;
+    }
+    if (http_query_param(req, "from", param, sizeof(param)))
+    {
+        key.range = 0;
+        key.to = time(NULL);
+        if (!parse_time(param, &key.from) ||
+            (http_query_param(req, "to", param, sizeof(param)) && !parse_time(param, &key.to)) ||
+            key.from < 0 || key.to <= key.from)
+        {
+            bad_request(resp, "Invalid from or to.\r\n");
+            return;
+        }
+        if (key.to - key.from > SERIES_RANGE_MAX)
+        {
+            key.from = key.to - SERIES_RANGE_MAX;
+        }
+    }
+
+    struct device *device = find_device(req, resp);
+    if (!device)
+    {
+        return;
+    }
+    key.series = history_find(device->history, key.code);
+    const unsigned int seq = key.series ? __atomic_load_n(&key.series->seq, __ATOMIC_ACQUIRE) : 0;
+
+    resp->status = 200;
+    resp->content_type = "application/json";
+
+    int slot = 0;
+    for (int i = 0; i < SERIES_CACHE_SIZE; ++i)
+    {
+        if (series_cache[i].blob && series_cache[i].seq == seq && !(seq & 1) &&
+            memcmp(&series_cache[i].key, &key, sizeof(key)) == 0)
+        {
+            series_cache[i].used = ++uses;
+            resp->blob = http_blob_ref(series_cache[i].blob);
+            return;
+        }
+        if (series_cache[i].used < series_cache[slot].used)
+        {
+            slot = i;
+        }
+    }
+
+    copy_series(device, key.code, &copy);
+    struct buf out = { 0 };
+    render_series(&out, &copy, &key);
+    if (series_cache[slot].blob)
+    {
+        http_blob_unref(series_cache[slot].blob);
+    }
+    memcpy(&series_cache[slot].key, &key, sizeof(key));
+    series_cache[slot].seq = seq;
+    series_cache[slot].used = ++uses;
+    series_cache[slot].blob = http_blob_new(out.data, out.len);
+    buf_free(&out);
+    resp->blob = http_blob_ref(series_cache[slot].blob);
+}
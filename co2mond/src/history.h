@@ -0,0 +1,87 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HISTORY_H_INCLUDED_
+#define HISTORY_H_INCLUDED_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+
+/*
+ * Fixed-size history of the values reported by a device. Every code gets
+ * three ring buffers: the raw samples, and minute and hour min/max/avg
+ * buckets. Only the device thread adds samples; readers take consistent
+ * copies without blocking it.
+ */
+
+#define HISTORY_CODES 8 /* codes tracked per device */
+#define HISTORY_RAW 2048 /* samples, a little over an hour at the usual rate */
+#define HISTORY_MINUTES 1440 /* one day */
+#define HISTORY_HOURS 744 /* 31 days */
+
+struct history_sample {
+    int64_t time;
+    uint16_t value;
+};
+
+struct history_bucket {
+    int64_t time; /* start of the bucket */
+    uint16_t min;
+    uint16_t max;
+    uint32_t count;
+    uint64_t sum;
+};
+
+struct history_series {
+    unsigned int seq;
+    unsigned int code;
+    unsigned int raw_head, raw_count;
+    unsigned int minutes_head, minutes_count;
+    unsigned int hours_head, hours_count;
+    struct history_sample raw[HISTORY_RAW];
+    struct history_bucket minutes[HISTORY_MINUTES];
+    struct history_bucket hours[HISTORY_HOURS];
+};
+
+struct history {
+    struct history_series *series[HISTORY_CODES];
+};
+
+extern struct history *
+history_new();
+
+extern void
+history_add(struct history *history, unsigned int code, uint16_t value, time_t now);
+
+extern const struct history_series *
+history_find(const struct history *history, unsigned int code);
+
+extern void
+history_copy(const struct history_series *series, struct history_series *copy);
+
+extern int
+history_parse_code(const char *s, unsigned int *code);
+
+extern void
+history_handler(const struct http_request *req, struct http_response *resp);
+
+extern void
+series_handler(const struct http_request *req, struct http_response *resp);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* SOCK_CLOEXEC */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hotplug.h"
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+/*
+ * Device events are read from the NETLINK_KOBJECT_UEVENT socket, without
+ * libudev. udevd rebroadcasts each kernel event once its rules have run,
+ * prefixed by a binary header; those are preferred, since the device node
+ * then has its permissions. Without udevd, the kernel events are used and
+ * the retries after an event cover the delay.
+ */
+
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_GROUP_UDEV 2
+#define UEVENT_BUFFER_SIZE 8192
+
+/* Header of the messages sent by udevd (libudev-monitor.c). */
+struct udev_header {
+    char prefix[8]; /* "libudev" */
+    unsigned int magic; /* 0xfeedcafe in network byte order */
+    unsigned int header_size;
+    unsigned int properties_off;
+    unsigned int properties_len;
+    unsigned int filter_subsystem_hash;
+    unsigned int filter_devtype_hash;
+    unsigned int filter_tag_bloom_hi;
+    unsigned int filter_tag_bloom_lo;
+};
+
+int
+hotplug_open()
+{
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1)
+    {
+        perror("socket(NETLINK_KOBJECT_UEVENT)");
+        return -1;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = access("/run/udev/control", F_OK) == 0 ? UEVENT_GROUP_UDEV : UEVENT_GROUP_KERNEL;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("bind(NETLINK_KOBJECT_UEVENT)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Properties are NUL separated KEY=VALUE strings.
+static const char *
+property(const char *props, size_t len, const char *key)
+{
+    size_t klen = strlen(key);
+    const char *end = props + len;
+    for (const char *p = props; p < end; p += strlen(p) + 1)
+    {
+        if ((size_t)(end - p) > klen && strncmp(p, key, klen) == 0 && p[klen] == '=')
+        {
+            return p + klen + 1;
+        }
+    }
+    return NULL;
+}
+
+// Matches the same devices as udevrules/99-co2mon.rules: the USB device
+// itself (used by hidapi-libusb) and its hidraw node.
+static int
+is_co2mon(const char *props, size_t len)
+{
+    const char *subsystem = property(props, len, "SUBSYSTEM");
+    if (!subsystem)
+    {
+        return 0;
+    }
+
+    if (strcmp(subsystem, "usb") == 0)
+    {
+        const char *product = property(props, len, "PRODUCT");
+        return product && strncmp(product, "4d9/a052/", 9) == 0;
+    }
+    if (strcmp(subsystem, "hidraw") == 0)
+    {
+        // .../0003:04D9:A052.0001/hidraw/hidraw0
+        const char *devpath = property(props, len, "DEVPATH");
+        return devpath && strstr(devpath, ":04D9:A052.") != NULL;
+    }
+    return 0;
+}
+
+// Returns 1 if the last event about a monitor added it, or if events may
+// have been lost. A monitor that was added and removed again doesn't count.
+static int
+read_events(int fd)
+{
+    char buf[UEVENT_BUFFER_SIZE + 1];
+    int added = 0;
+    while (1)
+    {
+        ssize_t n = recv(fd, buf, UEVENT_BUFFER_SIZE, MSG_DONTWAIT);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == ENOBUFS)
+            {
+                // The socket buffer overflowed, the caller has to look for
+                // the devices again.
+                fprintf(stderr, "hotplug: events lost, enumerating the devices again\n");
+                return 1;
+            }
+            return added || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        buf[n] = '\0';
+
+        const char *props;
+        size_t len;
+        if ((size_t)n >= sizeof(struct udev_header) && memcmp(buf, "libudev", 8) == 0)
+        {
+            const struct udev_header *header = (const struct udev_header *)buf;
+            if (header->properties_off >= (size_t)n ||
+                header->properties_len > (size_t)n - header->properties_off)
+            {
+                continue;
+            }
+            props = buf + header->properties_off;
+            len = header->properties_len;
+        }
+        else
+        {
+            // Kernel events start with "action@devpath".
+            size_t head = strlen(buf) + 1;
+            if (head >= (size_t)n)
+            {
+                continue;
+            }
+            props = buf + head;
+            len = n - head;
+        }
+        const char *action = property(props, len, "ACTION");
+        if (action && is_co2mon(props, len))
+        {
+            if (strcmp(action, "add") == 0)
+            {
+                added = 1;
+            }
+            else if (strcmp(action, "remove") == 0)
+            {
+                added = 0;
+            }
+        }
+    }
+}
+
+int
+hotplug_wait(int fd)
+{
+    if (fd == -1)
+    {
+        usleep(HOTPLUG_POLL_MS * 1000);
+        return 0;
+    }
+
+    while (1)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            usleep(HOTPLUG_POLL_MS * 1000);
+            return 0;
+        }
+        if (read_events(fd))
+        {
+            return 1;
+        }
+    }
+}
+
+void
+hotplug_close(int fd)
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+#else
+
+int
+hotplug_open()
+{
+    return -1;
+}
+
+int
+hotplug_wait(int fd)
+{
+    (void)fd;
+    usleep(HOTPLUG_POLL_MS * 1000);
+    return 0;
+}
+
+void
+hotplug_close(int fd)
+{
+    (void)fd;
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HOTPLUG_H_INCLUDED_
+#define HOTPLUG_H_INCLUDED_
+
+#define HOTPLUG_RETRIES 20 /* opens tried after an event, until udev has set permissions */
+#define HOTPLUG_RETRY_MS 100
+#define HOTPLUG_POLL_MS 1000 /* without hotplug events, waiting is polling */
+
+/* Returns a descriptor that receives device events from udev (or from the
+ * kernel if udev is not running), or -1 where they are not available. It
+ * should be opened before the attempt to open the device, so that no
+ * event is missed in between, and closed while the device is in use, as
+ * the events would pile up in it. */
+extern int
+hotplug_open();
+
+/* Waits until a CO2 monitor (04d9:a052, as in udevrules/99-co2mon.rules) is
+ * added and returns 1; other devices' events are not visible to the caller.
+ * It also returns 1 when events were lost, the devices should then be
+ * enumerated again. With fd == -1 it sleeps for HOTPLUG_POLL_MS instead and
+ * returns 0. */
+extern int
+hotplug_wait(int fd);
+
+extern void
+hotplug_close(int fd);
+
+#endif
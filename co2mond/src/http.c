@@ -0,0 +1,933 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* strnlen, strncasecmp */
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <err.h>
+
+#include "archive.h"
+#include "co2mond.h"
+#include "dashboard.h"
+#include "history.h"
+#include "http.h"
+#include "metrics.h"
+#include "stats.h"
+#include "stream.h"
+
+#define HTTP_CONNECTIONS_MAX 256
+#define HTTP_REQUEST_MAX 8192
+#define HTTP_TIMEOUT_MS 5000 // 5 seconds, just like co2mon_read_data()
+
+enum conn_state {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_DRAINING, // response is sent, waiting till EOF before calling close()
+    CONN_STREAMING, // headers are sent, events are written as they come
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    int keep_alive;
+    int64_t deadline;
+    struct buf in;
+    struct buf out; // status line, headers and small bodies
+    size_t out_off;
+    struct http_blob *blob; // shared body sent after out
+    size_t blob_off;
+    struct histogram *latency; // of the response being sent, if the route has one
+    int64_t started; // monotonic_ns() when the request was complete
+    int stream; // the response continues with /stream events
+};
+
+static const struct route {
+    const char *path;
+    http_handler handler;
+    struct histogram *latency;
+} routes[] = {
+    { "/metrics", metrics_handler, &scrape_duration_histogram },
+    { "/history", history_handler, NULL },
+    { "/series", series_handler, NULL },
+    { "/dashboard", dashboard_handler, NULL },
+    { "/stream", stream_handler, NULL },
+    { "/archive", archive_handler, NULL },
+};
+
+static struct conn conns[HTTP_CONNECTIONS_MAX];
+static int conns_count = 0;
+
+static int64_t
+now_ms()
+{
+    return monotonic_ns() / 1000000;
+}
+
+static int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+struct http_blob *
+http_blob_new(const void *data, size_t len)
+{
+    struct http_blob *blob = malloc(sizeof(*blob) + len);
+    if (!blob)
+    {
+        err(EXIT_FAILURE, "malloc");
+    }
+    blob->refs = 1;
+    blob->len = len;
+    if (len)
+    {
+        memcpy(blob->data, data, len);
+    }
+    return blob;
+}
+
+struct http_blob *
+http_blob_ref(struct http_blob *blob)
+{
+    blob->refs++;
+    return blob;
+}
+
+void
+http_blob_unref(struct http_blob *blob)
+{
+    if (--blob->refs == 0)
+    {
+        free(blob);
+    }
+}
+
+const char *
+http_header(const struct http_request *req, const char *name, size_t *len)
+{
+    const size_t name_len = strlen(name);
+    const char *line = req->headers;
+    while (*line)
+    {
+        const char *eol = strstr(line, "\r\n");
+        if (!eol)
+        {
+            break;
+        }
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0)
+        {
+            const char *value = line + name_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+            {
+                value++;
+            }
+            const char *end = eol;
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+            {
+                end--;
+            }
+            *len = end - value;
+            return value;
+        }
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+int
+http_header_has_token(const struct http_request *req, const char *name, const char *token)
+{
+    size_t len;
+    const char *value = http_header(req, name, &len);
+    if (!value)
+    {
+        return 0;
+    }
+
+    const size_t token_len = strlen(token);
+    const char *end = value + len;
+    while (value < end)
+    {
+        while (value < end && (*value == ' ' || *value == ','))
+        {
+            value++;
+        }
+        const char *next = value;
+        while (next < end && *next != ',')
+        {
+            next++;
+        }
+        const char *last = next;
+        while (last > value && last[-1] == ' ')
+        {
+            last--;
+        }
+        if ((size_t)(last - value) == token_len && strncasecmp(value, token, token_len) == 0)
+        {
+            return 1;
+        }
+        value = next;
+    }
+    return 0;
+}
+
+int
+http_list_next(const char **pos, const char *end, struct http_list_item *item)
+{
+    const char *p = *pos;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+    {
+        p++;
+    }
+    if (p == end)
+    {
+        return 0;
+    }
+
+    const char *next = p;
+    while (next < end && *next != ',')
+    {
+        next++;
+    }
+    *pos = next;
+
+    const char *semi = memchr(p, ';', next - p);
+    const char *value_end = semi ? semi : next;
+    while (value_end > p && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+    {
+        value_end--;
+    }
+    item->value = p;
+    item->len = value_end - p;
+    item->params = semi ? semi + 1 : next;
+    item->params_len = next - item->params;
+    item->q = 1;
+
+    char q[16];
+    if (http_list_param(item, "q", q, sizeof(q)))
+    {
+        item->q = atof(q);
+    }
+    return 1;
+}
+
+int
+http_list_param(const struct http_list_item *item, const char *name, char *value, size_t size)
+{
+    const size_t name_len = strlen(name);
+    const char *p = item->params;
+    const char *end = item->params + item->params_len;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ';'))
+        {
+            p++;
+        }
+        const char *next = memchr(p, ';', end - p);
+        if (!next)
+        {
+            next = end;
+        }
+        const char *eq = memchr(p, '=', next - p);
+        if (eq && (size_t)(eq - p) == name_len && strncasecmp(p, name, name_len) == 0)
+        {
+            const char *v = eq + 1;
+            const char *v_end = next;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+            {
+                v_end--;
+            }
+            if (v_end - v >= 2 && *v == '"' && v_end[-1] == '"')
+            {
+                v++;
+                v_end--;
+            }
+            if ((size_t)(v_end - v) >= size)
+            {
+                return 0;
+            }
+            memcpy(value, v, v_end - v);
+            value[v_end - v] = '\0';
+            return 1;
+        }
+        p = next;
+    }
+    return 0;
+}
+
+static int
+hex_digit(char c)
+{
+    if ('0' <= c && c <= '9')
+    {
+        return c - '0';
+    }
+    if ('a' <= c && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if ('A' <= c && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Copies the percent-decoded value of the first `name` parameter of the
+// query string. Returns 0 if there is no such parameter or it is too long.
+int
+http_query_param(const struct http_request *req, const char *name, char *value, size_t size)
+{
+    const size_t name_len = strlen(name);
+    const char *p = req->query;
+    while (*p)
+    {
+        const char *end = strchr(p, '&');
+        if (!end)
+        {
+            end = p + strlen(p);
+        }
+        if ((size_t)(end - p) >= name_len && strncmp(p, name, name_len) == 0 &&
+            (p + name_len == end || p[name_len] == '='))
+        {
+            const char *src = p + name_len + (p + name_len < end ? 1 : 0);
+            size_t len = 0;
+            while (src < end)
+            {
+                char c = *src++;
+                if (c == '+')
+                {
+                    c = ' ';
+                }
+                else if (c == '%' && end - src >= 2 && hex_digit(src[0]) >= 0 && hex_digit(src[1]) >= 0)
+                {
+                    c = hex_digit(src[0]) * 16 + hex_digit(src[1]);
+                    src += 2;
+                }
+                if (len + 1 >= size)
+                {
+                    return 0;
+                }
+                value[len++] = c;
+            }
+            value[len] = '\0';
+            return 1;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+static const char *
+status_text(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 503: return "Service Unavailable";
+    }
+    return "Unknown";
+}
+
+static void
+response_free(struct http_response *resp)
+{
+    buf_free(&resp->headers);
+    buf_free(&resp->body);
+    if (resp->blob)
+    {
+        http_blob_unref(resp->blob);
+        resp->blob = NULL;
+    }
+}
+
+static void
+conn_respond(struct conn *c, int minor, int head, struct http_response *resp)
+{
+    const int has_body = resp->status != 304;
+    const size_t body_len = resp->blob ? resp->blob->len : resp->body.len;
+
+    buf_printf(&c->out, "HTTP/1.%d %d %s\r\n", minor, resp->status, status_text(resp->status));
+    if (resp->content_type)
+    {
+        buf_printf(&c->out, "Content-Type: %s\r\n", resp->content_type);
+    }
+    if (resp->stream)
+    {
+        // The body ends when the connection is closed.
+        c->keep_alive = 0;
+        c->stream = !head;
+        if (c->stream)
+        {
+            __atomic_add_fetch(&stream_clients, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else if (has_body)
+    {
+        buf_printf(&c->out, "Content-Length: %lu\r\n", (unsigned long)body_len);
+    }
+    buf_printf(&c->out,
+        "Server: co2mond\r\n"
+        "Connection: %s\r\n",
+        c->keep_alive ? "keep-alive" : "close"
+    );
+    buf_append(&c->out, resp->headers.data, resp->headers.len);
+    buf_puts(&c->out, "\r\n");
+    if (has_body && !head)
+    {
+        if (resp->blob)
+        {
+            c->blob = resp->blob;
+            c->blob_off = 0;
+            resp->blob = NULL;
+        }
+        else
+        {
+            buf_append(&c->out, resp->body.data, resp->body.len);
+        }
+    }
+    c->out_off = 0;
+    c->state = CONN_WRITING;
+}
+
+static void
+conn_simple(struct conn *c, int minor, int status, const char *body)
+{
+    struct http_response resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.status = status;
+    buf_puts(&resp.body, body);
+    conn_respond(c, minor, 0, &resp);
+    response_free(&resp);
+}
+
+static void
+conn_error(struct conn *c, int minor, int status, const char *body)
+{
+    c->keep_alive = 0;
+    conn_simple(c, minor, status, body);
+}
+
+// Returns 1 if a complete request was found in the input buffer.
+static int
+conn_process(struct conn *c)
+{
+    char request[HTTP_REQUEST_MAX + 1];
+    const char *end = NULL;
+
+    for (size_t i = 3; i < c->in.len; ++i)
+    {
+        if (memcmp(c->in.data + i - 3, "\r\n\r\n", 4) == 0)
+        {
+            end = c->in.data + i + 1;
+            break;
+        }
+    }
+    if (!end)
+    {
+        if (c->in.len >= HTTP_REQUEST_MAX)
+        {
+            conn_error(c, 0, 400, "Request is too large.\r\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    size_t len = end - c->in.data;
+    if (len > HTTP_REQUEST_MAX)
+    {
+        conn_error(c, 0, 400, "Request is too large.\r\n");
+        return 1;
+    }
+    // The request is parsed as a string, a NUL byte would end it early.
+    if (memchr(c->in.data, '\0', len))
+    {
+        conn_error(c, 0, 400, "Request contains a NUL byte.\r\n");
+        return 1;
+    }
+    memcpy(request, c->in.data, len);
+    request[len] = '\0';
+    buf_consume(&c->in, len);
+
+    // Request line: METHOD SP request-target SP HTTP/1.x CRLF
+    char *line_end = strstr(request, "\r\n");
+    if (!line_end)
+    {
+        conn_error(c, 0, 400, "goto /metrics;\r\n");
+        return 1;
+    }
+    *line_end = '\0';
+    char *method = request;
+    char *target = strchr(method, ' ');
+    char *version = target ? strchr(target + 1, ' ') : NULL;
+    if (!target || !version || strncmp(version + 1, "HTTP/1.", 7) != 0 ||
+        (version[8] != '0' && version[8] != '1') || version[9] != '\0')
+    {
+        conn_error(c, 0, 400, "goto /metrics;\r\n");
+        return 1;
+    }
+    *target++ = '\0';
+    *version++ = '\0';
+    const int minor = version[7] - '0';
+
+    struct http_request req;
+    req.head = strcmp(method, "HEAD") == 0;
+    req.path = target;
+    req.headers = line_end + 2;
+    char *query = strchr(target, '?');
+    if (query)
+    {
+        *query++ = '\0';
+        req.query = query;
+    }
+    else
+    {
+        req.query = "";
+    }
+
+    if (minor == 0)
+    {
+        c->keep_alive = http_header_has_token(&req, "Connection", "keep-alive");
+    }
+    else
+    {
+        c->keep_alive = !http_header_has_token(&req, "Connection", "close");
+    }
+
+    if (strcmp(method, "GET") != 0 && !req.head)
+    {
+        conn_error(c, minor, 405, "Only GET and HEAD are supported.\r\n");
+        return 1;
+    }
+
+    const struct route *route = NULL;
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); ++i)
+    {
+        if (strcmp(routes[i].path, req.path) == 0)
+        {
+            route = &routes[i];
+            break;
+        }
+    }
+    if (!route)
+    {
+        conn_simple(c, minor, 404, "goto /metrics;\r\n");
+        return 1;
+    }
+
+    c->latency = route->latency;
+    if (c->latency)
+    {
+        c->started = monotonic_ns();
+    }
+
+    struct http_response resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.status = 200;
+    route->handler(&req, &resp);
+    conn_respond(c, minor, req.head, &resp);
+    response_free(&resp);
+    return 1;
+}
+
+static void
+conn_close(struct conn *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    if (c->stream)
+    {
+        __atomic_sub_fetch(&stream_clients, 1, __ATOMIC_RELAXED);
+        c->stream = 0;
+    }
+    buf_free(&c->in);
+    buf_free(&c->out);
+    if (c->blob)
+    {
+        http_blob_unref(c->blob);
+        c->blob = NULL;
+    }
+}
+
+static void
+conn_read(struct conn *c, int64_t now)
+{
+    char chunk[4096];
+    while (1)
+    {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (n == 0)
+        {
+            conn_close(c);
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn_close(c);
+            }
+            break;
+        }
+        if (c->state == CONN_READING)
+        {
+            buf_append(&c->in, chunk, n);
+            if (c->in.len >= HTTP_REQUEST_MAX)
+            {
+                break;
+            }
+        }
+    }
+
+    if (c->fd != -1 && c->state == CONN_READING && conn_process(c))
+    {
+        c->deadline = now + HTTP_TIMEOUT_MS;
+    }
+}
+
+static void
+conn_write(struct conn *c, int64_t now)
+{
+    while (1)
+    {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (c->out_off < c->out.len)
+        {
+            iov[iovcnt].iov_base = c->out.data + c->out_off;
+            iov[iovcnt].iov_len = c->out.len - c->out_off;
+            iovcnt++;
+        }
+        if (c->blob && c->blob_off < c->blob->len)
+        {
+            iov[iovcnt].iov_base = c->blob->data + c->blob_off;
+            iov[iovcnt].iov_len = c->blob->len - c->blob_off;
+            iovcnt++;
+        }
+        if (iovcnt == 0)
+        {
+            break;
+        }
+
+        ssize_t n = writev(c->fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn_close(c);
+            }
+            return;
+        }
+
+        size_t head = c->out.len - c->out_off;
+        if ((size_t)n < head)
+        {
+            c->out_off += n;
+        }
+        else
+        {
+            c->out_off = c->out.len;
+            c->blob_off += n - head;
+        }
+    }
+
+    c->out.len = 0;
+    c->out_off = 0;
+    if (c->blob)
+    {
+        http_blob_unref(c->blob);
+        c->blob = NULL;
+    }
+    if (c->latency)
+    {
+        histogram_observe(c->latency, monotonic_ns() - c->started);
+        c->latency = NULL;
+    }
+    if (c->stream)
+    {
+        if (c->state != CONN_STREAMING)
+        {
+            c->state = CONN_STREAMING;
+            c->deadline = now + STREAM_HEARTBEAT_MS;
+        }
+        return;
+    }
+    c->deadline = now + HTTP_TIMEOUT_MS;
+    if (!c->keep_alive)
+    {
+        if (shutdown(c->fd, SHUT_WR) != 0)
+        {
+            conn_close(c);
+            return;
+        }
+        c->state = CONN_DRAINING;
+        return;
+    }
+
+    // The next request might be already buffered (pipelining).
+    c->state = CONN_READING;
+    if (conn_process(c))
+    {
+        conn_write(c, now);
+    }
+}
+
+// A comment line keeps proxies from closing an idle stream. Output that
+// is still unsent a whole heartbeat later belongs to a stalled client.
+static void
+stream_heartbeat(struct conn *c, int64_t now)
+{
+    if (c->out.len > 0)
+    {
+        __atomic_add_fetch(&stream_dropped_total, 1, __ATOMIC_RELAXED);
+        conn_close(c);
+        return;
+    }
+    buf_puts(&c->out, ":\n\n");
+    c->deadline = now + STREAM_HEARTBEAT_MS;
+    conn_write(c, now);
+}
+
+// Formats the new readings once and queues them for every stream client.
+// Clients that have not read the previous STREAM_CLIENT_BUFFER_MAX bytes
+// are disconnected rather than buffered for without bound.
+static void
+stream_fan_out(int64_t now)
+{
+    static struct buf events;
+
+    events.len = 0;
+    stream_collect(&events);
+    if (events.len == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < conns_count; ++i)
+    {
+        struct conn *c = &conns[i];
+        if (c->fd == -1 || !c->stream)
+        {
+            continue;
+        }
+        if (c->out.len - c->out_off + events.len > STREAM_CLIENT_BUFFER_MAX)
+        {
+            __atomic_add_fetch(&stream_dropped_total, 1, __ATOMIC_RELAXED);
+            conn_close(c);
+            continue;
+        }
+        buf_append(&c->out, events.data, events.len);
+        conn_write(c, now);
+    }
+}
+
+static void
+accept_connections(int listen_fd, int64_t now)
+{
+    while (conns_count < HTTP_CONNECTIONS_MAX)
+    {
+        const int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("accept");
+            }
+            return;
+        }
+
+        if (set_nonblocking(client_fd) != 0)
+        {
+            perror("fcntl");
+            close(client_fd);
+            continue;
+        }
+
+        struct conn *c = &conns[conns_count++];
+        memset(c, 0, sizeof(*c));
+        c->fd = client_fd;
+        c->state = CONN_READING;
+        c->deadline = now + HTTP_TIMEOUT_MS;
+    }
+}
+
+static void*
+http_thread(void *arg)
+{
+    const int listen_fd = (ssize_t)arg;
+    static struct pollfd fds[HTTP_CONNECTIONS_MAX + 2];
+
+    while (1)
+    {
+        int64_t now = now_ms();
+        int timeout = -1;
+
+        fds[0].fd = listen_fd;
+        fds[0].events = conns_count < HTTP_CONNECTIONS_MAX ? POLLIN : 0;
+        fds[1].fd = stream_http_fd();
+        fds[1].events = POLLIN;
+        for (int i = 0; i < conns_count; ++i)
+        {
+            fds[i + 2].fd = conns[i].fd;
+            if (conns[i].state == CONN_STREAMING)
+            {
+                fds[i + 2].events = POLLIN | (conns[i].out.len > 0 ? POLLOUT : 0);
+            }
+            else
+            {
+                fds[i + 2].events = conns[i].state == CONN_WRITING ? POLLOUT : POLLIN;
+            }
+            int left = conns[i].deadline > now ? (int)(conns[i].deadline - now) : 0;
+            if (timeout == -1 || left < timeout)
+            {
+                timeout = left;
+            }
+        }
+        const int polled = conns_count;
+
+        if (poll(fds, polled + 2, timeout) == -1)
+        {
+            if (errno != EINTR)
+            {
+                err(EXIT_FAILURE, "poll");
+            }
+            continue;
+        }
+        now = now_ms();
+
+        for (int i = 0; i < polled; ++i)
+        {
+            struct conn *c = &conns[i];
+            const short revents = fds[i + 2].revents;
+            if (revents & POLLNVAL)
+            {
+                conn_close(c);
+            }
+            else if (c->state == CONN_STREAMING)
+            {
+                // Anything the client sends is discarded, EOF closes.
+                if (revents & (POLLIN | POLLERR | POLLHUP))
+                {
+                    conn_read(c, now);
+                }
+                if (c->fd != -1 && (revents & POLLOUT))
+                {
+                    conn_write(c, now);
+                }
+            }
+            else if (c->state == CONN_WRITING && (revents & (POLLOUT | POLLERR | POLLHUP)))
+            {
+                conn_write(c, now);
+            }
+            else if (c->state != CONN_WRITING && (revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                conn_read(c, now);
+                if (c->fd != -1 && c->state == CONN_WRITING)
+                {
+                    conn_write(c, now);
+                }
+            }
+
+            if (c->fd != -1 && c->deadline <= now)
+            {
+                if (c->state == CONN_STREAMING)
+                {
+                    stream_heartbeat(c, now);
+                }
+                else
+                {
+                    conn_close(c);
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            stream_fan_out(now);
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            accept_connections(listen_fd, now);
+        }
+
+        int alive = 0;
+        for (int i = 0; i < conns_count; ++i)
+        {
+            if (conns[i].fd != -1)
+            {
+                conns[alive++] = conns[i];
+            }
+        }
+        conns_count = alive;
+    }
+    return NULL;
+}
+
+void
+http_start(int listen_fd)
+{
+    pthread_t tid;
+
+    if (set_nonblocking(listen_fd) != 0)
+    {
+        err(EXIT_FAILURE, "fcntl");
+    }
+
+    stream_http_init();
+
+    if (pthread_create(&tid, NULL, http_thread, (void*)((size_t)listen_fd)) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    if (pthread_detach(tid) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_detach");
+    }
+}
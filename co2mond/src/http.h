@@ -0,0 +1,88 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTP_H_INCLUDED_
+#define HTTP_H_INCLUDED_
+
+#include "buf.h"
+
+struct http_request {
+    int head; /* HEAD request, the body is not sent */
+    const char *path; /* without the query string */
+    const char *query; /* empty if there is no query string */
+    const char *headers; /* header lines, each terminated by \r\n */
+};
+
+/* Immutable, reference counted body that can be shared by several
+ * responses. Only used from the HTTP thread. */
+struct http_blob {
+    unsigned int refs;
+    size_t len;
+    char data[];
+};
+
+struct http_response {
+    int status;
+    const char *content_type;
+    struct buf headers; /* extra header lines, each terminated by \r\n */
+    struct buf body;
+    struct http_blob *blob; /* sent instead of body if set, the response owns a reference */
+    int stream; /* the body is followed by /stream events until the client goes away */
+};
+
+typedef void (*http_handler)(const struct http_request *req, struct http_response *resp);
+
+extern struct http_blob *
+http_blob_new(const void *data, size_t len);
+
+extern struct http_blob *
+http_blob_ref(struct http_blob *blob);
+
+extern void
+http_blob_unref(struct http_blob *blob);
+
+extern const char *
+http_header(const struct http_request *req, const char *name, size_t *len);
+
+extern int
+http_header_has_token(const struct http_request *req, const char *name, const char *token);
+
+/* An element of a list header such as Accept or Accept-Encoding. */
+struct http_list_item {
+    const char *value; /* media type or coding, without parameters */
+    size_t len;
+    const char *params; /* after the first ';', q included */
+    size_t params_len;
+    double q; /* 1 if not given */
+};
+
+/* Takes the next element of a list header value that starts at *pos and
+ * ends at end. Returns 0 when there are no more elements. */
+extern int
+http_list_next(const char **pos, const char *end, struct http_list_item *item);
+
+/* Copies the value of a parameter of an element, without quotes. */
+extern int
+http_list_param(const struct http_list_item *item, const char *name, char *value, size_t size);
+
+extern int
+http_query_param(const struct http_request *req, const char *name, char *value, size_t size);
+
+extern void
+http_start(int listen_fd);
+
+#endif
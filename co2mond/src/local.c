@@ -0,0 +1,453 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE /* struct ucred */
+
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+
+#include "co2mon.h"
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "local.h"
+#include "stream.h"
+
+/*
+ * Local socket protocol server.
+ *
+ * A single thread polls the listening socket, the clients and a stream
+ * reader. Snapshots are taken from the device states without locking,
+ * like /metrics; new readings are converted to records once and appended
+ * to every subscriber. The socket is world-writable and the peer
+ * credentials decide who is served.
+ */
+
+struct client {
+    int fd;
+    int subscribed;
+    size_t in_len;
+    unsigned char in[sizeof(struct co2mon_request)];
+    struct buf out;
+    size_t out_off;
+};
+
+static int listen_fd = -1;
+static struct stream_reader *reader;
+static struct client clients[LOCAL_CLIENTS_MAX];
+static int clients_count = 0;
+
+static int clients_gauge;
+static uint64_t rejected_total;
+static uint64_t dropped_total;
+
+static int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void
+local_init(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errx(EXIT_FAILURE, "%s: path is too long", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) != 0)
+    {
+        err(EXIT_FAILURE, "unlink(%s)", path);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
+    {
+        err(EXIT_FAILURE, "socket");
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        err(EXIT_FAILURE, "bind(%s)", path);
+    }
+    if (chmod(path, 0666) != 0)
+    {
+        err(EXIT_FAILURE, "chmod(%s)", path);
+    }
+    if (listen(listen_fd, 16) != 0 || set_nonblocking(listen_fd) != 0)
+    {
+        err(EXIT_FAILURE, "listen(%s)", path);
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        err(EXIT_FAILURE, "signal(SIGPIPE, SIG_IGN)");
+    }
+
+    reader = stream_reader_new();
+}
+
+static int
+peer_allowed(int fd)
+{
+    uid_t uid;
+    gid_t gid;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    {
+        return 0;
+    }
+    uid = cred.uid;
+    gid = cred.gid;
+#else
+    if (getpeereid(fd, &uid, &gid) != 0)
+    {
+        return 0;
+    }
+#endif
+    return uid == 0 || uid == geteuid() || gid == getegid();
+}
+
+static void
+client_close(struct client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    buf_free(&c->out);
+    __atomic_sub_fetch(&clients_gauge, 1, __ATOMIC_RELAXED);
+}
+
+static void
+append_record(struct buf *out, int device, unsigned char code, uint16_t value, int64_t time_ms, int flags)
+{
+    struct co2mon_record record;
+    memset(&record, 0, sizeof(record));
+    record.device = device;
+    record.code = code;
+    record.flags = flags;
+    record.value = value;
+    record.time = time_ms;
+    buf_append(out, &record, sizeof(record));
+}
+
+static void
+append_snapshot(struct buf *out)
+{
+    static struct co2mon_state state; // only used by the local thread
+
+    devices_lock();
+    int count = devices_count;
+    devices_unlock();
+
+    for (int d = 0; d < count; ++d)
+    {
+        state_read(&devices[d], &state);
+        for (int i = 0; i < state.codes_count; ++i)
+        {
+            const struct code_state *c = &state.codes[i];
+            append_record(out, d, c->code, c->value, c->time_ms, 0);
+        }
+    }
+    append_record(out, 0, 0, 0, realtime_ms(), CO2MON_RECORD_END);
+}
+
+// Unsent bytes. Past LOCAL_CLIENT_BUFFER_MAX, requests are left unread
+// until the client catches up.
+static size_t
+client_pending(const struct client *c)
+{
+    return c->out.len - c->out_off;
+}
+
+static void
+client_write(struct client *c)
+{
+    while (c->out_off < c->out.len)
+    {
+        ssize_t n = send(c->fd, c->out.data + c->out_off, c->out.len - c->out_off, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                client_close(c);
+            }
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.len = 0;
+    c->out_off = 0;
+}
+
+static void
+client_read(struct client *c)
+{
+    while (client_pending(c) < LOCAL_CLIENT_BUFFER_MAX)
+    {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0)
+        {
+            client_close(c);
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                client_close(c);
+            }
+            return;
+        }
+        c->in_len += n;
+        if (c->in_len < sizeof(c->in))
+        {
+            continue;
+        }
+        c->in_len = 0;
+
+        // A subscription only sends, further requests are ignored.
+        if (c->subscribed)
+        {
+            continue;
+        }
+
+        struct co2mon_request req;
+        memcpy(&req, c->in, sizeof(req));
+        if (req.op != CO2MON_REQUEST_SNAPSHOT && req.op != CO2MON_REQUEST_SUBSCRIBE)
+        {
+            client_close(c);
+            return;
+        }
+        append_snapshot(&c->out);
+        c->subscribed = req.op == CO2MON_REQUEST_SUBSCRIBE;
+        client_write(c);
+        if (c->fd == -1)
+        {
+            return;
+        }
+    }
+}
+
+static void
+fan_out()
+{
+    static struct buf records;
+    struct stream_reading batch[64];
+    int n;
+
+    records.len = 0;
+    do
+    {
+        n = stream_read(reader, batch, 64);
+        for (int i = 0; i < n; ++i)
+        {
+            append_record(&records, batch[i].device, batch[i].code, batch[i].value, batch[i].time_ms, 0);
+        }
+    } while (n == 64);
+    if (records.len == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < clients_count; ++i)
+    {
+        struct client *c = &clients[i];
+        if (c->fd == -1 || !c->subscribed)
+        {
+            continue;
+        }
+        if (client_pending(c) + records.len > LOCAL_CLIENT_BUFFER_MAX)
+        {
+            __atomic_add_fetch(&dropped_total, 1, __ATOMIC_RELAXED);
+            client_close(c);
+            continue;
+        }
+        buf_append(&c->out, records.data, records.len);
+        client_write(c);
+    }
+}
+
+static void
+accept_clients()
+{
+    while (clients_count < LOCAL_CLIENTS_MAX)
+    {
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("accept");
+            }
+            return;
+        }
+
+        if (!peer_allowed(fd))
+        {
+            __atomic_add_fetch(&rejected_total, 1, __ATOMIC_RELAXED);
+            close(fd);
+            continue;
+        }
+        if (set_nonblocking(fd) != 0)
+        {
+            perror("fcntl");
+            close(fd);
+            continue;
+        }
+
+        struct client *c = &clients[clients_count++];
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        __atomic_add_fetch(&clients_gauge, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void*
+local_thread(void *arg)
+{
+    (void)arg;
+    static struct pollfd fds[LOCAL_CLIENTS_MAX + 2];
+
+    while (1)
+    {
+        fds[0].fd = listen_fd;
+        fds[0].events = clients_count < LOCAL_CLIENTS_MAX ? POLLIN : 0;
+        fds[1].fd = stream_reader_fd(reader);
+        fds[1].events = POLLIN;
+        for (int i = 0; i < clients_count; ++i)
+        {
+            fds[i + 2].fd = clients[i].fd;
+            fds[i + 2].events = (client_pending(&clients[i]) < LOCAL_CLIENT_BUFFER_MAX ? POLLIN : 0) |
+                (clients[i].out.len > 0 ? POLLOUT : 0);
+        }
+        const int polled = clients_count;
+
+        if (poll(fds, polled + 2, -1) == -1)
+        {
+            if (errno != EINTR)
+            {
+                err(EXIT_FAILURE, "poll");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < polled; ++i)
+        {
+            struct client *c = &clients[i];
+            const short revents = fds[i + 2].revents;
+            if (revents & POLLNVAL)
+            {
+                client_close(c);
+                continue;
+            }
+            if (revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                client_read(c);
+            }
+            if (c->fd != -1 && (revents & POLLOUT))
+            {
+                client_write(c);
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            fan_out();
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            accept_clients();
+        }
+
+        int alive = 0;
+        for (int i = 0; i < clients_count; ++i)
+        {
+            if (clients[i].fd != -1)
+            {
+                clients[alive++] = clients[i];
+            }
+        }
+        clients_count = alive;
+    }
+    return NULL;
+}
+
+void
+local_start()
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, local_thread, NULL) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    if (pthread_detach(tid) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_detach");
+    }
+}
+
+void
+render_local_stats(struct expo *e)
+{
+    if (listen_fd == -1)
+    {
+        return;
+    }
+
+    expo_family(e, "co2mon_local_clients", "Connected local socket clients.", EXPO_GAUGE);
+    expo_sample(e, NULL, 0, __atomic_load_n(&clients_gauge, __ATOMIC_RELAXED), 0);
+    expo_family(e, "co2mon_local_rejected_total", "Local socket connections refused by the credential check.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&rejected_total, __ATOMIC_RELAXED), 0);
+    expo_family(e, "co2mon_local_dropped_total", "Local subscribers disconnected for being too slow.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&dropped_total, __ATOMIC_RELAXED), 0);
+}
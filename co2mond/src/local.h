@@ -0,0 +1,38 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LOCAL_H_INCLUDED_
+#define LOCAL_H_INCLUDED_
+
+#include "expo.h"
+
+#define LOCAL_CLIENTS_MAX 64
+#define LOCAL_CLIENT_BUFFER_MAX 65536 /* unsent bytes of a client: requests wait, subscriptions are dropped */
+
+/* Binds the Unix socket of the local protocol (see co2mon.h), replacing a
+ * stale socket left at path. Exits on error. */
+extern void
+local_init(const char *path);
+
+/* Starts the thread that serves the local clients. */
+extern void
+local_start();
+
+extern void
+render_local_stats(struct expo *e);
+
+#endif
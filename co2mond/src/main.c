@@ -22,7 +22,6 @@
 #define _DARWIN_C_SOURCE /* daemon() on macOS */
 
 #include <pthread.h>
-#include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdint.h>
@@ -31,387 +30,191 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <err.h>
 
+#include "alert.h"
+#include "archive.h"
 #include "co2mon.h"
-
-#define CODE_TAMB 0x42 /* Ambient Temperature */
-#define CODE_CNTR 0x50 /* Relative Concentration of CO2 */
-
-#define PATH_MAX 4096
-#define VALUE_MAX 20
+#include "co2mond.h"
+#include "datadir.h"
+#include "history.h"
+#include "hotplug.h"
+#include "http.h"
+#include "local.h"
+#include "push.h"
+#include "rolling.h"
+#include "stats.h"
+#include "stream.h"
+
+#define LOG_FLUSH_INTERVAL_MS 60000
 
 int daemonize = 0;
 int print_unknown = 0;
 static int decode_data = -1; /* -1 == auto-detect old/new release devices */
-const char *devicefile = NULL;
-char *datadir;
-
-struct co2mon_state {
-    uint16_t data[256];
-    uint8_t seen[32];
-    time_t heatbeat;
-    unsigned int deverr;
-};
-
-pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
-struct co2mon_state co2mon;
-
-static int
-bitarr_isset(uint8_t* bitarr, unsigned int ndx)
+const char *devicefiles[DEVICES_MAX];
+int devicefiles_count = 0;
+int all_devices = 0;
+int multi_device = 0;
+char *logdir;
+char *archivedir;
+char *capturedir;
+co2mon_shm shm;
+
+pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct device devices[DEVICES_MAX];
+int devices_count = 0;
+
+void
+devices_lock()
 {
-    return bitarr[ndx >> 3] & (1u << (ndx & 0x07u)) ? 1 : 0;
-}
-
-static void
-bitarr_set(uint8_t* bitarr, unsigned int ndx)
-{
-    bitarr[ndx >> 3] |= 1u << (ndx & 0x07u);
-}
+    if (pthread_mutex_trylock(&devices_mutex) == 0)
+    {
+        histogram_observe(&lock_wait_histogram, 0);
+        return;
+    }
 
-static void
-state_lock()
-{
-    if (pthread_mutex_lock(&state_mutex) != 0)
+    int64_t start = monotonic_ns();
+    if (pthread_mutex_lock(&devices_mutex) != 0)
     {
         err(EXIT_FAILURE, "pthread_mutex_lock");
     }
+    histogram_observe(&lock_wait_histogram, monotonic_ns() - start);
 }
 
-static void
-state_unlock()
+void
+devices_unlock()
 {
-    if (pthread_mutex_unlock(&state_mutex) != 0)
+    if (pthread_mutex_unlock(&devices_mutex) != 0)
     {
         err(EXIT_FAILURE, "pthread_mutex_unlock");
     }
 }
 
-static int
-lock(int fd, short int type)
-{
-    struct flock lock;
-    lock.l_start = 0;
-    lock.l_len = 0;
-    lock.l_whence = SEEK_SET;
-    lock.l_type = type;
-    return fcntl(fd, F_SETLKW, &lock);
-}
-
-static double
-decode_temperature(uint16_t w)
-{
-    return (double)w * 0.0625 - 273.15;
-}
-
-static int
-write_data(int fd, const char *value)
+static void
+publish_shm(struct device *device)
 {
-    char data[VALUE_MAX + 1];
-    snprintf(data, VALUE_MAX + 1, "%s\n", value);
-
-    if (lock(fd, F_WRLCK) != 0)
+    if (!shm || device->shm_index < 0)
     {
-        perror("lock");
-        return 0;
-    }
-
-    if (ftruncate(fd, 0) != 0)
-    {
-        perror("ftruncate");
-        return 0;
-    }
-
-    ssize_t len = strnlen(data, VALUE_MAX + 1);
-    if (write(fd, data, len) != len)
-    {
-        perror("write");
-        return 0;
+        return;
     }
 
-    if (lock(fd, F_UNLCK) != 0)
+    // Only this device's thread changes its state, no need for state_read().
+    struct co2mon_snapshot *snapshot = co2mon_shm_write_begin(shm, device->shm_index);
+    snapshot->heartbeat = device->state.heatbeat;
+    snapshot->errors = device->state.deverr;
+    memset(snapshot->seen, 0, sizeof(snapshot->seen));
+    for (int i = 0; i < device->state.codes_count; ++i)
     {
-        perror("unlock");
-        return 0;
+        const struct code_state *c = &device->state.codes[i];
+        snapshot->data[c->code] = c->value;
+        bitarr_set(snapshot->seen, c->code);
     }
-
-    return 1;
-}
-
-static int
-write_value(const char *name, const char *value)
-{
-    if (!datadir)
-    {
-        return 1;
-    }
-
-    char filename[PATH_MAX];
-    snprintf(filename, PATH_MAX, "%s/%s", datadir, name);
-
-    int fd = open(filename, O_CREAT | O_WRONLY, 0666);
-    if (fd == -1)
-    {
-        perror(filename);
-        return 0;
-    }
-
-    int result = write_data(fd, value);
-    close(fd);
-    return result;
+    co2mon_shm_write_end(shm, device->shm_index);
 }
 
 static void
-write_heartbeat()
+write_heartbeat(struct device *device)
 {
     char buf[VALUE_MAX];
     const time_t now = time(0);
     snprintf(buf, VALUE_MAX, "%lld", (long long)now);
-    write_value("heartbeat", buf);
-    state_lock();
-    co2mon.heatbeat = now;
-    state_unlock();
+    write_value(device, "heartbeat", buf);
+    state_write_begin(device);
+    device->state.heatbeat = now;
+    state_write_end(device);
+    publish_shm(device);
 }
 
-static int
-read_match_path(FILE* fd)
+static void
+device_error(struct device *device, enum device_error_kind kind)
 {
-    // Prefix has no \r\n to support HTTP/1.0 requests with no headers.
-    const char *prefix = "GET /metrics HTTP/1.";
-    const int len = strlen(prefix);
-    for (int i = 0; i < len; ++i)
-    {
-        int next = fgetc(fd);
-        if (next == EOF || next != prefix[i]) // EOF or mismatch
-        {
-            return -1;
-        }
-    }
-    return 0;
+    state_write_begin(device);
+    device->state.deverr++;
+    device->state.errors[kind]++;
+    state_write_end(device);
+    publish_shm(device);
 }
 
-static int
-read_find_crlfcrlf(FILE* fd)
+static void
+print_value(struct device *device, const char *name, const char *value)
 {
-    const char *substring = "\x0d\x0a\x0d\x0a";
-    const int len = strlen(substring);
-    // automata is tivial as `substring` has no repeated chars
-    for (int i = 0; i < len; ++i)
+    if (multi_device)
     {
-        assert(i >= 0);
-        int next = fgetc(fd);
-        if (next == EOF)
-        {
-            return -1;
-        }
-        if (next != substring[i])
-        {
-            if (next == substring[0])
-            {
-                i = 0;
-            }
-            else
-            {
-                i = -1;
-            }
-        }
+        printf("%s\t%s\t%s\n", name, value, device->name);
     }
-    return 0;
-}
-
-static void*
-prometheus_thread(void *arg)
-{
-    const int listen_fd = (ssize_t)arg;
-    while (1) {
-        const int client_fd = accept(listen_fd, NULL, NULL);
-        const struct timeval maxdelay = { 5, 0 }; // 5 seconds, just like co2mon_read_data()
-        struct co2mon_state copy;
-        FILE* out = NULL;
-
-        if (client_fd == -1)
-        {
-            perror("accept");
-            continue;
-        }
-
-        if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &maxdelay, sizeof(maxdelay)) != 0 ||
-            setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &maxdelay, sizeof(maxdelay)) != 0)
-        {
-            perror("setsockopt");
-            goto cleanup;
-        }
-
-        out = fdopen(client_fd, "a+b");
-        if (!out)
-        {
-            perror("fdopen");
-            goto cleanup;
-        }
-
-        if (read_match_path(out) != 0 || read_find_crlfcrlf(out) != 0)
-        {
-            fprintf(out,
-                "HTTP/1.0 400 Bad Request\r\n"
-                "Server: co2mond\r\n"
-                "Connection: close\r\n"
-                "\r\n"
-                "goto /metrics;\r\n"
-            );
-            goto flush;
-        }
-
-        state_lock();
-        memcpy(&copy, &co2mon, sizeof(copy));
-        state_unlock();
-
-        if (!bitarr_isset(copy.seen, CODE_TAMB) || !bitarr_isset(copy.seen, CODE_CNTR))
-        {
-            fprintf(out,
-                "HTTP/1.0 503 Service Unavailable\r\n"
-                "Server: co2mond\r\n"
-                "Connection: close\r\n"
-                "\r\n"
-                "Device not ready.\r\n"
-            );
-            goto flush;
-        }
-
-        fprintf(out,
-            "HTTP/1.0 200 OK\r\n"
-            "Content-Type: text/plain; charset=utf-8\r\n"
-            "Server: co2mond\r\n"
-            "Connection: close\r\n"
-            "\r\n"
-        );
-
-        // Note, HTTP has \r\n and Prometheus uses \n as line separator.
-
-        if (print_unknown)
-        {
-            int has_unknown = 0;
-            for (int i = 0; i < sizeof(copy.data) / sizeof(copy.data[0]); ++i)
-            {
-                if (bitarr_isset(copy.seen, i) && i != CODE_TAMB && i != CODE_CNTR)
-                {
-                    has_unknown = 1;
-                    break;
-                }
-            }
-            if (has_unknown)
-            {
-                fprintf(out,
-                    "# HELP co2mon_unknown Unknown value.\n"
-                    "# TYPE co2mon_unknown gauge\n"
-                );
-                for (int i = 0; i < sizeof(copy.data) / sizeof(copy.data[0]); ++i)
-                {
-                    if (bitarr_isset(copy.seen, i) && i != CODE_TAMB && i != CODE_CNTR)
-                    {
-                        fprintf(out, "co2mon_unknown{key=\"x%02x\"} %d\n", i, copy.data[i]);
-                    }
-                }
-            }
-        }
-        fprintf(out,
-            "# HELP co2mon_temp_celsius Ambient temperature.\n"
-            "# TYPE co2mon_temp_celsius gauge\n"
-            "co2mon_temp_celsius %.4f\n"
-            "# HELP co2mon_co2_ppm Concentration of CO2, parts per million.\n"
-            "# TYPE co2mon_co2_ppm gauge\n"
-            "co2mon_co2_ppm %d\n"
-            "# HELP co2mon_device_errors_total CO2 monitor device error counter.\n"
-            "# TYPE co2mon_device_errors_total counter\n"
-            "co2mon_device_errors_total %d\n"
-            "# HELP co2mon_heartbeat_time_seconds CO2 monitor heartbeat timestamp.\n"
-            "# TYPE co2mon_heartbeat_time_seconds gauge\n"
-            "co2mon_heartbeat_time_seconds %lld\n",
-            decode_temperature(copy.data[CODE_TAMB]),
-            copy.data[CODE_CNTR],
-            copy.deverr,
-            (long long)copy.heatbeat
-        );
-flush:
-        fflush(out);
-        if (shutdown(client_fd, SHUT_WR) != 0)
-        {
-            perror("shutdown");
-            goto cleanup;
-        }
-        fgetc(out); // wait till EOF (or timeout) before calling close()
-cleanup:
-        if (out)
-        {
-            fclose(out);
-        }
-        else
-        {
-            close(client_fd);
-        }
-
+    else
+    {
+        printf("%s\t%s\n", name, value);
     }
+    fflush(stdout);
 }
 
 static void
-device_loop(co2mon_device dev)
+device_loop(struct device *device, co2mon_device dev)
 {
     co2mon_data_t magic_table = { 0 };
     co2mon_data_t result;
     uint16_t written_tamb = 0;
     uint16_t written_cntr = 0;
+    int64_t last_frame = 0;
 
     if (!co2mon_send_magic_table(dev, magic_table))
     {
-        state_lock();
-        co2mon.deverr++;
-        state_unlock();
+        device_error(device, ERROR_MAGIC_TABLE);
         fprintf(stderr, "Unable to send magic table to CO2 device\n");
         return;
     }
 
-    state_lock();
-    memset(co2mon.seen, 0, sizeof(co2mon.seen));
-    state_unlock();
+    state_write_begin(device);
+    device->state.codes_count = 0;
+    state_write_end(device);
+    publish_shm(device);
 
     while (1)
     {
         int r = co2mon_read_data(dev, magic_table, result);
         if (r <= 0)
         {
-            state_lock();
-            co2mon.deverr++;
-            state_unlock();
+            device_error(device, ERROR_READ);
             fprintf(stderr, "Error while reading data from device\n");
             break;
         }
 
-        if (result[4] != 0x0d)
+        const int64_t arrived = monotonic_ns();
+        if (last_frame)
         {
-            state_lock();
-            co2mon.deverr++;
-            state_unlock();
-            fprintf(stderr, "Unexpected data from device (data[4] = %02hhx, want 0x0d)\n", result[4]);
-            continue;
+            histogram_observe(&frame_interval_histogram, arrived - last_frame);
         }
+        last_frame = arrived;
 
-        unsigned char r0, r1, r2, r3, checksum;
-        r0 = result[0];
-        r1 = result[1];
-        r2 = result[2];
-        r3 = result[3];
-        checksum = r0 + r1 + r2;
-        if (checksum != r3)
+        switch (frame_check(result))
         {
-            state_lock();
-            co2mon.deverr++;
-            state_unlock();
-            fprintf(stderr, "checksum error (%02hhx, await %02hhx)\n", checksum, r3);
+        case FRAME_OK:
+            if (device->plugged_ns)
+            {
+                int64_t latency = arrived - device->plugged_ns;
+                histogram_observe(&reconnect_latency_histogram, latency);
+                fprintf(stderr, "Reconnected in %lld ms\n", (long long)(latency / 1000000));
+                device->plugged_ns = 0;
+            }
+            break;
+        case FRAME_BAD_TRAILER:
+            device_error(device, ERROR_TRAILER);
+            fprintf(stderr, "Unexpected data from device (data[4] = %02hhx, want 0x0d)\n", result[4]);
+            continue;
+        case FRAME_BAD_CHECKSUM:
+            device_error(device, ERROR_CHECKSUM);
+            fprintf(stderr, "checksum error (%02hhx, await %02hhx)\n", (unsigned char)(result[0] + result[1] + result[2]), result[3]);
             continue;
         }
 
+        unsigned char r0 = result[0];
+
         char buf[VALUE_MAX];
         uint16_t w = (result[1] << 8) + result[2];
 
@@ -422,19 +225,18 @@ device_loop(co2mon_device dev)
 
             if (!daemonize)
             {
-                printf("Tamb\t%s\n", buf);
-                fflush(stdout);
+                print_value(device, "Tamb", buf);
             }
 
             if (written_tamb != w)
             {
-                if (write_value("Tamb", buf))
+                if (write_value(device, "Tamb", buf))
                 {
                     written_tamb = w;
                 }
             }
 
-            write_heartbeat();
+            write_heartbeat(device);
 
             break;
         case CODE_CNTR:
@@ -446,88 +248,441 @@ device_loop(co2mon_device dev)
 
             if (!daemonize)
             {
-                printf("CntR\t%s\n", buf);
-                fflush(stdout);
+                print_value(device, "CntR", buf);
             }
 
             if (written_cntr != w)
             {
-                if (write_value("CntR", buf))
+                if (write_value(device, "CntR", buf))
                 {
                     written_cntr = w;
                 }
             }
 
-            write_heartbeat();
+            write_heartbeat(device);
 
             break;
         default:
             if (print_unknown && !daemonize)
             {
-                printf("0x%02hhx\t%d\n", r0, (int)w);
-                fflush(stdout);
+                snprintf(buf, VALUE_MAX, "%d", (int)w);
+                char name[VALUE_MAX];
+                snprintf(name, VALUE_MAX, "0x%02hhx", r0);
+                print_value(device, name, buf);
             }
         }
 
-        state_lock();
-        co2mon.data[r0] = w;
-        bitarr_set(co2mon.seen, r0);
-        state_unlock();
+        // Spurious CntR values are dropped, and unknown codes are only
+        // passed on with -u. They would also take the history slots of the
+        // codes that matter.
+        const int valid = r0 == CODE_CNTR ? w <= 3000 : (r0 == CODE_TAMB || print_unknown);
+
+        const int64_t arrived_ms = realtime_ms();
+        if (valid)
+        {
+            rolling_add(device->rolling, r0, w, arrived);
+            archive_add(device->archive, r0, w, arrived_ms / 1000);
+            alert_reading(device, r0, w, arrived, arrived_ms);
+        }
+        state_write_begin(device);
+        state_set_code(&device->state, r0, w, arrived, arrived_ms);
+        state_write_end(device);
+        publish_shm(device);
+
+        if (valid)
+        {
+            history_add(device->history, r0, w, time(0));
+            push_reading(device, r0, w);
+            stream_reading(device, r0, w);
+        }
+
+        if (device->log)
+        {
+            struct co2mon_log_record record;
+            record.time = arrived_ms;
+            record.code = r0;
+            record.value = w;
+            pthread_mutex_lock(&device->log_mutex);
+            co2mon_log_append(device->log, &record);
+            pthread_mutex_unlock(&device->log_mutex);
+        }
+
+        histogram_observe(&frame_handle_histogram, monotonic_ns() - arrived);
     }
 }
 
-static co2mon_device
-open_device()
+static struct device *
+add_device(const char *path, int hotplug)
 {
-    if (devicefile)
+    devices_lock();
+    if (devices_count == DEVICES_MAX)
     {
-        return co2mon_open_device_path(devicefile);
+        devices_unlock();
+        return NULL;
     }
-    return co2mon_open_device();
+    struct device *device = &devices[devices_count];
+    memset(device, 0, sizeof(*device));
+    snprintf(device->path, sizeof(device->path), "%s", path);
+    snprintf(device->name, sizeof(device->name), "%s", path);
+    for (char *p = device->name; *p; ++p)
+    {
+        if (!(('0' <= *p && *p <= '9') || ('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') || *p == '-' || *p == '.'))
+        {
+            *p = '_';
+        }
+    }
+    device->hotplug = hotplug;
+    device->history = history_new();
+    device->rolling = rolling_new();
+    device->shm_index = shm ? co2mon_shm_add_device(shm, device->name) : -1;
+    if (logdir)
+    {
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s.log", logdir, multi_device ? device->name : "co2mon");
+        device->log = co2mon_log_open(filename, LOG_FLUSH_INTERVAL_MS);
+        pthread_mutex_init(&device->log_mutex, NULL);
+    }
+    if (archivedir)
+    {
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s.rra", archivedir, multi_device ? device->name : "co2mon");
+        device->archive = archive_open(filename);
+    }
+    devices_count++;
+    devices_unlock();
+    return device;
+}
+
+static int
+is_replay(const char *path)
+{
+    return strncmp(path, "replay:", 7) == 0 || strncmp(path, "replay-fast:", 12) == 0;
 }
 
 static void
-main_loop()
+flush_log(struct device *device)
+{
+    if (device->log)
+    {
+        pthread_mutex_lock(&device->log_mutex);
+        co2mon_log_flush(device->log);
+        pthread_mutex_unlock(&device->log_mutex);
+    }
+}
+
+static void
+flush_logs()
+{
+    devices_lock();
+    for (int d = 0; d < devices_count; ++d)
+    {
+        flush_log(&devices[d]);
+    }
+    devices_unlock();
+}
+
+// Blocks are otherwise only written when a sample arrives, a device that
+// goes quiet would keep its last samples in memory.
+static void*
+log_flush_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        sleep(LOG_FLUSH_INTERVAL_MS / 1000);
+        flush_logs();
+    }
+    return NULL;
+}
+
+static void*
+log_signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    if (sigwait(set, &sig) != 0)
+    {
+        err(EXIT_FAILURE, "sigwait");
+    }
+    flush_logs();
+    exit(EXIT_SUCCESS);
+    return NULL;
+}
+
+// Must be called before any other thread is started: SIGTERM and SIGINT
+// are blocked in all of them and handled by log_signal_thread, so the
+// logs are flushed before exiting.
+static void
+log_start()
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+    {
+        errx(EXIT_FAILURE, "pthread_sigmask failed");
+    }
+
+    void *(*threads[])(void *) = { log_signal_thread, log_flush_thread };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, threads[i], &set) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_create");
+        }
+
+        if (pthread_detach(tid) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_detach");
+        }
+    }
+}
+
+static co2mon_device
+open_device(struct device *device)
+{
+    co2mon_device dev;
+    if (device->path[0])
+    {
+        dev = co2mon_open_device_path(device->path);
+    }
+    else
+    {
+        dev = co2mon_open_device();
+    }
+
+    if (dev && capturedir && !is_replay(device->path))
+    {
+        char filename[PATH_MAX];
+        snprintf(filename, PATH_MAX, "%s/%s.cap", capturedir, multi_device ? device->name : "co2mon");
+        co2mon_capture_start(dev, filename);
+    }
+    return dev;
+}
+
+static void*
+device_thread(void *arg)
 {
+    struct device *device = arg;
     int error_shown = 0;
+    int retries = 0;
+
+    // Enumerated devices are found again by main_loop, and captures don't
+    // appear by themselves. Events are only needed while the device is
+    // missing, so the socket is closed while it is open.
+    const int wait_hotplug = !device->hotplug && !is_replay(device->path);
+    int hotplug_fd = wait_hotplug ? hotplug_open() : -1;
+
     while (1)
     {
-        co2mon_device dev = open_device();
+        co2mon_device dev = open_device(device);
         if (dev == NULL)
         {
+            if (device->hotplug && retries == 0)
+            {
+                break;
+            }
             if (!error_shown)
             {
-                fprintf(stderr, "Unable to open CO2 device\n");
+                if (device->path[0])
+                {
+                    fprintf(stderr, "Unable to open CO2 device %s\n", device->path);
+                }
+                else
+                {
+                    fprintf(stderr, "Unable to open CO2 device\n");
+                }
                 error_shown = 1;
             }
-            sleep(1);
+            if (retries > 0)
+            {
+                retries--;
+                usleep(HOTPLUG_RETRY_MS * 1000);
+            }
+            else if (hotplug_wait(hotplug_fd))
+            {
+                device->plugged_ns = monotonic_ns();
+                retries = HOTPLUG_RETRIES;
+            }
             continue;
         }
         else
         {
             error_shown = 0;
+            retries = 0;
+            hotplug_close(hotplug_fd);
+            hotplug_fd = -1;
+        }
+
+        if (device->opened)
+        {
+            state_write_begin(device);
+            device->state.reconnects++;
+            state_write_end(device);
         }
+        device->opened = 1;
 
-        device_loop(dev);
+        device_loop(device, dev);
+        flush_log(device);
 
         co2mon_close_device(dev);
+        device->plugged_ns = 0;
+
+        // A capture is played back once.
+        if (is_replay(device->path))
+        {
+            break;
+        }
+
+        // The error may be transient; if the device is gone, the thread
+        // waits for it to be plugged in again (or exits if it was found
+        // by enumeration).
+        if (wait_hotplug)
+        {
+            hotplug_fd = hotplug_open();
+        }
+        retries = HOTPLUG_RETRIES;
+    }
+
+    hotplug_close(hotplug_fd);
+
+    devices_lock();
+    device->active = 0;
+    devices_unlock();
+    return NULL;
+}
+
+static void
+start_device(struct device *device)
+{
+    pthread_t tid;
+
+    devices_lock();
+    device->active = 1;
+    devices_unlock();
+
+    if (pthread_create(&tid, NULL, device_thread, device) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    if (pthread_detach(tid) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_detach");
+    }
+}
+
+static int64_t hotplug_event_ns; /* time of the last hotplug event, used by main_loop only */
+
+static void
+enumerate_callback(const char *path, void *arg)
+{
+    (void)arg;
+
+    struct device *device = NULL;
+    int active = 0;
+    devices_lock();
+    for (int d = 0; d < devices_count; ++d)
+    {
+        if (strcmp(devices[d].path, path) == 0)
+        {
+            device = &devices[d];
+            active = device->active;
+            break;
+        }
+    }
+    devices_unlock();
+
+    if (active)
+    {
+        return;
+    }
+
+    if (!device)
+    {
+        device = add_device(path, 1);
+        if (!device)
+        {
+            fprintf(stderr, "Too many CO2 devices, ignoring %s\n", path);
+            return;
+        }
+        fprintf(stderr, "Found CO2 device %s\n", path);
+    }
+    device->plugged_ns = hotplug_event_ns;
+    start_device(device);
+}
+
+static void
+main_loop()
+{
+    if (!multi_device)
+    {
+        device_thread(add_device(devicefiles_count ? devicefiles[0] : "", 0));
+        return;
+    }
+
+    for (int i = 0; i < devicefiles_count; ++i)
+    {
+        start_device(add_device(devicefiles[i], 0));
+    }
+
+    if (!all_devices)
+    {
+        while (1)
+        {
+            pause();
+        }
+    }
+
+    int hotplug_fd = hotplug_open();
+    int retries = 0;
+    while (1)
+    {
+        co2mon_enumerate_devices(enumerate_callback, NULL);
+        if (retries > 0)
+        {
+            retries--;
+            usleep(HOTPLUG_RETRY_MS * 1000);
+        }
+        else if (hotplug_wait(hotplug_fd))
+        {
+            hotplug_event_ns = monotonic_ns();
+            retries = HOTPLUG_RETRIES;
+        }
+        else
+        {
+            hotplug_event_ns = 0;
+        }
     }
 }
 
 int main(int argc, char *argv[])
 {
     char *reldatadir = 0;
+    char *rellogdir = 0;
+    char *relarchivedir = 0;
+    char *relcapturedir = 0;
+    char *shmfile = 0;
     char *promaddr = 0;
+    char *pushtarget = 0;
+    char *socketpath = 0;
+    char *hookspec = 0;
+    int flush_interval = PUSH_FLUSH_INTERVAL_MS;
     char *pidfile = 0;
     char *logfile = 0;
 
     int c;
     int opterr = 0;
     int show_help = 0;
-    while ((c = getopt(argc, argv, ":dnNhuD:P:f:l:p:")) != -1)
+    while ((c = getopt(argc, argv, ":adnNhuA:C:D:E:F:H:L:P:R:S:U:W:f:l:p:r:")) != -1)
     {
         switch (c)
         {
+        case 'a':
+            all_devices = 1;
+            break;
         case 'd':
             daemonize = 1;
             break;
@@ -543,14 +698,61 @@ int main(int argc, char *argv[])
         case 'N':
             decode_data = 1;
             break;
+        case 'A':
+            if (!alert_add_rule(optarg))
+            {
+                opterr++;
+            }
+            break;
+        case 'C':
+            relcapturedir = optarg;
+            break;
         case 'D':
             reldatadir = optarg;
             break;
+        case 'E':
+            pushtarget = optarg;
+            break;
+        case 'F':
+            flush_interval = atoi(optarg);
+            if (flush_interval <= 0)
+            {
+                fprintf(stderr, "Invalid flush interval: %s\n", optarg);
+                opterr++;
+            }
+            break;
+        case 'H':
+            hookspec = optarg;
+            break;
+        case 'L':
+            rellogdir = optarg;
+            break;
+        case 'R':
+            relarchivedir = optarg;
+            break;
+        case 'S':
+            shmfile = optarg;
+            break;
         case 'P':
             promaddr = optarg;
             break;
+        case 'U':
+            socketpath = optarg;
+            break;
+        case 'W':
+            if (!rolling_parse_windows(optarg))
+            {
+                opterr++;
+            }
+            break;
         case 'f':
-            devicefile = optarg;
+            if (devicefiles_count == DEVICES_MAX)
+            {
+                fprintf(stderr, "Too many devices, at most %d are supported\n", DEVICES_MAX);
+                opterr++;
+                break;
+            }
+            devicefiles[devicefiles_count++] = optarg;
             break;
         case 'l':
             logfile = optarg;
@@ -558,6 +760,12 @@ int main(int argc, char *argv[])
         case 'p':
             pidfile = optarg;
             break;
+        case 'r':
+            if (!archive_parse(optarg))
+            {
+                opterr++;
+            }
+            break;
         case ':':
             fprintf(stderr, "Option -%c requires an operand\n", optopt);
             opterr++;
@@ -569,25 +777,59 @@ int main(int argc, char *argv[])
     }
     if (show_help || opterr || optind != argc)
     {
-        fprintf(stderr, "usage: co2mond [-dhun] [-D datadir] [-f device] [-p pidfle] [-l logfile]\n");
+        fprintf(stderr, "usage: co2mond [-adhun] [-A rule]... [-H hook] [-C capturedir] [-D datadir] [-E target [-F ms]] [-L logdir] [-R archivedir [-r archives]] [-S shmfile] [-U socket] [-W windows] [-f device]... [-p pidfle] [-l logfile]\n");
         if (show_help)
         {
             fprintf(stderr, "\n");
+            fprintf(stderr, "  -a    use all matching devices, including ones plugged in later\n");
             fprintf(stderr, "  -d    run as a daemon\n");
             fprintf(stderr, "  -h    show this help message\n");
             fprintf(stderr, "  -u    print values for unknown items\n");
             fprintf(stderr, "  -n    use payload as-is, as delivered by 2nd release devices (overrides auto-detection)\n");
             fprintf(stderr, "  -N    decode payload that is scrambled by 1st release devices (overrides auto-detection)\n");
+            fprintf(stderr, "  -A rule\n");
+            fprintf(stderr, "        alert when a reading stays beyond a threshold, e.g. co2>1200 or\n");
+            fprintf(stderr, "        temp<16,clear=17,hold=30s,every=1m (clear level, hold time and\n");
+            fprintf(stderr, "        minimum interval between hooks, default %ds); may be repeated\n", ALERT_INTERVAL_DEFAULT_MS / 1000);
+            fprintf(stderr, "  -H hook\n");
+            fprintf(stderr, "        notify alert changes with exec:command (CO2MON_* variables),\n");
+            fprintf(stderr, "        unix:path or http://host:port/path (JSON)\n");
+            fprintf(stderr, "  -C capturedir\n");
+            fprintf(stderr, "        record raw frames from the devices in capturedir, for replay:\n");
+            fprintf(stderr, "        -f replay:file plays a capture back in real time,\n");
+            fprintf(stderr, "        -f replay-fast:file as fast as possible\n");
             fprintf(stderr, "  -D datadir\n");
             fprintf(stderr, "        store values from the sensor in datadir\n");
+            fprintf(stderr, "        (in a subdirectory per device when several devices are used)\n");
+            fprintf(stderr, "  -E target\n");
+            fprintf(stderr, "        push readings to influx+udp://host:port, influx+tcp://host:port,\n");
+            fprintf(stderr, "        statsd+udp://host:port or statsd+tcp://host:port\n");
+            fprintf(stderr, "  -F ms\n");
+            fprintf(stderr, "        interval between pushes (default %d)\n", PUSH_FLUSH_INTERVAL_MS);
+            fprintf(stderr, "  -L logdir\n");
+            fprintf(stderr, "        append every sample to a compressed log in logdir (see co2log)\n");
+            fprintf(stderr, "  -R archivedir\n");
+            fprintf(stderr, "        keep round-robin archives of the readings in archivedir, served\n");
+            fprintf(stderr, "        as rrdtool dump XML on /archive\n");
+            fprintf(stderr, "  -r archives\n");
+            fprintf(stderr, "        step and archives as CF:xff:steps:rows, CF being AVERAGE, MIN,\n");
+            fprintf(stderr, "        MAX or LAST (default " ARCHIVE_DEFAULT ")\n");
+            fprintf(stderr, "  -S shmfile\n");
+            fprintf(stderr, "        publish values in a shared memory file (e.g., " CO2MON_SHM_PATH ")\n");
             fprintf(stderr, "  -P host:port\n");
             fprintf(stderr, "        address on which to expose metrics\n");
+            fprintf(stderr, "  -U socket\n");
+            fprintf(stderr, "        serve snapshots and subscriptions on a Unix socket (e.g., " CO2MON_SOCKET_PATH ")\n");
+            fprintf(stderr, "  -W windows\n");
+            fprintf(stderr, "        export the EWMA, min, max, mean and quantiles of the readings over\n");
+            fprintf(stderr, "        these windows with the metrics (e.g., 5m,1h, at most %d)\n", ROLLING_WINDOWS_MAX);
             fprintf(stderr, "  -f devicefile\n");
 #ifdef __linux__
             fprintf(stderr, "        path to a device (e.g., /dev/hidraw0)\n");
 #else
             fprintf(stderr, "        path to a device\n");
 #endif
+            fprintf(stderr, "        may be repeated to serve several devices\n");
             fprintf(stderr, "  -p pidfile\n");
             fprintf(stderr, "        write PID to a file named pidfile\n");
             fprintf(stderr, "  -l logfile\n");
@@ -596,9 +838,11 @@ int main(int argc, char *argv[])
         }
         exit(1);
     }
-    if (daemonize && !reldatadir && !promaddr)
+    multi_device = all_devices || devicefiles_count > 1;
+
+    if (daemonize && !reldatadir && !rellogdir && !relarchivedir && !relcapturedir && !shmfile && !promaddr && !pushtarget && !socketpath && !hookspec)
     {
-        fprintf(stderr, "co2mond: it is useless to use -d without -D or -P.\n");
+        fprintf(stderr, "co2mond: it is useless to use -d without -C, -D, -E, -H, -L, -R, -S, -P or -U.\n");
         exit(1);
     }
 
@@ -612,6 +856,60 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (rellogdir)
+    {
+        logdir = realpath(rellogdir, NULL);
+        if (logdir == NULL)
+        {
+            perror(rellogdir);
+            exit(1);
+        }
+    }
+
+    if (relarchivedir)
+    {
+        archivedir = realpath(relarchivedir, NULL);
+        if (archivedir == NULL)
+        {
+            perror(relarchivedir);
+            exit(1);
+        }
+    }
+
+    if (relcapturedir)
+    {
+        capturedir = realpath(relcapturedir, NULL);
+        if (capturedir == NULL)
+        {
+            perror(relcapturedir);
+            exit(1);
+        }
+    }
+
+    if (pushtarget && !push_init(pushtarget, flush_interval))
+    {
+        exit(1);
+    }
+
+    if (hookspec && !alert_set_hook(hookspec))
+    {
+        exit(1);
+    }
+
+    if (shmfile)
+    {
+        shm = co2mon_shm_create(shmfile);
+        if (!shm)
+        {
+            exit(1);
+        }
+    }
+
+    if (socketpath)
+    {
+        local_init(socketpath);
+    }
+
     int pidfd = -1;
     if (pidfile)
     {
@@ -691,7 +989,7 @@ int main(int argc, char *argv[])
             err(EXIT_FAILURE, "listen");
         }
 
-        if (signal(SIGPIPE, SIG_IGN) != 0)
+        if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         {
             err(EXIT_FAILURE, "signal(SIGPIPE, SIG_IGN)");
         }
@@ -719,20 +1017,28 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (logdir)
+    {
+        log_start();
+    }
+
     if (listen_fd != -1)
     {
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, prometheus_thread, (void*)((size_t)listen_fd)) != 0)
-        {
-            err(EXIT_FAILURE, "pthread_create");
-        }
+        http_start(listen_fd);
+    }
 
-        if (pthread_detach(tid) != 0)
-        {
-            err(EXIT_FAILURE, "pthread_detach");
-        }
+    if (pushtarget)
+    {
+        push_start();
     }
 
+    if (socketpath)
+    {
+        local_start();
+    }
+
+    alert_start();
+
     if (logfd != -1)
     {
         dup2(logfd, fileno(stderr));
@@ -753,5 +1059,18 @@ int main(int argc, char *argv[])
     {
         free(datadir);
     }
-    return 1;
+    if (logdir)
+    {
+        free(logdir);
+    }
+    if (capturedir)
+    {
+        free(capturedir);
+    }
+    if (archivedir)
+    {
+        free(archivedir);
+    }
+    // main_loop only returns once a single device has been replayed.
+    return 0;
 }
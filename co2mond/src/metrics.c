@@ -0,0 +1,581 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* clock_gettime */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "alert.h"
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "http.h"
+#include "local.h"
+#include "metrics.h"
+#include "push.h"
+#include "rolling.h"
+#include "stats.h"
+#include "stream.h"
+
+static const char *error_kind_names[ERROR_KINDS] = {
+    "magic_table",
+    "read",
+    "trailer",
+    "checksum",
+};
+
+// Fills labels with the device label, if any, and returns their number.
+static int
+device_labels(struct expo_label *labels, const struct device *device)
+{
+    if (multi_device)
+    {
+        labels[0].name = "device";
+        labels[0].value = device->name;
+        return 1;
+    }
+    return 0;
+}
+
+int
+device_ready(const struct co2mon_state *state)
+{
+    return state_code(state, CODE_TAMB) && state_code(state, CODE_CNTR);
+}
+
+static int
+is_known(unsigned char code)
+{
+    return code == CODE_TAMB || code == CODE_CNTR;
+}
+
+// Adds the key label of a code to the device label, if any.
+static int
+code_labels(struct expo_label *labels, const struct device *device, char *key, unsigned char code)
+{
+    int n = device_labels(labels, device);
+    snprintf(key, 8, "x%02x", code);
+    labels[n].name = "key";
+    labels[n].value = key;
+    return n + 1;
+}
+
+enum rolling_stat {
+    STAT_EWMA,
+    STAT_MIN,
+    STAT_MAX,
+    STAT_MEAN,
+    STAT_QUANTILE,
+    STATS,
+};
+
+static const struct {
+    const char *suffix;
+    const char *help;
+} rolling_stats[STATS] = {
+    [STAT_EWMA] = { "ewma", "exponentially weighted moving average, with the window as time constant" },
+    [STAT_MIN] = { "min", "minimum over the window" },
+    [STAT_MAX] = { "max", "maximum over the window" },
+    [STAT_MEAN] = { "mean", "mean over the window" },
+    [STAT_QUANTILE] = { "quantile", "quantiles over the window" },
+};
+
+static const struct {
+    unsigned int code;
+    const char *name;
+    const char *what;
+} rolling_metrics[ROLLING_CODES] = {
+    { CODE_TAMB, "co2mon_temp_celsius", "Ambient temperature" },
+    { CODE_CNTR, "co2mon_co2_ppm", "Concentration of CO2" },
+};
+
+static double
+rolling_value(unsigned int code, double w)
+{
+    return code == CODE_TAMB ? w * 0.0625 - 273.15 : w;
+}
+
+static void
+render_rolling(struct expo *e, const struct device *copy, int count)
+{
+    static struct rolling_summary summaries[DEVICES_MAX][ROLLING_WINDOWS_MAX];
+    static int summarized[DEVICES_MAX];
+    const int64_t now_ns = monotonic_ns();
+    struct expo_label labels[3];
+    char name[64], help[128], quantile[16];
+
+    for (int m = 0; m < ROLLING_CODES; ++m)
+    {
+        const unsigned int code = rolling_metrics[m].code;
+        for (int d = 0; d < count; ++d)
+        {
+            summarized[d] = rolling_summarize(copy[d].rolling, code, now_ns, summaries[d]);
+        }
+
+        for (int stat = 0; stat < STATS; ++stat)
+        {
+            snprintf(name, sizeof(name), "%s_%s", rolling_metrics[m].name, rolling_stats[stat].suffix);
+            snprintf(help, sizeof(help), "%s, %s.", rolling_metrics[m].what, rolling_stats[stat].help);
+            expo_family(e, name, help, EXPO_GAUGE);
+            for (int d = 0; d < count; ++d)
+            {
+                for (int w = 0; summarized[d] && w < rolling_windows_count; ++w)
+                {
+                    const struct rolling_summary *summary = &summaries[d][w];
+                    if (!summary->count)
+                    {
+                        continue;
+                    }
+                    int n = device_labels(labels, &copy[d]);
+                    labels[n].name = "window";
+                    labels[n].value = rolling_window_names[w];
+                    n++;
+                    switch (stat)
+                    {
+                    case STAT_EWMA:
+                        expo_sample(e, labels, n, rolling_value(code, summary->ewma), 0);
+                        break;
+                    case STAT_MIN:
+                        expo_sample(e, labels, n, rolling_value(code, summary->min), 0);
+                        break;
+                    case STAT_MAX:
+                        expo_sample(e, labels, n, rolling_value(code, summary->max), 0);
+                        break;
+                    case STAT_MEAN:
+                        expo_sample(e, labels, n, rolling_value(code, summary->mean), 0);
+                        break;
+                    case STAT_QUANTILE:
+                        labels[n].name = "quantile";
+                        labels[n].value = quantile;
+                        for (int q = 0; q < ROLLING_QUANTILES; ++q)
+                        {
+                            snprintf(quantile, sizeof(quantile), "%g", rolling_quantiles[q]);
+                            expo_sample(e, labels, n + 1, rolling_value(code, summary->quantiles[q]), 0);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void
+render_metrics(struct expo *e, const struct device *copy, int count)
+{
+    struct expo_label labels[2];
+    char key[8];
+    int n;
+
+    if (print_unknown)
+    {
+        int has_unknown = 0;
+        for (int d = 0; d < count && !has_unknown; ++d)
+        {
+            for (int i = 0; i < copy[d].state.codes_count; ++i)
+            {
+                has_unknown |= !is_known(copy[d].state.codes[i].code);
+            }
+        }
+        if (has_unknown)
+        {
+            expo_family(e, "co2mon_unknown", "Unknown value.", EXPO_GAUGE);
+            for (int d = 0; d < count; ++d)
+            {
+                for (int i = 0; i < copy[d].state.codes_count; ++i)
+                {
+                    const struct code_state *c = &copy[d].state.codes[i];
+                    if (!is_known(c->code))
+                    {
+                        n = code_labels(labels, &copy[d], key, c->code);
+                        expo_sample(e, labels, n, c->value, c->time_ms);
+                    }
+                }
+            }
+        }
+    }
+
+    expo_family(e, "co2mon_temp_celsius", "Ambient temperature.", EXPO_GAUGE);
+    for (int d = 0; d < count; ++d)
+    {
+        if (device_ready(&copy[d].state))
+        {
+            const struct code_state *c = state_code(&copy[d].state, CODE_TAMB);
+            n = device_labels(labels, &copy[d]);
+            expo_sample(e, labels, n, decode_temperature(c->value), c->time_ms);
+        }
+    }
+
+    expo_family(e, "co2mon_co2_ppm", "Concentration of CO2, parts per million.", EXPO_GAUGE);
+    for (int d = 0; d < count; ++d)
+    {
+        if (device_ready(&copy[d].state))
+        {
+            const struct code_state *c = state_code(&copy[d].state, CODE_CNTR);
+            n = device_labels(labels, &copy[d]);
+            expo_sample(e, labels, n, c->value, c->time_ms);
+        }
+    }
+
+    // Per code, so that a code that stops updating while others still
+    // arrive can be told from the heartbeat. Unknown codes need -u.
+    expo_family(e, "co2mon_code_updated_time_seconds", "Time of the last reading of a code.", EXPO_GAUGE);
+    for (int d = 0; d < count; ++d)
+    {
+        for (int i = 0; i < copy[d].state.codes_count; ++i)
+        {
+            const struct code_state *c = &copy[d].state.codes[i];
+            if (print_unknown || is_known(c->code))
+            {
+                n = code_labels(labels, &copy[d], key, c->code);
+                expo_sample(e, labels, n, c->time_ms / 1000.0, 0);
+            }
+        }
+    }
+
+    expo_family(e, "co2mon_code_samples_total", "Readings of a code since the device was opened.", EXPO_COUNTER);
+    for (int d = 0; d < count; ++d)
+    {
+        for (int i = 0; i < copy[d].state.codes_count; ++i)
+        {
+            const struct code_state *c = &copy[d].state.codes[i];
+            if (print_unknown || is_known(c->code))
+            {
+                n = code_labels(labels, &copy[d], key, c->code);
+                expo_sample(e, labels, n, c->count, 0);
+            }
+        }
+    }
+
+    if (rolling_windows_count)
+    {
+        render_rolling(e, copy, count);
+    }
+
+    expo_family(e, "co2mon_device_errors_total", "CO2 monitor device error counter.", EXPO_COUNTER);
+    for (int d = 0; d < count; ++d)
+    {
+        n = device_labels(labels, &copy[d]);
+        expo_sample(e, labels, n, copy[d].state.deverr, 0);
+    }
+
+    expo_family(e, "co2mon_errors_total", "CO2 monitor device errors by kind.", EXPO_COUNTER);
+    for (int d = 0; d < count; ++d)
+    {
+        for (int k = 0; k < ERROR_KINDS; ++k)
+        {
+            n = device_labels(labels, &copy[d]);
+            labels[n].name = "kind";
+            labels[n].value = error_kind_names[k];
+            expo_sample(e, labels, n + 1, copy[d].state.errors[k], 0);
+        }
+    }
+
+    expo_family(e, "co2mon_reconnects_total", "Number of times the device was opened again.", EXPO_COUNTER);
+    for (int d = 0; d < count; ++d)
+    {
+        n = device_labels(labels, &copy[d]);
+        expo_sample(e, labels, n, copy[d].state.reconnects, 0);
+    }
+
+    expo_family(e, "co2mon_heartbeat_time_seconds", "CO2 monitor heartbeat timestamp.", EXPO_GAUGE);
+    for (int d = 0; d < count; ++d)
+    {
+        if (device_ready(&copy[d].state))
+        {
+            n = device_labels(labels, &copy[d]);
+            expo_sample(e, labels, n, copy[d].state.heatbeat, 0);
+        }
+    }
+}
+
+/* The exposition is rendered only when some device state has changed, or
+ * a rolling window has moved, since the previous scrape, so that frequent
+ * scrapes of unchanged data cost a few loads and a 304 or a send of the
+ * cached body. Each format and encoding is rendered on its first request
+ * after a change. The self-instrumentation is sampled at the same time, so
+ * it lags by at most one frame. */
+
+enum encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODINGS,
+};
+
+static struct device copy[DEVICES_MAX]; // only used by the HTTP thread
+static int cache_ready;
+static struct http_blob *cache_bodies[EXPO_FORMATS][ENCODINGS];
+static int cache_count = -1;
+static unsigned long long cache_generation;
+static char cache_etag[48]; // without the variant
+
+static void
+update_cache(int count, int64_t moved)
+{
+    unsigned long long generation = moved;
+    int ready = 0;
+
+    for (int d = 0; d < count; ++d)
+    {
+        // Paths and names never change once the device is listed.
+        memcpy(copy[d].name, devices[d].name, sizeof(copy[d].name));
+        copy[d].rolling = devices[d].rolling;
+        generation += state_read(&devices[d], &copy[d].state);
+        ready |= device_ready(&copy[d].state);
+    }
+
+    for (int f = 0; f < EXPO_FORMATS; ++f)
+    {
+        for (int c = 0; c < ENCODINGS; ++c)
+        {
+            if (cache_bodies[f][c])
+            {
+                http_blob_unref(cache_bodies[f][c]);
+                cache_bodies[f][c] = NULL;
+            }
+        }
+    }
+
+    // Generations restart from zero with the process, so the start time
+    // keeps the tags of different runs apart.
+    static time_t epoch = 0;
+    if (!epoch)
+    {
+        epoch = time(NULL);
+    }
+
+    cache_ready = ready;
+    cache_count = count;
+    cache_generation = generation;
+    snprintf(cache_etag, sizeof(cache_etag), "%llx-%x-%llx",
+        (unsigned long long)epoch, (unsigned)count, generation);
+}
+
+#ifdef HAVE_ZLIB
+static struct http_blob *
+gzip_blob(const struct http_blob *blob)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS selects the gzip wrapper.
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return NULL;
+    }
+
+    struct buf out = { 0 };
+    buf_reserve(&out, deflateBound(&zs, blob->len));
+    zs.next_in = (Bytef *)blob->data;
+    zs.avail_in = blob->len;
+    zs.next_out = (Bytef *)out.data;
+    zs.avail_out = out.cap;
+    int r = deflate(&zs, Z_FINISH);
+    out.len = out.cap - zs.avail_out;
+    deflateEnd(&zs);
+
+    struct http_blob *gz = r == Z_STREAM_END ? http_blob_new(out.data, out.len) : NULL;
+    buf_free(&out);
+    return gz;
+}
+#endif
+
+static struct http_blob *
+cached_body(enum expo_format format, enum encoding encoding)
+{
+    struct http_blob **body = &cache_bodies[format][encoding];
+    if (*body)
+    {
+        return *body;
+    }
+
+    if (encoding == ENCODING_GZIP)
+    {
+#ifdef HAVE_ZLIB
+        *body = gzip_blob(cached_body(format, ENCODING_IDENTITY));
+#endif
+        return *body;
+    }
+
+    struct buf out = { 0 };
+    struct expo e;
+    expo_init(&e, format, &out);
+    const int64_t start = monotonic_ns();
+    render_metrics(&e, copy, cache_count);
+    histogram_observe(&scrape_render_histogram, monotonic_ns() - start);
+    render_stats(&e);
+    render_push_stats(&e);
+    render_stream_stats(&e);
+    render_local_stats(&e);
+    render_alert_stats(&e, cache_count);
+    expo_finish(&e);
+    *body = http_blob_new(out.data, out.len);
+    buf_free(&out);
+    return *body;
+}
+
+static int
+media_type_is(const struct http_list_item *item, const char *type)
+{
+    return item->len == strlen(type) && strncasecmp(item->value, type, item->len) == 0;
+}
+
+// Picks the format with the highest q in Accept, the earliest one on ties.
+// Anything unknown gets the Prometheus text format.
+static enum expo_format
+negotiate_format(const struct http_request *req)
+{
+    size_t len;
+    const char *accept = http_header(req, "Accept", &len);
+    if (!accept)
+    {
+        return EXPO_TEXT;
+    }
+
+    enum expo_format best = EXPO_TEXT;
+    double best_q = 0;
+    const char *end = accept + len;
+    struct http_list_item item;
+    while (http_list_next(&accept, end, &item))
+    {
+        char param[64];
+        int format = -1;
+        if (media_type_is(&item, "application/vnd.google.protobuf"))
+        {
+            if (http_list_param(&item, "proto", param, sizeof(param)) &&
+                strcmp(param, "io.prometheus.client.MetricFamily") == 0 &&
+                http_list_param(&item, "encoding", param, sizeof(param)) &&
+                strcmp(param, "delimited") == 0)
+            {
+                format = EXPO_PROTOBUF;
+            }
+        }
+        else if (media_type_is(&item, "application/openmetrics-text"))
+        {
+            if (!http_list_param(&item, "version", param, sizeof(param)) ||
+                strcmp(param, "1.0.0") == 0 || strcmp(param, "0.0.1") == 0)
+            {
+                format = EXPO_OPENMETRICS;
+            }
+        }
+        else if (media_type_is(&item, "text/plain") || media_type_is(&item, "text/*") ||
+            media_type_is(&item, "*/*"))
+        {
+            format = EXPO_TEXT;
+        }
+
+        if (format != -1 && item.q > best_q)
+        {
+            best = format;
+            best_q = item.q;
+        }
+    }
+    return best;
+}
+
+static enum encoding
+negotiate_encoding(const struct http_request *req)
+{
+#ifdef HAVE_ZLIB
+    size_t len;
+    const char *accept = http_header(req, "Accept-Encoding", &len);
+    if (!accept)
+    {
+        return ENCODING_IDENTITY;
+    }
+
+    const char *end = accept + len;
+    struct http_list_item item;
+    while (http_list_next(&accept, end, &item))
+    {
+        if ((media_type_is(&item, "gzip") || media_type_is(&item, "*")) && item.q > 0)
+        {
+            return ENCODING_GZIP;
+        }
+    }
+#else
+    (void)req;
+#endif
+    return ENCODING_IDENTITY;
+}
+
+void
+metrics_handler(const struct http_request *req, struct http_response *resp)
+{
+    static const char *variant_names[EXPO_FORMATS] = { "t", "o", "p" };
+    unsigned long long generation = 0;
+    int count;
+
+    devices_lock();
+    count = devices_count;
+    devices_unlock();
+
+    for (int d = 0; d < count; ++d)
+    {
+        generation += state_seq(&devices[d]);
+    }
+    // The rolling windows move on without readings.
+    const int64_t moved = rolling_generation(monotonic_ns());
+    generation += moved;
+    if (count != cache_count || generation != cache_generation)
+    {
+        update_cache(count, moved);
+    }
+
+    if (!cache_ready)
+    {
+        resp->status = 503;
+        buf_puts(&resp->body, "Device not ready.\r\n");
+        return;
+    }
+
+    const enum expo_format format = negotiate_format(req);
+    enum encoding encoding = negotiate_encoding(req);
+    struct http_blob *body = cached_body(format, encoding);
+    if (!body)
+    {
+        encoding = ENCODING_IDENTITY;
+        body = cached_body(format, encoding);
+    }
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%s-%s%s\"", cache_etag, variant_names[format],
+        encoding == ENCODING_GZIP ? "z" : "");
+    buf_printf(&resp->headers, "ETag: %s\r\nVary: Accept, Accept-Encoding\r\n", etag);
+
+    size_t len;
+    const char *inm = http_header(req, "If-None-Match", &len);
+    if (inm && ((len == 1 && inm[0] == '*') ||
+        (len == strlen(etag) && memcmp(inm, etag, len) == 0)))
+    {
+        resp->status = 304;
+        return;
+    }
+
+    if (encoding == ENCODING_GZIP)
+    {
+        buf_puts(&resp->headers, "Content-Encoding: gzip\r\n");
+    }
+    resp->content_type = expo_content_types[format];
+    resp->blob = http_blob_ref(body);
+}
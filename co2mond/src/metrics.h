@@ -0,0 +1,35 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METRICS_H_INCLUDED_
+#define METRICS_H_INCLUDED_
+
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "http.h"
+
+extern int
+device_ready(const struct co2mon_state *state);
+
+extern void
+render_metrics(struct expo *e, const struct device *copy, int count);
+
+extern void
+metrics_handler(const struct http_request *req, struct http_response *resp);
+
+#endif
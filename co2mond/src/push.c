@@ -0,0 +1,428 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* clock_gettime */
+
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <err.h>
+
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "push.h"
+
+/*
+ * Push export of readings.
+ *
+ * Device threads append readings to a bounded queue. Every flush interval
+ * the push thread takes the whole queue and sends it as InfluxDB line
+ * protocol or StatsD gauges, packed into datagrams of at most
+ * PUSH_DATAGRAM_MAX bytes over UDP, or written to a TCP connection that is
+ * reopened on the next flush after an error. Readings that do not fit in
+ * the queue or cannot be sent are dropped and counted.
+ */
+
+#define PUSH_DATAGRAM_MAX 1432 /* fits an Ethernet MTU with IPv6 headers */
+#define PUSH_TCP_TIMEOUT_MS 1000
+
+enum push_format {
+    PUSH_INFLUX,
+    PUSH_STATSD,
+};
+
+struct push_item {
+    int device;
+    unsigned char code;
+    uint16_t value;
+    int64_t time_ns; /* since the Epoch */
+};
+
+static enum push_format format;
+static int socktype;
+static struct addrinfo *address;
+static int flush_interval;
+static int sock = -1;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct push_item queue[PUSH_QUEUE_MAX];
+static int queue_len = 0;
+
+static uint64_t sent_total;
+static uint64_t dropped_queue_total;
+static uint64_t dropped_send_total;
+
+int
+push_init(const char *target, int flush_interval_ms)
+{
+    const char *rest;
+    if (strncmp(target, "influx+udp://", 13) == 0)
+    {
+        format = PUSH_INFLUX;
+        socktype = SOCK_DGRAM;
+        rest = target + 13;
+    }
+    else if (strncmp(target, "influx+tcp://", 13) == 0)
+    {
+        format = PUSH_INFLUX;
+        socktype = SOCK_STREAM;
+        rest = target + 13;
+    }
+    else if (strncmp(target, "statsd+udp://", 13) == 0)
+    {
+        format = PUSH_STATSD;
+        socktype = SOCK_DGRAM;
+        rest = target + 13;
+    }
+    else if (strncmp(target, "statsd+tcp://", 13) == 0)
+    {
+        format = PUSH_STATSD;
+        socktype = SOCK_STREAM;
+        rest = target + 13;
+    }
+    else
+    {
+        fprintf(stderr, "%s: expected influx+udp, influx+tcp, statsd+udp or statsd+tcp\n", target);
+        return 0;
+    }
+
+    char *copy = strdup(rest);
+    char *colon = strrchr(copy, ':');
+    if (!colon || colon == copy)
+    {
+        fprintf(stderr, "%s: expected host:port\n", target);
+        free(copy);
+        return 0;
+    }
+    *colon = '\0';
+    char *host = copy;
+    size_t hlen = strlen(host);
+    if (host[0] == '[' && hlen > 1 && host[hlen - 1] == ']')
+    {
+        host[hlen - 1] = '\0';
+        host++;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    int gai_errno = getaddrinfo(host, colon + 1, &hints, &address);
+    free(copy);
+    if (gai_errno != 0)
+    {
+        fprintf(stderr, "getaddrinfo(%s): %s\n", target, gai_strerror(gai_errno));
+        return 0;
+    }
+
+    // A TCP collector that goes away must not kill the daemon.
+    if (socktype == SOCK_STREAM && signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE, SIG_IGN)");
+        return 0;
+    }
+
+    flush_interval = flush_interval_ms;
+    return 1;
+}
+
+void
+push_reading(const struct device *device, unsigned char code, uint16_t value)
+{
+    if (!address)
+    {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    if (pthread_mutex_lock(&queue_mutex) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_mutex_lock");
+    }
+    if (queue_len < PUSH_QUEUE_MAX)
+    {
+        struct push_item *item = &queue[queue_len++];
+        item->device = device - devices;
+        item->code = code;
+        item->value = value;
+        item->time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    else
+    {
+        __atomic_add_fetch(&dropped_queue_total, 1, __ATOMIC_RELAXED);
+    }
+    if (pthread_mutex_unlock(&queue_mutex) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_mutex_unlock");
+    }
+}
+
+static void
+format_item(struct buf *out, const struct push_item *item)
+{
+    const char *name = devices[item->device].name;
+
+    if (format == PUSH_INFLUX)
+    {
+        // Device names only contain [0-9A-Za-z._-], nothing to escape.
+        buf_puts(out, "co2mon");
+        if (multi_device)
+        {
+            buf_printf(out, ",device=%s", name);
+        }
+        if (item->code == CODE_TAMB)
+        {
+            buf_printf(out, " temp_celsius=%.4f", decode_temperature(item->value));
+        }
+        else if (item->code == CODE_CNTR)
+        {
+            buf_printf(out, " co2_ppm=%di", (int)item->value);
+        }
+        else
+        {
+            buf_printf(out, " x%02x=%di", item->code, (int)item->value);
+        }
+        buf_printf(out, " %lld\n", (long long)item->time_ns);
+        return;
+    }
+
+    // StatsD names are dot separated, so dots in device names are replaced.
+    buf_puts(out, "co2mon.");
+    if (multi_device)
+    {
+        for (const char *p = name; *p; ++p)
+        {
+            buf_append(out, *p == '.' ? "_" : p, 1);
+        }
+        buf_puts(out, ".");
+    }
+    if (item->code == CODE_TAMB)
+    {
+        buf_printf(out, "temp_celsius:%.4f|g\n", decode_temperature(item->value));
+    }
+    else if (item->code == CODE_CNTR)
+    {
+        buf_printf(out, "co2_ppm:%d|g\n", (int)item->value);
+    }
+    else
+    {
+        buf_printf(out, "x%02x:%d|g\n", item->code, (int)item->value);
+    }
+}
+
+static int
+connect_socket()
+{
+    if (sock != -1)
+    {
+        return 1;
+    }
+
+    for (struct addrinfo *ai = address; ai; ai = ai->ai_next)
+    {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        struct timeval tv;
+        tv.tv_sec = PUSH_TCP_TIMEOUT_MS / 1000;
+        tv.tv_usec = (PUSH_TCP_TIMEOUT_MS % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            sock = fd;
+            return 1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static int
+send_all(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(sock, data, len, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void
+drop_connection()
+{
+    close(sock);
+    sock = -1;
+}
+
+// Sends lines [0, len) of out, which holds count readings. Datagrams end
+// at line boundaries; a line that is longer than a datagram is sent alone.
+static void
+send_batch(const struct buf *out, int count)
+{
+    if (!connect_socket())
+    {
+        __atomic_add_fetch(&dropped_send_total, count, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (socktype == SOCK_STREAM)
+    {
+        if (send_all(out->data, out->len))
+        {
+            __atomic_add_fetch(&sent_total, count, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_add_fetch(&dropped_send_total, count, __ATOMIC_RELAXED);
+            drop_connection();
+        }
+        return;
+    }
+
+    size_t start = 0;
+    while (start < out->len)
+    {
+        size_t end = start;
+        int lines = 0;
+        while (end < out->len)
+        {
+            const char *nl = memchr(out->data + end, '\n', out->len - end);
+            size_t next = nl - out->data + 1;
+            if (lines > 0 && next - start > PUSH_DATAGRAM_MAX)
+            {
+                break;
+            }
+            end = next;
+            lines++;
+        }
+
+        if (send_all(out->data + start, end - start))
+        {
+            __atomic_add_fetch(&sent_total, lines, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            // Nothing is listening yet (ECONNREFUSED) or the buffer is full.
+            __atomic_add_fetch(&dropped_send_total, lines, __ATOMIC_RELAXED);
+        }
+        start = end;
+    }
+}
+
+static void *
+push_thread(void *arg)
+{
+    (void)arg;
+    static struct push_item batch[PUSH_QUEUE_MAX];
+    struct buf out = { 0 };
+
+    while (1)
+    {
+        struct timespec ts;
+        ts.tv_sec = flush_interval / 1000;
+        ts.tv_nsec = (flush_interval % 1000) * 1000000L;
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        {
+        }
+
+        if (pthread_mutex_lock(&queue_mutex) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_mutex_lock");
+        }
+        int count = queue_len;
+        memcpy(batch, queue, count * sizeof(batch[0]));
+        queue_len = 0;
+        if (pthread_mutex_unlock(&queue_mutex) != 0)
+        {
+            err(EXIT_FAILURE, "pthread_mutex_unlock");
+        }
+
+        if (count == 0)
+        {
+            continue;
+        }
+
+        out.len = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            format_item(&out, &batch[i]);
+        }
+        send_batch(&out, count);
+    }
+    return NULL;
+}
+
+void
+push_start()
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, push_thread, NULL) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    if (pthread_detach(tid) != 0)
+    {
+        err(EXIT_FAILURE, "pthread_detach");
+    }
+}
+
+void
+render_push_stats(struct expo *e)
+{
+    static const struct expo_label queue_full = { "reason", "queue_full" };
+    static const struct expo_label send_error = { "reason", "send_error" };
+
+    if (!address)
+    {
+        return;
+    }
+
+    expo_family(e, "co2mon_push_sent_total", "Readings sent by the push exporter.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&sent_total, __ATOMIC_RELAXED), 0);
+    expo_family(e, "co2mon_push_dropped_total", "Readings dropped by the push exporter.", EXPO_COUNTER);
+    expo_sample(e, &queue_full, 1, __atomic_load_n(&dropped_queue_total, __ATOMIC_RELAXED), 0);
+    expo_sample(e, &send_error, 1, __atomic_load_n(&dropped_send_total, __ATOMIC_RELAXED), 0);
+}
@@ -0,0 +1,46 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PUSH_H_INCLUDED_
+#define PUSH_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "co2mond.h"
+#include "expo.h"
+
+#define PUSH_FLUSH_INTERVAL_MS 1000
+#define PUSH_QUEUE_MAX 4096 /* readings waiting for a flush, newer ones are dropped */
+
+/* Parses a target such as influx+udp://host:port or statsd+tcp://host:port
+ * and resolves it. Returns 0 on error. */
+extern int
+push_init(const char *target, int flush_interval_ms);
+
+/* Starts the thread that sends the queued readings every flush interval. */
+extern void
+push_start();
+
+/* Queues a reading if the exporter is enabled. Never blocks for longer
+ * than a copy. */
+extern void
+push_reading(const struct device *device, unsigned char code, uint16_t value);
+
+extern void
+render_push_stats(struct expo *e);
+
+#endif
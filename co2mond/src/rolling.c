@@ -0,0 +1,344 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 700
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "co2mond.h"
+#include "rolling.h"
+
+const double rolling_quantiles[ROLLING_QUANTILES] = { 0.5, 0.9, 0.99 };
+
+int rolling_windows_count = 0;
+const char *rolling_window_names[ROLLING_WINDOWS_MAX];
+
+static char window_names[ROLLING_WINDOWS_MAX][24];
+static int64_t slot_ns[ROLLING_WINDOWS_MAX];
+
+/* The histogram bins cover the plausible raw values of a code, the ones
+ * outside are counted in the first or the last bin. */
+static const struct {
+    unsigned int code;
+    unsigned int lo;
+    unsigned int width;
+} layouts[ROLLING_CODES] = {
+    { CODE_TAMB, 3712, 4 }, /* -41.15 to 86.85 C by 0.25 C */
+    { CODE_CNTR, 0, 8 }, /* 0 to 4096 ppm by 8 ppm */
+};
+
+int
+rolling_parse_windows(const char *s)
+{
+    rolling_windows_count = 0;
+    while (*s)
+    {
+        char *end;
+        long long span = strtoll(s, &end, 10);
+        switch (*end)
+        {
+        case 'd':
+            span *= 24;
+            /* fallthrough */
+        case 'h':
+            span *= 60;
+            /* fallthrough */
+        case 'm':
+            span *= 60;
+            /* fallthrough */
+        case 's':
+            end++;
+        }
+        if (end == s || (*end != ',' && *end != '\0') || span < ROLLING_SLOTS || span > 366 * 86400)
+        {
+            fprintf(stderr, "Invalid window: %s\n", s);
+            return 0;
+        }
+        if (rolling_windows_count == ROLLING_WINDOWS_MAX)
+        {
+            fprintf(stderr, "Too many windows, at most %d are supported\n", ROLLING_WINDOWS_MAX);
+            return 0;
+        }
+
+        char *name = window_names[rolling_windows_count];
+        if (span % 86400 == 0)
+        {
+            snprintf(name, sizeof(window_names[0]), "%lldd", span / 86400);
+        }
+        else if (span % 3600 == 0)
+        {
+            snprintf(name, sizeof(window_names[0]), "%lldh", span / 3600);
+        }
+        else if (span % 60 == 0)
+        {
+            snprintf(name, sizeof(window_names[0]), "%lldm", span / 60);
+        }
+        else
+        {
+            snprintf(name, sizeof(window_names[0]), "%llds", span);
+        }
+        rolling_window_names[rolling_windows_count] = name;
+        slot_ns[rolling_windows_count] = span * 1000000000 / ROLLING_SLOTS;
+        rolling_windows_count++;
+
+        s = *end ? end + 1 : end;
+    }
+    return rolling_windows_count > 0;
+}
+
+struct rolling *
+rolling_new()
+{
+    if (!rolling_windows_count)
+    {
+        return NULL;
+    }
+    struct rolling *rolling = calloc(1, sizeof(*rolling));
+    if (!rolling)
+    {
+        err(EXIT_FAILURE, "calloc");
+    }
+    for (int s = 0; s < ROLLING_CODES; ++s)
+    {
+        rolling->series[s].code = layouts[s].code;
+    }
+    return rolling;
+}
+
+static int
+series_index(unsigned int code)
+{
+    for (int s = 0; s < ROLLING_CODES; ++s)
+    {
+        if (layouts[s].code == code)
+        {
+            return s;
+        }
+    }
+    return -1;
+}
+
+static int
+bin_of(int s, uint16_t value)
+{
+    if (value < layouts[s].lo)
+    {
+        return 0;
+    }
+    unsigned int bin = (value - layouts[s].lo) / layouts[s].width;
+    return bin < ROLLING_BINS ? bin : ROLLING_BINS - 1;
+}
+
+static void
+slot_expire(struct rolling_window *window, struct rolling_slot *slot, uint32_t *slot_bins)
+{
+    for (int b = 0; b < ROLLING_BINS; ++b)
+    {
+        window->bins[b] -= slot_bins[b];
+    }
+    memset(slot_bins, 0, ROLLING_BINS * sizeof(slot_bins[0]));
+    window->count -= slot->count;
+    window->sum -= slot->sum;
+    memset(slot, 0, sizeof(*slot));
+}
+
+void
+rolling_add(struct rolling *rolling, unsigned int code, uint16_t value, int64_t time_ns)
+{
+    int s = series_index(code);
+    if (!rolling || s < 0)
+    {
+        return;
+    }
+    struct rolling_series *series = &rolling->series[s];
+    const int bin = bin_of(s, value);
+
+    __atomic_store_n(&series->seq, series->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (int w = 0; w < rolling_windows_count; ++w)
+    {
+        struct rolling_window *window = &series->windows[w];
+        const int64_t index = time_ns / slot_ns[w];
+
+        // The window moves when a reading falls into a new slot.
+        if (!series->time_ns || index != series->time_ns / slot_ns[w])
+        {
+            for (int i = 0; i < ROLLING_SLOTS; ++i)
+            {
+                if (window->slots[i].count && window->slots[i].index <= index - ROLLING_SLOTS)
+                {
+                    slot_expire(window, &window->slots[i], rolling->slot_bins[s][w][i]);
+                }
+            }
+        }
+
+        const int i = index % ROLLING_SLOTS;
+        struct rolling_slot *slot = &window->slots[i];
+        if (!slot->count)
+        {
+            slot->index = index;
+            slot->min = value;
+            slot->max = value;
+        }
+        if (value < slot->min)
+        {
+            slot->min = value;
+        }
+        if (value > slot->max)
+        {
+            slot->max = value;
+        }
+        slot->count++;
+        slot->sum += value;
+        rolling->slot_bins[s][w][i][bin]++;
+        window->bins[bin]++;
+        window->count++;
+        window->sum += value;
+
+        if (series->time_ns)
+        {
+            double alpha = -expm1((double)(series->time_ns - time_ns) / (slot_ns[w] * ROLLING_SLOTS));
+            window->ewma += alpha * (value - window->ewma);
+        }
+        else
+        {
+            window->ewma = value;
+        }
+    }
+    series->time_ns = time_ns;
+
+    __atomic_store_n(&series->seq, series->seq + 1, __ATOMIC_RELEASE);
+}
+
+static double
+quantile(const struct rolling_window *window, int s, double q)
+{
+    const double rank = q * window->count;
+    double seen = 0;
+    for (int b = 0; b < ROLLING_BINS; ++b)
+    {
+        if (window->bins[b] && seen + window->bins[b] >= rank)
+        {
+            return layouts[s].lo + (b + (rank - seen) / window->bins[b]) * layouts[s].width;
+        }
+        seen += window->bins[b];
+    }
+    return layouts[s].lo + ROLLING_BINS * layouts[s].width;
+}
+
+int
+rolling_summarize(const struct rolling *rolling, unsigned int code, int64_t now_ns, struct rolling_summary *summaries)
+{
+    int s = series_index(code);
+    if (!rolling || s < 0)
+    {
+        return 0;
+    }
+
+    struct rolling_series copy;
+    const struct rolling_series *series = &rolling->series[s];
+    unsigned int seq0, seq1;
+    do
+    {
+        seq0 = __atomic_load_n(&series->seq, __ATOMIC_ACQUIRE);
+        memcpy(&copy, series, sizeof(copy));
+
+        // Slots are otherwise only expired by the next reading. Their bins
+        // are read under the same sequence number as the copy.
+        for (int w = 0; w < rolling_windows_count; ++w)
+        {
+            struct rolling_window *window = &copy.windows[w];
+            const int64_t index = now_ns / slot_ns[w];
+            for (int i = 0; i < ROLLING_SLOTS; ++i)
+            {
+                struct rolling_slot *slot = &window->slots[i];
+                if (slot->count && slot->index <= index - ROLLING_SLOTS)
+                {
+                    for (int b = 0; b < ROLLING_BINS; ++b)
+                    {
+                        window->bins[b] -= rolling->slot_bins[s][w][i][b];
+                    }
+                    window->count -= slot->count;
+                    window->sum -= slot->sum;
+                    memset(slot, 0, sizeof(*slot));
+                }
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq1 = __atomic_load_n(&series->seq, __ATOMIC_RELAXED);
+    } while ((seq0 & 1) || seq0 != seq1);
+
+    if (!copy.time_ns)
+    {
+        return 0;
+    }
+
+    for (int w = 0; w < rolling_windows_count; ++w)
+    {
+        const struct rolling_window *window = &copy.windows[w];
+        struct rolling_summary *summary = &summaries[w];
+        memset(summary, 0, sizeof(*summary));
+        summary->count = window->count;
+        if (!window->count)
+        {
+            continue;
+        }
+
+        summary->min = 65535;
+        for (int i = 0; i < ROLLING_SLOTS; ++i)
+        {
+            const struct rolling_slot *slot = &window->slots[i];
+            if (slot->count)
+            {
+                if (slot->min < summary->min)
+                {
+                    summary->min = slot->min;
+                }
+                if (slot->max > summary->max)
+                {
+                    summary->max = slot->max;
+                }
+            }
+        }
+        summary->ewma = window->ewma;
+        summary->mean = (double)window->sum / window->count;
+        for (int q = 0; q < ROLLING_QUANTILES; ++q)
+        {
+            // The bins are coarser than the readings, the extremes are exact.
+            double value = quantile(window, s, rolling_quantiles[q]);
+            summary->quantiles[q] = value < summary->min ? summary->min : value > summary->max ? summary->max : value;
+        }
+    }
+    return 1;
+}
+
+int64_t
+rolling_generation(int64_t now_ns)
+{
+    int64_t generation = 0;
+    for (int w = 0; w < rolling_windows_count; ++w)
+    {
+        generation += now_ns / slot_ns[w];
+    }
+    return generation;
+}
@@ -0,0 +1,108 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ROLLING_H_INCLUDED_
+#define ROLLING_H_INCLUDED_
+
+#include <stdint.h>
+
+/*
+ * Rolling statistics of the temperature and CO2 readings, kept up to date
+ * frame by frame so that dashboards do not have to evaluate range queries.
+ *
+ * Each configured window is made of ROLLING_SLOTS slots and moves one slot
+ * at a time, so it covers between (ROLLING_SLOTS - 1) / ROLLING_SLOTS and
+ * all of its span, ending at the time it is summarized. A device that has
+ * gone quiet ends up with empty windows rather than stale statistics. Per window there is an
+ * EWMA with the span as its time constant, the min, max and mean, and a
+ * fixed-range histogram for the quantiles, which are exact to a bin.
+ * Only the device thread adds readings; readers take consistent copies
+ * without blocking it.
+ */
+
+#define ROLLING_WINDOWS_MAX 4
+#define ROLLING_SLOTS 10
+#define ROLLING_BINS 512
+#define ROLLING_CODES 2 /* Tamb and CntR */
+#define ROLLING_QUANTILES 3
+
+struct rolling_slot {
+    int64_t index; /* time / slot length of the readings in it */
+    uint16_t min;
+    uint16_t max;
+    uint32_t count;
+    uint64_t sum;
+};
+
+struct rolling_window {
+    struct rolling_slot slots[ROLLING_SLOTS]; /* by index % ROLLING_SLOTS */
+    uint32_t bins[ROLLING_BINS]; /* all slots together */
+    uint32_t count;
+    uint64_t sum;
+    double ewma;
+};
+
+struct rolling_series {
+    unsigned int seq;
+    unsigned int code;
+    int64_t time_ns; /* monotonic time of the last reading, 0 before the first */
+    struct rolling_window windows[ROLLING_WINDOWS_MAX];
+};
+
+struct rolling {
+    struct rolling_series series[ROLLING_CODES];
+    uint32_t slot_bins[ROLLING_CODES][ROLLING_WINDOWS_MAX][ROLLING_SLOTS][ROLLING_BINS]; /* device thread only */
+};
+
+/* The statistics of one window, in raw values. */
+struct rolling_summary {
+    uint32_t count; /* 0 if the window is empty */
+    double ewma;
+    double min;
+    double max;
+    double mean;
+    double quantiles[ROLLING_QUANTILES];
+};
+
+extern const double rolling_quantiles[ROLLING_QUANTILES];
+
+extern int rolling_windows_count;
+extern const char *rolling_window_names[ROLLING_WINDOWS_MAX];
+
+/* Parses a comma-separated list of spans such as 5m,1h. Returns 0 on
+ * error. */
+extern int
+rolling_parse_windows(const char *s);
+
+/* Returns NULL unless windows are configured. */
+extern struct rolling *
+rolling_new();
+
+extern void
+rolling_add(struct rolling *rolling, unsigned int code, uint16_t value, int64_t time_ns);
+
+/* Fills one summary per configured window, as of now_ns. Returns 0 if the
+ * code has no readings. */
+extern int
+rolling_summarize(const struct rolling *rolling, unsigned int code, int64_t now_ns, struct rolling_summary *summaries);
+
+/* Returns a number that changes whenever the windows move by a slot at
+ * now_ns, after which summaries taken before are stale. */
+extern int64_t
+rolling_generation(int64_t now_ns);
+
+#endif
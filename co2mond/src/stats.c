@@ -0,0 +1,136 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "buf.h"
+#include "expo.h"
+#include "stats.h"
+
+static const int64_t bucket_bounds_ns[HISTOGRAM_BUCKETS] = {
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000,
+    1000000000, 2500000000LL, 5000000000LL,
+    10000000000LL,
+};
+
+struct histogram frame_interval_histogram = {
+    "co2mon_frame_interval_seconds",
+    "Time between consecutive frames of a device.",
+    { 0 }, 0,
+};
+
+struct histogram frame_handle_histogram = {
+    "co2mon_frame_handle_seconds",
+    "Time from the arrival of a decoded frame until it is validated and applied, including the datadir and log writes.",
+    { 0 }, 0,
+};
+
+struct histogram datadir_write_histogram = {
+    "co2mon_datadir_write_seconds",
+    "Time to write a value to the data directory.",
+    { 0 }, 0,
+};
+
+struct histogram lock_wait_histogram = {
+    "co2mon_lock_wait_seconds",
+    "Time spent waiting for the device list lock.",
+    { 0 }, 0,
+};
+
+struct histogram scrape_render_histogram = {
+    "co2mon_scrape_render_seconds",
+    "Time to render the metrics after a device state change.",
+    { 0 }, 0,
+};
+
+struct histogram scrape_duration_histogram = {
+    "co2mon_scrape_duration_seconds",
+    "Time from a complete /metrics request to the last byte of the response.",
+    { 0 }, 0,
+};
+
+struct histogram reconnect_latency_histogram = {
+    "co2mon_reconnect_latency_seconds",
+    "Time from a device hotplug event to the first valid frame.",
+    { 0 }, 0,
+};
+
+struct histogram alert_hook_latency_histogram = {
+    "co2mon_alert_hook_latency_seconds",
+    "Time from the reading that changed an alert to the end of its hook.",
+    { 0 }, 0,
+};
+
+static struct histogram *histograms[] = {
+    &frame_interval_histogram,
+    &frame_handle_histogram,
+    &datadir_write_histogram,
+    &lock_wait_histogram,
+    &scrape_render_histogram,
+    &scrape_duration_histogram,
+    &reconnect_latency_histogram,
+    &alert_hook_latency_histogram,
+};
+
+void
+histogram_observe(struct histogram *histogram, int64_t ns)
+{
+    int i = 0;
+    while (i < HISTOGRAM_BUCKETS && ns > bucket_bounds_ns[i])
+    {
+        i++;
+    }
+    __atomic_add_fetch(&histogram->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum_ns, ns > 0 ? ns : 0, __ATOMIC_RELAXED);
+}
+
+void
+render_stats(struct expo *e)
+{
+    double bounds[HISTOGRAM_BUCKETS];
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        bounds[i] = bucket_bounds_ns[i] / 1e9;
+    }
+
+    for (size_t h = 0; h < sizeof(histograms) / sizeof(histograms[0]); ++h)
+    {
+        const struct histogram *histogram = histograms[h];
+        expo_family(e, histogram->name, histogram->help, EXPO_HISTOGRAM);
+
+        // The count is the sum of the loaded buckets, so that it always
+        // matches the +Inf bucket.
+        uint64_t count = 0;
+        for (int i = 0; i <= HISTOGRAM_BUCKETS; ++i)
+        {
+            count += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+            if (i < HISTOGRAM_BUCKETS)
+            {
+                counts[i] = count;
+            }
+        }
+        expo_histogram(e, NULL, 0, bounds, counts, HISTOGRAM_BUCKETS, count,
+            __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STATS_H_INCLUDED_
+#define STATS_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "expo.h"
+
+/*
+ * Self-instrumentation of co2mond, exported with the device metrics.
+ *
+ * Histograms use one set of buckets, from 1us to 10s in 1-2.5-5 steps,
+ * wide enough for both the per-frame work and the frame intervals.
+ * Observations are lock-free, so device threads never wait for a scrape.
+ */
+
+#define HISTOGRAM_BUCKETS 22
+
+struct histogram {
+    const char *name;
+    const char *help;
+    uint64_t buckets[HISTOGRAM_BUCKETS + 1]; /* not cumulative, the last one is +Inf */
+    uint64_t sum_ns;
+};
+
+extern struct histogram frame_interval_histogram;
+extern struct histogram frame_handle_histogram;
+extern struct histogram datadir_write_histogram;
+extern struct histogram lock_wait_histogram;
+extern struct histogram scrape_render_histogram;
+extern struct histogram scrape_duration_histogram;
+extern struct histogram reconnect_latency_histogram;
+extern struct histogram alert_hook_latency_histogram;
+
+extern void
+histogram_observe(struct histogram *histogram, int64_t ns);
+
+extern void
+render_stats(struct expo *e);
+
+#endif
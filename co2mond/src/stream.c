@@ -0,0 +1,259 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "http.h"
+#include "stream.h"
+
+/*
+ * Live readings for /stream and the local socket.
+ *
+ * Device threads claim a slot of a ring with an atomic increment and fill
+ * it under a per-slot sequence number, so they never wait for each other
+ * or for the readers. The first reading after a reader has caught up
+ * writes a byte to the reader's pipe to wake it up. Each reader keeps its
+ * own position; if it falls behind by more than the ring, the oldest
+ * readings are lost to it.
+ */
+
+struct stream_event {
+    unsigned int seq; /* 2 * index + 1 while written, 2 * index + 2 when complete */
+    struct stream_reading reading;
+};
+
+struct stream_reader {
+    unsigned int tail; /* next index to read */
+    int wake_pipe[2];
+    int wake_pending;
+};
+
+static struct stream_event ring[STREAM_RING_SIZE];
+static unsigned int ring_head; /* index of the next slot to claim */
+static struct stream_reader readers[STREAM_READERS_MAX];
+static int readers_count;
+
+static struct stream_reader *http_reader;
+
+int stream_clients;
+uint64_t stream_dropped_total;
+static uint64_t events_total;
+static uint64_t lost_total;
+
+struct stream_reader *
+stream_reader_new()
+{
+    if (readers_count == STREAM_READERS_MAX)
+    {
+        errx(EXIT_FAILURE, "too many stream readers");
+    }
+    struct stream_reader *reader = &readers[readers_count];
+    if (pipe(reader->wake_pipe) != 0)
+    {
+        err(EXIT_FAILURE, "pipe");
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        int flags = fcntl(reader->wake_pipe[i], F_GETFL);
+        if (flags == -1 || fcntl(reader->wake_pipe[i], F_SETFL, flags | O_NONBLOCK) == -1 ||
+            fcntl(reader->wake_pipe[i], F_SETFD, FD_CLOEXEC) == -1)
+        {
+            err(EXIT_FAILURE, "fcntl");
+        }
+    }
+    reader->tail = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    __atomic_store_n(&readers_count, readers_count + 1, __ATOMIC_RELEASE);
+    return reader;
+}
+
+int
+stream_reader_fd(struct stream_reader *reader)
+{
+    return reader->wake_pipe[0];
+}
+
+void
+stream_reading(const struct device *device, unsigned char code, uint16_t value)
+{
+    const int count = __atomic_load_n(&readers_count, __ATOMIC_ACQUIRE);
+    if (count == 0)
+    {
+        return;
+    }
+
+    const int64_t time_ms = realtime_ms();
+    const unsigned int index = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    struct stream_event *event = &ring[index % STREAM_RING_SIZE];
+    __atomic_store_n(&event->seq, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->reading.device = device - devices;
+    event->reading.code = code;
+    event->reading.value = value;
+    event->reading.time_ms = time_ms;
+    __atomic_store_n(&event->seq, 2 * index + 2, __ATOMIC_RELEASE);
+
+    for (int r = 0; r < count && r < STREAM_READERS_MAX; ++r)
+    {
+        if (!__atomic_exchange_n(&readers[r].wake_pending, 1, __ATOMIC_ACQ_REL))
+        {
+            // A full pipe already wakes the reader up.
+            ssize_t n = write(readers[r].wake_pipe[1], "", 1);
+            (void)n;
+        }
+    }
+}
+
+int
+stream_read(struct stream_reader *reader, struct stream_reading *out, int max)
+{
+    char drain[64];
+    while (read(reader->wake_pipe[0], drain, sizeof(drain)) > 0)
+    {
+    }
+    // Readings completed from now on write to the pipe again, the earlier
+    // ones are visible below.
+    __atomic_exchange_n(&reader->wake_pending, 0, __ATOMIC_ACQ_REL);
+
+    const unsigned int head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    if (head - reader->tail > STREAM_RING_SIZE)
+    {
+        __atomic_add_fetch(&lost_total, head - reader->tail - STREAM_RING_SIZE, __ATOMIC_RELAXED);
+        reader->tail = head - STREAM_RING_SIZE;
+    }
+
+    int count = 0;
+    while (reader->tail != head && count < max)
+    {
+        const struct stream_event *slot = &ring[reader->tail % STREAM_RING_SIZE];
+        const unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if ((int)(seq - (2 * reader->tail + 2)) < 0)
+        {
+            // Claimed but not complete yet; its writer wakes us up again.
+            break;
+        }
+
+        out[count] = slot->reading;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != 2 * reader->tail + 2 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+        {
+            // Overwritten by a writer that has lapped us.
+            __atomic_add_fetch(&lost_total, 1, __ATOMIC_RELAXED);
+            reader->tail++;
+            continue;
+        }
+
+        count++;
+        reader->tail++;
+    }
+    return count;
+}
+
+void
+stream_http_init()
+{
+    http_reader = stream_reader_new();
+}
+
+int
+stream_http_fd()
+{
+    return stream_reader_fd(http_reader);
+}
+
+static void
+format_event(struct buf *out, const struct stream_reading *reading)
+{
+    buf_puts(out, "data: {");
+    if (multi_device)
+    {
+        // Device names only contain [0-9A-Za-z._-], nothing to escape.
+        buf_printf(out, "\"device\":\"%s\",", devices[reading->device].name);
+    }
+    if (reading->code == CODE_TAMB)
+    {
+        buf_printf(out, "\"name\":\"Tamb\",\"value\":%.4f", decode_temperature(reading->value));
+    }
+    else if (reading->code == CODE_CNTR)
+    {
+        buf_printf(out, "\"name\":\"CntR\",\"value\":%d", (int)reading->value);
+    }
+    else
+    {
+        buf_printf(out, "\"name\":\"x%02x\",\"value\":%d", reading->code, (int)reading->value);
+    }
+    buf_printf(out, ",\"time\":%lld.%03d}\n\n",
+        (long long)(reading->time_ms / 1000), (int)(reading->time_ms % 1000));
+}
+
+void
+stream_collect(struct buf *out)
+{
+    struct stream_reading batch[64];
+    int n;
+    do
+    {
+        n = stream_read(http_reader, batch, 64);
+        for (int i = 0; i < n; ++i)
+        {
+            format_event(out, &batch[i]);
+        }
+        __atomic_add_fetch(&events_total, n, __ATOMIC_RELAXED);
+    } while (n == 64);
+}
+
+void
+stream_handler(const struct http_request *req, struct http_response *resp)
+{
+    (void)req;
+
+    if (__atomic_load_n(&stream_clients, __ATOMIC_RELAXED) >= STREAM_CLIENTS_MAX)
+    {
+        resp->status = 503;
+        buf_puts(&resp->body, "Too many /stream clients.\r\n");
+        return;
+    }
+
+    resp->stream = 1;
+    resp->content_type = "text/event-stream";
+    buf_puts(&resp->headers, "Cache-Control: no-cache\r\n");
+    buf_puts(&resp->body, "retry: 1000\n\n");
+}
+
+void
+render_stream_stats(struct expo *e)
+{
+    expo_family(e, "co2mon_stream_clients", "Connected /stream clients.", EXPO_GAUGE);
+    expo_sample(e, NULL, 0, __atomic_load_n(&stream_clients, __ATOMIC_RELAXED), 0);
+    expo_family(e, "co2mon_stream_events_total", "Readings sent to the /stream clients.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&events_total, __ATOMIC_RELAXED), 0);
+    expo_family(e, "co2mon_stream_lost_total", "Readings overwritten before a reader could take them.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&lost_total, __ATOMIC_RELAXED), 0);
+    expo_family(e, "co2mon_stream_dropped_total", "/stream clients disconnected for being too slow.", EXPO_COUNTER);
+    expo_sample(e, NULL, 0, __atomic_load_n(&stream_dropped_total, __ATOMIC_RELAXED), 0);
+}
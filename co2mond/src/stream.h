@@ -0,0 +1,85 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STREAM_H_INCLUDED_
+#define STREAM_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "buf.h"
+#include "co2mond.h"
+#include "expo.h"
+#include "http.h"
+
+#define STREAM_RING_SIZE 1024 /* readings not yet sent to the clients, a power of two */
+#define STREAM_READERS_MAX 4
+#define STREAM_CLIENTS_MAX 192 /* leaves connections for /metrics */
+#define STREAM_CLIENT_BUFFER_MAX 65536 /* unsent bytes, slower clients are dropped */
+#define STREAM_HEARTBEAT_MS 15000
+
+struct stream_reading {
+    int device; /* index in devices */
+    unsigned char code;
+    uint16_t value;
+    int64_t time_ms; /* since the Epoch */
+};
+
+struct stream_reader;
+
+/* Adds a consumer of the readings published from now on, with its own
+ * wakeup pipe. Readers are added before the device threads start. */
+extern struct stream_reader *
+stream_reader_new();
+
+/* Becomes readable when stream_read() has readings to return. */
+extern int
+stream_reader_fd(struct stream_reader *reader);
+
+/* Copies up to max readings published since the previous call and returns
+ * their number; call again while it returns max. Only one thread may use
+ * a reader. */
+extern int
+stream_read(struct stream_reader *reader, struct stream_reading *out, int max);
+
+/* Publishes a reading to the readers. Never blocks. */
+extern void
+stream_reading(const struct device *device, unsigned char code, uint16_t value);
+
+/* The /stream endpoint, served by the HTTP thread. */
+
+extern void
+stream_http_init();
+
+extern int
+stream_http_fd();
+
+/* Appends the readings published since the previous call as Server-Sent
+ * Events. */
+extern void
+stream_collect(struct buf *out);
+
+/* Updated by the HTTP thread. */
+extern int stream_clients;
+extern uint64_t stream_dropped_total;
+
+extern void
+stream_handler(const struct http_request *req, struct http_response *resp);
+
+extern void
+render_stream_stats(struct expo *e);
+
+#endif
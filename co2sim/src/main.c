@@ -0,0 +1,350 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* BUS_USB */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+/*
+ * Virtual CO2 monitor: creates a USB-zyTemp device through /dev/uhid that
+ * answers the magic table feature report and sends valid frames, so that
+ * co2mond can be run against it without hardware.
+ */
+
+#define VENDOR_ID 0x04d9
+#define PRODUCT_ID 0xa052
+
+#define CODE_TAMB 0x42 /* Ambient Temperature */
+#define CODE_CNTR 0x50 /* Relative Concentration of CO2 */
+
+/* The descriptor of the real device: 8 byte input and feature reports on a
+ * vendor-defined page. */
+static const unsigned char report_descriptor[] = {
+    0x06, 0x00, 0xff, /* Usage Page (Vendor Defined 0xFF00) */
+    0x09, 0x01,       /* Usage (0x01) */
+    0xa1, 0x01,       /* Collection (Application) */
+    0x15, 0x00,       /*   Logical Minimum (0) */
+    0x26, 0xff, 0x00, /*   Logical Maximum (255) */
+    0x75, 0x08,       /*   Report Size (8) */
+    0x95, 0x08,       /*   Report Count (8) */
+    0x81, 0x02,       /*   Input (Data,Var,Abs) */
+    0x95, 0x08,       /*   Report Count (8) */
+    0xb1, 0x02,       /*   Feature (Data,Var,Abs) */
+    0xc0,             /* End Collection */
+};
+
+static volatile sig_atomic_t stop = 0;
+
+int scramble_frames = 0;
+unsigned char magic_table[8];
+int opened = 0;
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+uhid_write(int fd, const struct uhid_event *ev)
+{
+    ssize_t r = write(fd, ev, sizeof(*ev));
+    if (r < 0)
+    {
+        err(EXIT_FAILURE, "write(/dev/uhid)");
+    }
+    if (r != sizeof(*ev))
+    {
+        errx(EXIT_FAILURE, "write(/dev/uhid): short write");
+    }
+}
+
+/* Inverse of the decoding done by libco2mon for release 0x0100 devices. */
+static void
+scramble(const unsigned char *frame, unsigned char *out)
+{
+    static const unsigned char magic_word[8] = "Htemp99e";
+    static const int swaps[8] = { 2, 4, 0, 7, 1, 6, 5, 3 };
+    unsigned char r[8], buf[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        r[i] = frame[i] + ((magic_word[i] << 4) | (magic_word[i] >> 4));
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        buf[i] = (unsigned char)(r[i] << 3) | (r[(i + 1) % 8] >> 5);
+        buf[i] ^= magic_table[i];
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        out[i] = buf[swaps[i]];
+    }
+}
+
+/* Cycles through the items the real device reports, with slowly
+ * drifting values. */
+static void
+next_frame(unsigned long n, unsigned char *frame)
+{
+    static const unsigned char codes[] = { CODE_CNTR, CODE_TAMB, 0x41, 0x43, 0x6d, 0x6e, 0x71 };
+    unsigned char code = codes[n % sizeof(codes)];
+    unsigned long step = n / sizeof(codes);
+    uint16_t value;
+    switch (code)
+    {
+    case CODE_CNTR:
+        value = 400 + step % 1600;
+        break;
+    case CODE_TAMB:
+        value = (uint16_t)((22.0 + 273.15) * 16) + step % 32;
+        break;
+    default:
+        value = step & 0xffff;
+    }
+
+    unsigned char plain[8] = { 0 };
+    plain[0] = code;
+    plain[1] = value >> 8;
+    plain[2] = value & 0xff;
+    plain[3] = plain[0] + plain[1] + plain[2];
+    plain[4] = 0x0d;
+
+    if (scramble_frames)
+    {
+        scramble(plain, frame);
+    }
+    else
+    {
+        memcpy(frame, plain, sizeof(plain));
+    }
+}
+
+static void
+handle_event(int fd)
+{
+    struct uhid_event ev;
+    ssize_t r = read(fd, &ev, sizeof(ev));
+    if (r < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN)
+        {
+            return;
+        }
+        err(EXIT_FAILURE, "read(/dev/uhid)");
+    }
+
+    struct uhid_event reply;
+    memset(&reply, 0, sizeof(reply));
+    switch (ev.type)
+    {
+    case UHID_OPEN:
+        opened = 1;
+        break;
+    case UHID_CLOSE:
+        opened = 0;
+        break;
+    case UHID_SET_REPORT:
+        // The magic table, as sent by co2mon_send_magic_table(); the
+        // report number is its first byte.
+        memset(magic_table, 0, sizeof(magic_table));
+        memcpy(magic_table, ev.u.set_report.data,
+               ev.u.set_report.size < sizeof(magic_table) ? ev.u.set_report.size : sizeof(magic_table));
+        reply.type = UHID_SET_REPORT_REPLY;
+        reply.u.set_report_reply.id = ev.u.set_report.id;
+        reply.u.set_report_reply.err = 0;
+        uhid_write(fd, &reply);
+        break;
+    case UHID_GET_REPORT:
+        reply.type = UHID_GET_REPORT_REPLY;
+        reply.u.get_report_reply.id = ev.u.get_report.id;
+        reply.u.get_report_reply.err = EIO;
+        uhid_write(fd, &reply);
+        break;
+    default:
+        break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double rate = 1.0;
+    unsigned long count = 0;
+    int version = -1;
+
+    int c;
+    int opterr = 0;
+    int show_help = 0;
+    while ((c = getopt(argc, argv, ":hsc:r:v:")) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            show_help = 1;
+            break;
+        case 's':
+            scramble_frames = 1;
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'v':
+            version = strtol(optarg, NULL, 16);
+            break;
+        case ':':
+            fprintf(stderr, "Option -%c requires an operand\n", optopt);
+            opterr++;
+            break;
+        case '?':
+            fprintf(stderr, "Unrecognized option: -%c\n", optopt);
+            opterr++;
+        }
+    }
+    if (show_help || opterr || optind != argc || rate < 0)
+    {
+        fprintf(stderr, "usage: co2sim [-hs] [-r rate] [-c count] [-v version]\n");
+        if (show_help)
+        {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  -h    show this help message\n");
+            fprintf(stderr, "  -s    scramble frames like release 0x0100 devices\n");
+            fprintf(stderr, "  -r rate\n");
+            fprintf(stderr, "        frames per second (default 1, 0 for as fast as possible)\n");
+            fprintf(stderr, "  -c count\n");
+            fprintf(stderr, "        exit after sending count frames\n");
+            fprintf(stderr, "  -v version\n");
+            fprintf(stderr, "        device version in hex (default 0100 with -s, 0200 otherwise)\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "The release of a virtual device cannot be auto-detected, so co2mond\n");
+            fprintf(stderr, "should be run with -N for scrambled frames and -n otherwise.\n");
+            fprintf(stderr, "\n");
+        }
+        exit(1);
+    }
+    if (version == -1)
+    {
+        version = scramble_frames ? 0x0100 : 0x0200;
+    }
+
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+    {
+        err(EXIT_FAILURE, "/dev/uhid");
+    }
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "Holtek USB-zyTemp (co2sim)");
+    memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+    ev.u.create2.rd_size = sizeof(report_descriptor);
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = VENDOR_ID;
+    ev.u.create2.product = PRODUCT_ID;
+    ev.u.create2.version = version;
+    uhid_write(fd, &ev);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    unsigned long sent = 0;
+    int64_t interval = rate > 0 ? (int64_t)(1e9 / rate) : 0;
+    int64_t start = 0;
+    int64_t next = 0;
+    int was_opened = 0;
+    while (!stop && (count == 0 || sent < count))
+    {
+        int64_t now = monotonic_ns();
+        int timeout = -1;
+        if (opened)
+        {
+            if (!was_opened)
+            {
+                // Rate is kept from the moment a reader appears.
+                start = now;
+                next = now;
+                was_opened = 1;
+                fprintf(stderr, "co2sim: device opened\n");
+            }
+
+            // Send every frame that is due, so that high rates are kept on
+            // average in spite of the poll() resolution.
+            while (next <= now && (count == 0 || sent < count))
+            {
+                memset(&ev, 0, sizeof(ev));
+                ev.type = UHID_INPUT2;
+                ev.u.input2.size = 8;
+                next_frame(sent, ev.u.input2.data);
+                uhid_write(fd, &ev);
+                sent++;
+                next += interval;
+                if (interval == 0)
+                {
+                    break;
+                }
+            }
+            timeout = interval == 0 ? 0 : (int)((next - now + 999999) / 1000000);
+        }
+        else if (was_opened)
+        {
+            was_opened = 0;
+            fprintf(stderr, "co2sim: device closed\n");
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) > 0)
+        {
+            handle_event(fd);
+        }
+    }
+
+    double elapsed = start ? (monotonic_ns() - start) / 1e9 : 0;
+    fprintf(stderr, "co2sim: sent %lu frames in %.3f s\n", sent, elapsed);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    uhid_write(fd, &ev);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Native collectd plugin: reads the snapshots that co2mond publishes with
+ * -S, so that a read costs a few memory loads instead of opening and
+ * parsing files from the data directory.
+ *
+ *   LoadPlugin co2mon
+ *   <Plugin co2mon>
+ *       ShmFile "/dev/shm/co2mon"
+ *   </Plugin>
+ *
+ * Values are dispatched like graph/collectd/co2mon.py does, with the device
+ * name as the plugin instance when co2mond serves several devices.
+ */
+
+#define _XOPEN_SOURCE 700 /* PATH_MAX, strcasecmp */
+
+#include "collectd.h"
+#include "plugin.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "co2mon.h"
+
+#define CODE_TAMB 0x42 /* Ambient Temperature */
+#define CODE_CNTR 0x50 /* Relative Concentration of CO2 */
+
+static char shm_path[PATH_MAX] = CO2MON_SHM_PATH;
+static co2mon_shm shm;
+static int64_t last_heartbeat[CO2MON_SHM_DEVICES];
+
+static int
+is_set(const uint8_t *bitarr, unsigned int ndx)
+{
+    return bitarr[ndx >> 3] & (1u << (ndx & 0x07u)) ? 1 : 0;
+}
+
+static int
+co2mon_config(oconfig_item_t *ci)
+{
+    for (int i = 0; i < ci->children_num; ++i)
+    {
+        oconfig_item_t *child = ci->children + i;
+        if (strcasecmp(child->key, "ShmFile") == 0 &&
+            child->values_num == 1 && child->values[0].type == OCONFIG_TYPE_STRING)
+        {
+            snprintf(shm_path, sizeof(shm_path), "%s", child->values[0].value.string);
+        }
+        else
+        {
+            ERROR("co2mon plugin: invalid option %s", child->key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+dispatch(const char *instance, cdtime_t time, const char *type, const char *type_instance, gauge_t gauge)
+{
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t value;
+
+    value.gauge = gauge;
+    vl.values = &value;
+    vl.values_len = 1;
+    vl.time = time;
+    snprintf(vl.plugin, sizeof(vl.plugin), "co2mon");
+    snprintf(vl.plugin_instance, sizeof(vl.plugin_instance), "%s", instance);
+    snprintf(vl.type, sizeof(vl.type), "%s", type);
+    snprintf(vl.type_instance, sizeof(vl.type_instance), "%s", type_instance);
+    plugin_dispatch_values(&vl);
+}
+
+static int
+co2mon_read(void)
+{
+    if (!shm)
+    {
+        // co2mond may start after collectd.
+        if (access(shm_path, R_OK) != 0)
+        {
+            return -1;
+        }
+        shm = co2mon_shm_open(shm_path);
+        if (!shm)
+        {
+            return -1;
+        }
+    }
+
+    int count = co2mon_shm_devices(shm);
+    for (int d = 0; d < count; ++d)
+    {
+        struct co2mon_snapshot snapshot;
+        if (co2mon_shm_read(shm, d, &snapshot) != 1)
+        {
+            continue;
+        }
+        if (!is_set(snapshot.seen, CODE_TAMB) || !is_set(snapshot.seen, CODE_CNTR))
+        {
+            continue;
+        }
+        // Only new readings are dispatched.
+        if (snapshot.heartbeat <= last_heartbeat[d])
+        {
+            continue;
+        }
+        last_heartbeat[d] = snapshot.heartbeat;
+
+        cdtime_t time = TIME_T_TO_CDTIME_T(snapshot.heartbeat);
+        dispatch(snapshot.name, time, "gauge", "co2_ppm", snapshot.data[CODE_CNTR]);
+        dispatch(snapshot.name, time, "temperature", "", snapshot.data[CODE_TAMB] * 0.0625 - 273.15);
+    }
+    return 0;
+}
+
+static int
+co2mon_shutdown(void)
+{
+    if (shm)
+    {
+        co2mon_shm_close(shm);
+        shm = NULL;
+    }
+    return 0;
+}
+
+void
+module_register(void)
+{
+    plugin_register_complex_config("co2mon", co2mon_config);
+    plugin_register_read("co2mon", co2mon_read);
+    plugin_register_shutdown("co2mon", co2mon_shutdown);
+}
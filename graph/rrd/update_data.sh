@@ -1,18 +1,5 @@
 #!/bin/sh
-last_co2=U
-last_temp=U
-
-update_rrd() {
-    rrdtool update graph.rrd --template CO2:TEMP -- N:$last_co2:$last_temp
-}
-
-../../build/co2mond/co2mond | while read -r name value; do
-    echo "$name $value"
-    if [ "$name" = "CntR" ]; then
-        last_co2=$value
-        update_rrd
-    elif [ "$name" = "Tamb" ]; then
-        last_temp=$value
-        update_rrd
-    fi
-done
+# co2mond keeps the round-robin archive in ./co2mon.rra itself, with the
+# step and archives of graph.rrd, and serves it on /archive for
+# update_graph.sh.
+exec ../../build/co2mond/co2mond -R . -P 127.0.0.1:8080
@@ -1,8 +1,13 @@
 #!/bin/bash
+restore() {
+    curl -sf -o archive.xml http://127.0.0.1:8080/archive &&
+        rrdtool restore -f archive.xml graph.rrd
+}
+
 while true; do
-    make graph-all-1d.png
+    restore && make graph-all-1d.png
     for i in {1..12}; do
-        make graph-all-1h.png
+        restore && make graph-all-1h.png
         sleep 5
     done
 done
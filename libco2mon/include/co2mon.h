@@ -18,12 +18,15 @@
 #ifndef CO2MON_H_INCLUDED_
 #define CO2MON_H_INCLUDED_
 
-#include <hidapi.h>
+#include <stddef.h>
+#include <stdint.h>
 
-typedef hid_device *co2mon_device;
+typedef struct co2mon_device_ *co2mon_device;
 
 typedef unsigned char co2mon_data_t[8];
 
+typedef void (*co2mon_enumerate_cb)(const char *path, void *arg);
+
 extern int
 co2mon_init(int);
 
@@ -36,6 +39,9 @@ co2mon_open_device();
 extern co2mon_device
 co2mon_open_device_path(const char *path);
 
+extern int
+co2mon_enumerate_devices(co2mon_enumerate_cb cb, void *arg);
+
 extern void
 co2mon_close_device(co2mon_device dev);
 
@@ -48,4 +54,222 @@ co2mon_send_magic_table(co2mon_device dev, co2mon_data_t magic_table);
 extern int
 co2mon_read_data(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t result);
 
+/*
+ * Decodes count raw frames of a release 0x0100 device, stored back to
+ * back, into out, which may be the same array as in. Used for reprocessing
+ * captured frames; it picks the fastest kernel the CPU supports.
+ */
+extern void
+co2mon_decode_frames(const unsigned char *magic_table, const unsigned char *in, unsigned char *out, size_t count);
+
+/*
+ * Non-blocking reading.
+ *
+ * co2mon_device_fd() returns a descriptor that becomes readable when
+ * frames are available, for use with poll(), select() or epoll; it must
+ * not be read directly. Once it has been requested, the device should only
+ * be read with co2mon_read_frames() or co2mon_dispatch_frames().
+ *
+ * co2mon_read_frames() decodes up to max available frames without waiting
+ * and returns their number, 0 if there are none, or -1 if the device
+ * failed and has to be reopened. co2mon_dispatch_frames() passes every
+ * available frame to a callback and returns their number or -1.
+ */
+
+typedef void (*co2mon_frame_cb)(co2mon_device dev, co2mon_data_t frame, void *arg);
+
+extern int
+co2mon_device_fd(co2mon_device dev);
+
+extern int
+co2mon_read_frames(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t *frames, int max);
+
+extern int
+co2mon_dispatch_frames(co2mon_device dev, co2mon_data_t magic_table, co2mon_frame_cb cb, void *arg);
+
+/*
+ * Capture and replay of raw frames.
+ *
+ * co2mon_capture_start() appends every raw frame read from dev, with the
+ * time since the previous one, to a capture file until the device is
+ * closed. A capture file can be opened like a device with the path
+ * "replay:<file>", which plays it back in real time, or
+ * "replay-fast:<file>", which plays it back as fast as it is read. The
+ * frames go through the usual decoding, and reading fails at the end of
+ * the file.
+ */
+
+extern int
+co2mon_capture_start(co2mon_device dev, const char *path);
+
+/*
+ * Append-only sample log.
+ *
+ * Samples are stored in independent blocks of at most
+ * CO2MON_LOG_BLOCK_MAX bytes, each with a CRC-32. Timestamps are delta of
+ * delta encoded and values are XORed with the previous value of the same
+ * code, both as varints. A block is written with a single write() once it
+ * is full or older than the flush interval, so a crash loses at most the
+ * block that was being filled. co2mon_log_open() truncates a torn block
+ * left by such a crash before appending; corrupt blocks followed by intact
+ * ones are kept and skipped by both the writer and the reader.
+ */
+
+#define CO2MON_LOG_BLOCK_MAX 4096
+
+typedef struct co2mon_log_ *co2mon_log;
+
+typedef struct co2mon_log_reader_ *co2mon_log_reader;
+
+struct co2mon_log_record {
+    int64_t time; /* milliseconds since the Epoch */
+    unsigned char code;
+    uint16_t value;
+};
+
+extern co2mon_log
+co2mon_log_open(const char *path, int flush_interval_ms);
+
+extern int
+co2mon_log_append(co2mon_log log, const struct co2mon_log_record *record);
+
+extern int
+co2mon_log_flush(co2mon_log log);
+
+extern void
+co2mon_log_close(co2mon_log log);
+
+extern co2mon_log_reader
+co2mon_log_reader_open(const char *path);
+
+/* Returns 1 if a record was read, 0 at the end of the log and -1 if the
+ * rest of the log is corrupted. Corrupt blocks in the middle are skipped. */
+extern int
+co2mon_log_read(co2mon_log_reader reader, struct co2mon_log_record *record);
+
+extern void
+co2mon_log_reader_close(co2mon_log_reader reader);
+
+/*
+ * Shared-memory publication of the latest readings.
+ *
+ * co2mond maps a file (CO2MON_SHM_PATH by default) and updates a snapshot
+ * per device in place, guarded by a sequence counter, so that publishing
+ * does not cost any system calls. Readers map the same file and retry
+ * their copy until it is consistent; they never block the daemon.
+ */
+
+#define CO2MON_SHM_PATH "/dev/shm/co2mon"
+#define CO2MON_SHM_DEVICES 64
+#define CO2MON_NAME_MAX 64
+
+typedef struct co2mon_shm_ *co2mon_shm;
+
+struct co2mon_snapshot {
+    char name[CO2MON_NAME_MAX]; /* device path with unsafe characters replaced, empty for the first matching device */
+    int64_t heartbeat; /* seconds since the Epoch of the last accepted frame */
+    uint32_t errors; /* device error counter */
+    uint8_t seen[32]; /* bitmap of codes present in data */
+    uint16_t data[256]; /* last value per code */
+};
+
+/* Writer side, used by co2mond. */
+
+extern co2mon_shm
+co2mon_shm_create(const char *path);
+
+extern int
+co2mon_shm_add_device(co2mon_shm shm, const char *name);
+
+extern struct co2mon_snapshot *
+co2mon_shm_write_begin(co2mon_shm shm, int device);
+
+extern void
+co2mon_shm_write_end(co2mon_shm shm, int device);
+
+/* Reader side. */
+
+extern co2mon_shm
+co2mon_shm_open(const char *path);
+
+extern int
+co2mon_shm_devices(co2mon_shm shm);
+
+/* Returns 1 on success, 0 if there is no such device and -1 if no
+ * consistent copy could be taken (the writer died during an update). */
+extern int
+co2mon_shm_read(co2mon_shm shm, int device, struct co2mon_snapshot *snapshot);
+
+extern void
+co2mon_shm_close(co2mon_shm shm);
+
+/*
+ * Local socket protocol.
+ *
+ * co2mond can listen on a Unix stream socket (CO2MON_SOCKET_PATH by
+ * default) for consumers on the same host. A client writes a
+ * struct co2mon_request and reads fixed-size struct co2mon_record
+ * values in the host byte order. CO2MON_REQUEST_SNAPSHOT returns the last
+ * value of every code of every device, ended by a record with
+ * CO2MON_RECORD_END set; CO2MON_REQUEST_SUBSCRIBE returns the same
+ * snapshot and then every new reading as it is accepted. Subscribers that
+ * do not keep up are disconnected. Only root, the user co2mond runs as and
+ * members of its group are served.
+ *
+ * Devices are identified by their index, in the order of the device
+ * labels of /metrics and of co2mon_shm_devices().
+ */
+
+#define CO2MON_SOCKET_PATH "/run/co2mon.sock"
+
+#define CO2MON_REQUEST_SNAPSHOT 1
+#define CO2MON_REQUEST_SUBSCRIBE 2
+
+#define CO2MON_RECORD_END 0x01 /* the last record of a snapshot, carries no value */
+
+struct co2mon_request {
+    uint32_t op;
+    uint32_t reserved;
+};
+
+struct co2mon_record {
+    uint16_t device;
+    uint8_t code;
+    uint8_t flags;
+    uint16_t value;
+    uint16_t reserved;
+    int64_t time; /* milliseconds since the Epoch */
+};
+
+typedef struct co2mon_client_ *co2mon_client;
+
+/* Connects to co2mond, path may be NULL for CO2MON_SOCKET_PATH. */
+extern co2mon_client
+co2mon_client_open(const char *path);
+
+/* Stores up to max records of a snapshot and returns their number, or -1
+ * on error. Records that do not fit are discarded. */
+extern int
+co2mon_client_snapshot(co2mon_client client, struct co2mon_record *records, int max);
+
+/* Like co2mon_client_snapshot(), then turns the connection into a
+ * subscription that is read with co2mon_client_read(). */
+extern int
+co2mon_client_subscribe(co2mon_client client, struct co2mon_record *records, int max);
+
+/* A descriptor that becomes readable when new records arrive. Records
+ * may already be buffered by the client, so co2mon_client_read() is called
+ * until it returns less than max before waiting for it. */
+extern int
+co2mon_client_fd(co2mon_client client);
+
+/* Waits up to timeout_ms (-1 for no limit) for new readings of a
+ * subscription, stores up to max of them and returns their number, 0 on
+ * timeout or -1 if the connection is lost. */
+extern int
+co2mon_client_read(co2mon_client client, struct co2mon_record *records, int max, int timeout_ms);
+
+extern void
+co2mon_client_close(co2mon_client client);
+
 #endif
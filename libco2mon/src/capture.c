@@ -0,0 +1,315 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* clock_gettime, nanosleep */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "co2mon.h"
+#include "device.h"
+
+/*
+ * Capture file format:
+ *
+ *   header: "CO2CAP\0\1", release number (16-bit little-endian), 6 zero bytes
+ *   record: microseconds since the previous frame (varint), raw frame (8 bytes)
+ *
+ * The first frame after co2mon_capture_start() has a delay of 0, so a file
+ * can be appended to across reconnects. A torn record at the end is
+ * ignored on replay.
+ */
+
+static const char capture_magic[8] = "CO2CAP\0\1";
+
+#define CAPTURE_HEADER_SIZE 16
+
+struct capture {
+    FILE *f;
+    int64_t last_us;
+};
+
+struct replay_device {
+    struct co2mon_device_ base;
+    FILE *f;
+    int fast;
+    int64_t start_us;
+    int64_t due_us; /* time of the next frame, relative to start_us */
+    int have_next;
+    co2mon_data_t next;
+    unsigned long frames;
+};
+
+static int64_t
+monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_us(int64_t us)
+{
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    {
+    }
+}
+
+int
+co2mon_capture_start(co2mon_device dev, const char *path)
+{
+    FILE *f = fopen(path, "ab");
+    if (!f)
+    {
+        perror(path);
+        return 0;
+    }
+
+    if (ftell(f) == 0)
+    {
+        unsigned char header[CAPTURE_HEADER_SIZE] = { 0 };
+        memcpy(header, capture_magic, sizeof(capture_magic));
+        uint16_t release = dev->release_number < 0 ? 0 : dev->release_number;
+        header[8] = release & 0xff;
+        header[9] = release >> 8;
+        if (fwrite(header, sizeof(header), 1, f) != 1 || fflush(f) != 0)
+        {
+            perror(path);
+            fclose(f);
+            return 0;
+        }
+    }
+
+    struct capture *capture = malloc(sizeof(*capture));
+    if (!capture)
+    {
+        perror("malloc");
+        fclose(f);
+        return 0;
+    }
+    capture->f = f;
+    capture->last_us = -1;
+
+    if (dev->capture)
+    {
+        capture_close(dev->capture);
+    }
+    dev->capture = capture;
+    return 1;
+}
+
+void
+capture_frame(struct capture *capture, const co2mon_data_t frame)
+{
+    int64_t now = monotonic_us();
+    uint64_t delta = capture->last_us < 0 ? 0 : now - capture->last_us;
+    capture->last_us = now;
+
+    unsigned char record[10 + sizeof(co2mon_data_t)];
+    size_t len = 0;
+    while (delta >= 0x80)
+    {
+        record[len++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    record[len++] = delta;
+    memcpy(record + len, frame, sizeof(co2mon_data_t));
+    len += sizeof(co2mon_data_t);
+
+    // Frames arrive about once a second, so each one is written out
+    // right away and survives a crash.
+    if (fwrite(record, len, 1, capture->f) != 1 || fflush(capture->f) != 0)
+    {
+        perror("capture");
+    }
+}
+
+void
+capture_close(struct capture *capture)
+{
+    fclose(capture->f);
+    free(capture);
+}
+
+static struct replay_device *
+replay_device(co2mon_device dev)
+{
+    return (struct replay_device *)dev;
+}
+
+// Reads the next record. Returns 0 at the end of the file.
+static int
+replay_next(struct replay_device *dev)
+{
+    if (dev->have_next)
+    {
+        return 1;
+    }
+
+    uint64_t delta = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        int c = getc(dev->f);
+        if (c == EOF || shift > 63)
+        {
+            return 0;
+        }
+        delta |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            break;
+        }
+    }
+    if (fread(dev->next, sizeof(dev->next), 1, dev->f) != 1)
+    {
+        return 0;
+    }
+    dev->due_us += delta;
+    dev->have_next = 1;
+    return 1;
+}
+
+static void
+replay_close(co2mon_device base)
+{
+    struct replay_device *dev = replay_device(base);
+    double elapsed = (monotonic_us() - dev->start_us) / 1e6;
+    fprintf(stderr, "%s: replayed %lu frames in %.3f s\n", dev->base.path, dev->frames, elapsed);
+    fclose(dev->f);
+    free(dev);
+}
+
+static int
+replay_send_feature_report(co2mon_device dev, const unsigned char *data, size_t length)
+{
+    (void)dev;
+    (void)data;
+    return length;
+}
+
+static int
+replay_read(co2mon_device base, co2mon_data_t data, int timeout_ms)
+{
+    struct replay_device *dev = replay_device(base);
+    if (!replay_next(dev))
+    {
+        fprintf(stderr, "%s: end of capture\n", dev->base.path);
+        return -1;
+    }
+
+    if (!dev->fast)
+    {
+        int64_t wait = dev->start_us + dev->due_us - monotonic_us();
+        if (wait > (int64_t)timeout_ms * 1000)
+        {
+            // Same as a device that did not send anything in time.
+            sleep_us((int64_t)timeout_ms * 1000);
+            return 0;
+        }
+        if (wait > 0)
+        {
+            sleep_us(wait);
+        }
+    }
+
+    memcpy(data, dev->next, sizeof(co2mon_data_t));
+    dev->have_next = 0;
+    dev->frames++;
+    return sizeof(co2mon_data_t);
+}
+
+// A regular file is always readable, so in real time a poller wakes up
+// more often than frames are due.
+static int
+replay_fd(co2mon_device dev)
+{
+    return fileno(replay_device(dev)->f);
+}
+
+static int
+replay_read_available(co2mon_device base, co2mon_data_t *frames, int max)
+{
+    struct replay_device *dev = replay_device(base);
+    int count = 0;
+    while (count < max)
+    {
+        if (!replay_next(dev))
+        {
+            return count ? count : -1;
+        }
+        if (!dev->fast && dev->start_us + dev->due_us > monotonic_us())
+        {
+            break;
+        }
+        memcpy(frames[count++], dev->next, sizeof(co2mon_data_t));
+        dev->have_next = 0;
+        dev->frames++;
+    }
+    return count;
+}
+
+static const struct device_ops replay_ops = {
+    replay_close,
+    replay_send_feature_report,
+    replay_read,
+    replay_fd,
+    replay_read_available,
+};
+
+co2mon_device
+replay_open(const char *path, int fast, int *release_number)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, f) != 1 || memcmp(header, capture_magic, sizeof(capture_magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    struct replay_device *dev = calloc(1, sizeof(*dev));
+    if (!dev)
+    {
+        perror("calloc");
+        fclose(f);
+        return NULL;
+    }
+    dev->base.ops = &replay_ops;
+    dev->f = f;
+    dev->fast = fast;
+    dev->start_us = monotonic_us();
+
+    int release = header[8] | header[9] << 8;
+    *release_number = release ? release : -1;
+    return &dev->base;
+}
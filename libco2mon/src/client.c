@@ -0,0 +1,202 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "co2mon.h"
+
+#define CLIENT_TIMEOUT_MS 5000 /* for a snapshot */
+#define CLIENT_BUFFER_RECORDS 64
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct co2mon_client_ {
+    int fd;
+    size_t len;
+    unsigned char buf[CLIENT_BUFFER_RECORDS * sizeof(struct co2mon_record)];
+};
+
+co2mon_client
+co2mon_client_open(const char *path)
+{
+    if (!path)
+    {
+        path = CO2MON_SOCKET_PATH;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: path is too long\n", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    co2mon_client client = malloc(sizeof(*client));
+    if (!client)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    client->len = 0;
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->fd == -1)
+    {
+        perror("socket");
+        free(client);
+        return NULL;
+    }
+    if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror(path);
+        close(client->fd);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+// Returns 1 if a record was taken, 0 on timeout and -1 on error.
+static int
+next_record(co2mon_client client, struct co2mon_record *record, int timeout_ms)
+{
+    while (client->len < sizeof(*record))
+    {
+        struct pollfd pfd;
+        pfd.fd = client->fd;
+        pfd.events = POLLIN;
+        int r = poll(&pfd, 1, timeout_ms);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0)
+        {
+            return 0;
+        }
+
+        ssize_t n = recv(client->fd, client->buf + client->len, sizeof(client->buf) - client->len, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        client->len += n;
+    }
+
+    memcpy(record, client->buf, sizeof(*record));
+    client->len -= sizeof(*record);
+    memmove(client->buf, client->buf + sizeof(*record), client->len);
+    return 1;
+}
+
+static int
+request(co2mon_client client, uint32_t op, struct co2mon_record *records, int max)
+{
+    struct co2mon_request req;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    if (send(client->fd, &req, sizeof(req), MSG_NOSIGNAL) != (ssize_t)sizeof(req))
+    {
+        return -1;
+    }
+
+    int count = 0;
+    while (1)
+    {
+        struct co2mon_record record;
+        if (next_record(client, &record, CLIENT_TIMEOUT_MS) <= 0)
+        {
+            return -1;
+        }
+        if (record.flags & CO2MON_RECORD_END)
+        {
+            return count;
+        }
+        if (count < max)
+        {
+            records[count++] = record;
+        }
+    }
+}
+
+int
+co2mon_client_snapshot(co2mon_client client, struct co2mon_record *records, int max)
+{
+    return request(client, CO2MON_REQUEST_SNAPSHOT, records, max);
+}
+
+int
+co2mon_client_subscribe(co2mon_client client, struct co2mon_record *records, int max)
+{
+    return request(client, CO2MON_REQUEST_SUBSCRIBE, records, max);
+}
+
+int
+co2mon_client_fd(co2mon_client client)
+{
+    return client->fd;
+}
+
+int
+co2mon_client_read(co2mon_client client, struct co2mon_record *records, int max, int timeout_ms)
+{
+    int count = 0;
+    while (count < max)
+    {
+        // Only the first record is waited for.
+        int r = next_record(client, &records[count], count == 0 ? timeout_ms : 0);
+        if (r < 0)
+        {
+            return count ? count : -1;
+        }
+        if (r == 0)
+        {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+void
+co2mon_client_close(co2mon_client client)
+{
+    close(client->fd);
+    free(client);
+}
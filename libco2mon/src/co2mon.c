@@ -21,143 +21,185 @@
 #include <string.h>
 
 #include "co2mon.h"
+#include "device.h"
 
 static int decode_data = -1;
 
 int
 co2mon_init(int decode)
 {
-    int r = hid_init();
-    if (r < 0)
-    {
-        fprintf(stderr, "hid_init: error\n");
-    }
     decode_data = decode;
-    return r;
+    return backend_init();
 }
 
 void
 co2mon_exit()
 {
-    int r = hid_exit();
-    if (r < 0)
-    {
-        fprintf(stderr, "hid_exit: error\n");
-    }
+    backend_exit();
 }
 
-hid_device *
-co2mon_open_device()
+static co2mon_device
+open_device(const char *path)
 {
-    hid_device *dev = hid_open(0x04d9, 0xa052, NULL);
+    int release_number;
+    co2mon_device dev;
+    if (path && strncmp(path, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) == 0)
+    {
+        dev = replay_open(path + strlen(REPLAY_PREFIX), 0, &release_number);
+    }
+    else if (path && strncmp(path, REPLAY_FAST_PREFIX, strlen(REPLAY_FAST_PREFIX)) == 0)
+    {
+        dev = replay_open(path + strlen(REPLAY_FAST_PREFIX), 1, &release_number);
+    }
+    else
+    {
+        dev = backend_open(path, &release_number);
+    }
     if (!dev)
     {
-        fprintf(stderr, "hid_open: error\n");
+        return NULL;
+    }
+    if (path)
+    {
+        snprintf(dev->path, sizeof(dev->path), "%s", path);
     }
-    else if (decode_data == -1)
+    dev->release_number = release_number;
+
+    /* Each device is auto-detected on its own, so that both releases
+     * can be served by one process. */
+    dev->decode_data = decode_data;
+    if (dev->decode_data == -1)
     {
-        struct hid_device_info *hdi = hid_get_device_info(dev);
-        if (hdi && hdi->release_number >  0x0100) {
-            decode_data = 0;
+        if (release_number > 0x0100) {
+            dev->decode_data = 0;
         } else {
-            decode_data = 1;
+            dev->decode_data = 1;
         }
     }
     return dev;
 }
 
-hid_device *
+co2mon_device
+co2mon_open_device()
+{
+    return open_device(NULL);
+}
+
+co2mon_device
 co2mon_open_device_path(const char *path)
 {
-    hid_device *dev = hid_open_path(path);
-    if (!dev)
-    {
-        fprintf(stderr, "hid_open_path: error\n");
-    }
-    return dev;
+    return open_device(path);
+}
+
+int
+co2mon_enumerate_devices(co2mon_enumerate_cb cb, void *arg)
+{
+    return backend_enumerate(cb, arg);
 }
 
 void
-co2mon_close_device(hid_device *dev)
+co2mon_close_device(co2mon_device dev)
 {
-    hid_close(dev);
+    if (dev->capture)
+    {
+        capture_close(dev->capture);
+    }
+    dev->ops->close(dev);
 }
 
 int
-co2mon_device_path(hid_device *dev, char *str, size_t maxlen)
+co2mon_device_path(co2mon_device dev, char *str, size_t maxlen)
 {
-    str[0] = '\0';
+    if (maxlen == 0)
+    {
+        return 0;
+    }
+    snprintf(str, maxlen, "%s", dev->path);
     return 1;
 }
 
 int
-co2mon_send_magic_table(hid_device *dev, co2mon_data_t magic_table)
+co2mon_send_magic_table(co2mon_device dev, co2mon_data_t magic_table)
 {
-    int r = hid_send_feature_report(dev, magic_table, sizeof(co2mon_data_t));
+    int r = dev->ops->send_feature_report(dev, magic_table, sizeof(co2mon_data_t));
     if (r < 0 || r != sizeof(co2mon_data_t))
     {
-        fprintf(stderr, "hid_send_feature_report: error\n");
+        fprintf(stderr, "co2mon_send_magic_table: error\n");
         return 0;
     }
     return 1;
 }
 
 static void
-swap_char(unsigned char *a, unsigned char *b)
+decode_buf(int decode, co2mon_data_t result, co2mon_data_t buf, co2mon_data_t magic_table)
 {
-    unsigned char tmp = *a;
-    *a = *b;
-    *b = tmp;
-}
-
-static void
-decode_buf(co2mon_data_t result, co2mon_data_t buf, co2mon_data_t magic_table)
-{
-    if (decode_data) {
-        swap_char(&buf[0], &buf[2]);
-        swap_char(&buf[1], &buf[4]);
-        swap_char(&buf[3], &buf[7]);
-        swap_char(&buf[5], &buf[6]);
-
-        for (int i = 0; i < 8; ++i)
-        {
-            buf[i] ^= magic_table[i];
-        }
-
-        unsigned char tmp = (buf[7] << 5);
-        result[7] = (buf[6] << 5) | (buf[7] >> 3);
-        result[6] = (buf[5] << 5) | (buf[6] >> 3);
-        result[5] = (buf[4] << 5) | (buf[5] >> 3);
-        result[4] = (buf[3] << 5) | (buf[4] >> 3);
-        result[3] = (buf[2] << 5) | (buf[3] >> 3);
-        result[2] = (buf[1] << 5) | (buf[2] >> 3);
-        result[1] = (buf[0] << 5) | (buf[1] >> 3);
-        result[0] = tmp | (buf[0] >> 3);
-
-        const unsigned char magic_word[8] = "Htemp99e";
-        for (int i = 0; i < 8; ++i)
-        {
-            result[i] -= (magic_word[i] << 4) | (magic_word[i] >> 4);
-        }
+    if (decode) {
+        co2mon_decode_frames(magic_table, buf, result, 1);
     } else memcpy(result, buf, 8);
 }
 
 int
-co2mon_read_data(hid_device *dev, co2mon_data_t magic_table, co2mon_data_t result)
+co2mon_read_data(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t result)
 {
     co2mon_data_t data = { 0 };
-    int actual_length = hid_read_timeout(dev, data, sizeof(co2mon_data_t), 5000 /* milliseconds */);
+    int actual_length = dev->ops->read(dev, data, 5000 /* milliseconds */);
     if (actual_length < 0)
     {
-        fprintf(stderr, "hid_read_timeout: error\n");
         return actual_length;
     }
+    if (dev->capture && actual_length == sizeof(co2mon_data_t))
+    {
+        capture_frame(dev->capture, data);
+    }
     if (actual_length != sizeof(co2mon_data_t))
     {
-        fprintf(stderr, "hid_read_timeout: transferred %d bytes, expected %lu bytes\n", actual_length, (unsigned long)sizeof(co2mon_data_t));
+        fprintf(stderr, "co2mon_read_data: transferred %d bytes, expected %lu bytes\n", actual_length, (unsigned long)sizeof(co2mon_data_t));
         return 0;
     }
 
-    decode_buf(result, data, magic_table);
+    decode_buf(dev->decode_data, result, data, magic_table);
     return actual_length;
 }
+
+int
+co2mon_device_fd(co2mon_device dev)
+{
+    return dev->ops->fd(dev);
+}
+
+int
+co2mon_read_frames(co2mon_device dev, co2mon_data_t magic_table, co2mon_data_t *frames, int max)
+{
+    if (max <= 0)
+    {
+        return 0;
+    }
+
+    int count = dev->ops->read_available(dev, frames, max);
+    for (int i = 0; dev->capture && i < count; ++i)
+    {
+        capture_frame(dev->capture, frames[i]);
+    }
+    if (count > 0 && dev->decode_data)
+    {
+        co2mon_decode_frames(magic_table, frames[0], frames[0], count);
+    }
+    return count;
+}
+
+int
+co2mon_dispatch_frames(co2mon_device dev, co2mon_data_t magic_table, co2mon_frame_cb cb, void *arg)
+{
+    co2mon_data_t frames[32];
+    int total = 0;
+    int n;
+    while ((n = co2mon_read_frames(dev, magic_table, frames, sizeof(frames) / sizeof(frames[0]))) > 0)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            cb(dev, frames[i], arg);
+        }
+        total += n;
+    }
+    return n < 0 ? -1 : total;
+}
@@ -0,0 +1,227 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "co2mon.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define DECODE_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Descrambling of frames from release 0x0100 devices.
+ *
+ * decode_scalar() is the reference implementation. The vector kernels
+ * treat each frame as a little-endian 64-bit word, in which every step is
+ * a lane-wise operation:
+ *
+ *   - the byte swaps become shifts by whole bytes with masks (or a byte
+ *     shuffle where it is available);
+ *   - result[i] = buf[i - 1] << 5 | buf[i] >> 3 (indices mod 8) is
+ *     (rotl(x, 13) & 0xe0e0...) | ((x >> 3) & 0x1f1f...);
+ *   - the "Htemp99e" word is subtracted byte-wise.
+ *
+ * The kernel is chosen once from the CPU features, or from the
+ * CO2MON_DECODE environment variable (scalar, sse2 or avx2).
+ */
+
+static const unsigned char magic_word[8] = "Htemp99e";
+
+static void
+swap_char(unsigned char *a, unsigned char *b)
+{
+    unsigned char tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void
+decode_scalar(const unsigned char *magic_table, const unsigned char *in, unsigned char *out, size_t count)
+{
+    for (size_t n = 0; n < count; ++n, in += 8, out += 8)
+    {
+        co2mon_data_t buf;
+        memcpy(buf, in, sizeof(buf));
+
+        swap_char(&buf[0], &buf[2]);
+        swap_char(&buf[1], &buf[4]);
+        swap_char(&buf[3], &buf[7]);
+        swap_char(&buf[5], &buf[6]);
+
+        for (int i = 0; i < 8; ++i)
+        {
+            buf[i] ^= magic_table[i];
+        }
+
+        unsigned char tmp = (buf[7] << 5);
+        out[7] = (buf[6] << 5) | (buf[7] >> 3);
+        out[6] = (buf[5] << 5) | (buf[6] >> 3);
+        out[5] = (buf[4] << 5) | (buf[5] >> 3);
+        out[4] = (buf[3] << 5) | (buf[4] >> 3);
+        out[3] = (buf[2] << 5) | (buf[3] >> 3);
+        out[2] = (buf[1] << 5) | (buf[2] >> 3);
+        out[1] = (buf[0] << 5) | (buf[1] >> 3);
+        out[0] = tmp | (buf[0] >> 3);
+
+        for (int i = 0; i < 8; ++i)
+        {
+            out[i] -= (magic_word[i] << 4) | (magic_word[i] >> 4);
+        }
+    }
+}
+
+#ifdef DECODE_X86
+
+static uint64_t
+load64(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint64_t
+subtrahend64()
+{
+    unsigned char s[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        s[i] = (magic_word[i] << 4) | (magic_word[i] >> 4);
+    }
+    return load64(s);
+}
+
+#define BYTE(i) (0xffULL << (8 * (i)))
+
+__attribute__((target("sse2")))
+static void
+decode_sse2(const unsigned char *magic_table, const unsigned char *in, unsigned char *out, size_t count)
+{
+    const __m128i magic = _mm_set1_epi64x(load64(magic_table));
+    const __m128i sub = _mm_set1_epi64x(subtrahend64());
+    const __m128i lo5 = _mm_set1_epi8(0x1f);
+    const __m128i hi3 = _mm_set1_epi8((char)0xe0);
+    // Masks of the destination bytes for each shift of the swaps.
+    const __m128i m8l = _mm_set1_epi64x(BYTE(6));
+    const __m128i m8r = _mm_set1_epi64x(BYTE(5));
+    const __m128i m16l = _mm_set1_epi64x(BYTE(2));
+    const __m128i m16r = _mm_set1_epi64x(BYTE(0));
+    const __m128i m24l = _mm_set1_epi64x(BYTE(4));
+    const __m128i m24r = _mm_set1_epi64x(BYTE(1));
+    const __m128i m32l = _mm_set1_epi64x(BYTE(7));
+    const __m128i m32r = _mm_set1_epi64x(BYTE(3));
+
+    size_t n = 0;
+    for (; n + 2 <= count; n += 2)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + 8 * n));
+
+        __m128i y = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_slli_epi64(x, 8), m8l),
+                             _mm_and_si128(_mm_srli_epi64(x, 8), m8r)),
+                _mm_or_si128(_mm_and_si128(_mm_slli_epi64(x, 16), m16l),
+                             _mm_and_si128(_mm_srli_epi64(x, 16), m16r))),
+            _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_slli_epi64(x, 24), m24l),
+                             _mm_and_si128(_mm_srli_epi64(x, 24), m24r)),
+                _mm_or_si128(_mm_and_si128(_mm_slli_epi64(x, 32), m32l),
+                             _mm_and_si128(_mm_srli_epi64(x, 32), m32r))));
+        y = _mm_xor_si128(y, magic);
+
+        __m128i rot = _mm_or_si128(_mm_slli_epi64(y, 13), _mm_srli_epi64(y, 51));
+        y = _mm_or_si128(_mm_and_si128(rot, hi3),
+                         _mm_and_si128(_mm_srli_epi64(y, 3), lo5));
+        y = _mm_sub_epi8(y, sub);
+
+        _mm_storeu_si128((__m128i *)(out + 8 * n), y);
+    }
+    decode_scalar(magic_table, in + 8 * n, out + 8 * n, count - n);
+}
+
+__attribute__((target("avx2")))
+static void
+decode_avx2(const unsigned char *magic_table, const unsigned char *in, unsigned char *out, size_t count)
+{
+    const __m256i magic = _mm256_set1_epi64x(load64(magic_table));
+    const __m256i sub = _mm256_set1_epi64x(subtrahend64());
+    const __m256i lo5 = _mm256_set1_epi8(0x1f);
+    const __m256i hi3 = _mm256_set1_epi8((char)0xe0);
+    const __m256i swaps = _mm256_setr_epi8(
+        2, 4, 0, 7, 1, 6, 5, 3, 10, 12, 8, 15, 9, 14, 13, 11,
+        2, 4, 0, 7, 1, 6, 5, 3, 10, 12, 8, 15, 9, 14, 13, 11);
+
+    size_t n = 0;
+    for (; n + 4 <= count; n += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(in + 8 * n));
+
+        __m256i y = _mm256_xor_si256(_mm256_shuffle_epi8(x, swaps), magic);
+        __m256i rot = _mm256_or_si256(_mm256_slli_epi64(y, 13), _mm256_srli_epi64(y, 51));
+        y = _mm256_or_si256(_mm256_and_si256(rot, hi3),
+                            _mm256_and_si256(_mm256_srli_epi64(y, 3), lo5));
+        y = _mm256_sub_epi8(y, sub);
+
+        _mm256_storeu_si256((__m256i *)(out + 8 * n), y);
+    }
+    decode_sse2(magic_table, in + 8 * n, out + 8 * n, count - n);
+}
+
+#endif
+
+typedef void (*decode_fn)(const unsigned char *, const unsigned char *, unsigned char *, size_t);
+
+static decode_fn
+select_decoder()
+{
+    const char *forced = getenv("CO2MON_DECODE");
+    if (forced && strcmp(forced, "scalar") == 0)
+    {
+        return decode_scalar;
+    }
+#ifdef DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (!forced || strcmp(forced, "avx2") == 0))
+    {
+        return decode_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return decode_sse2;
+    }
+#endif
+    return decode_scalar;
+}
+
+void
+co2mon_decode_frames(const unsigned char *magic_table, const unsigned char *in, unsigned char *out, size_t count)
+{
+    // Racing threads select the same function, so a relaxed store is enough.
+    static decode_fn decode;
+    decode_fn fn = __atomic_load_n(&decode, __ATOMIC_RELAXED);
+    if (!fn)
+    {
+        fn = select_decoder();
+        __atomic_store_n(&decode, fn, __ATOMIC_RELAXED);
+    }
+    fn(magic_table, in, out, count);
+}
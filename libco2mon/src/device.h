@@ -0,0 +1,89 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CO2MON_DEVICE_H_INCLUDED_
+#define CO2MON_DEVICE_H_INCLUDED_
+
+#include "co2mon.h"
+
+#define CO2MON_VENDOR_ID 0x04d9
+#define CO2MON_PRODUCT_ID 0xa052
+
+#define DEVICE_PATH_MAX 256
+
+struct device_ops {
+    void (*close)(co2mon_device dev);
+    int (*send_feature_report)(co2mon_device dev, const unsigned char *data, size_t length);
+    /* Reads one raw frame. Returns its length, 0 on timeout or a negative
+     * value on error. */
+    int (*read)(co2mon_device dev, co2mon_data_t data, int timeout_ms);
+    int (*fd)(co2mon_device dev);
+    /* Reads the available raw frames without waiting. Returns their number
+     * or -1 on error. */
+    int (*read_available)(co2mon_device dev, co2mon_data_t *frames, int max);
+};
+
+struct capture;
+
+/* Part of the device handle shared by all backends. Each backend embeds it
+ * as the first member of its own structure. */
+struct co2mon_device_ {
+    const struct device_ops *ops;
+    int decode_data;
+    int release_number;
+    struct capture *capture;
+    char path[DEVICE_PATH_MAX];
+};
+
+/*
+ * Implemented by the backend selected with CO2MON_BACKEND.
+ */
+
+extern int
+backend_init();
+
+extern int
+backend_exit();
+
+/* Opens the device at path, or the first matching device if path is NULL,
+ * and fills in its path and operations. The release number (bcdDevice) is
+ * set to -1 if it is not known. */
+extern co2mon_device
+backend_open(const char *path, int *release_number);
+
+extern int
+backend_enumerate(co2mon_enumerate_cb cb, void *arg);
+
+/*
+ * Capture files (capture.c).
+ */
+
+#define REPLAY_PREFIX "replay:"
+#define REPLAY_FAST_PREFIX "replay-fast:"
+
+/* Opens a capture file as a device that plays it back in real time, or as
+ * fast as it is read if fast is set. */
+extern co2mon_device
+replay_open(const char *path, int fast, int *release_number);
+
+extern void
+capture_frame(struct capture *capture, const co2mon_data_t frame);
+
+extern void
+capture_close(struct capture *capture);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef CO2MON_BACKEND_HIDAPI
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hidapi.h>
+
+#include "device.h"
+
+#define READER_TIMEOUT_MS 250 /* how long closing the device may wait for the reader thread */
+
+struct hidapi_device {
+    struct co2mon_device_ base;
+    hid_device *hid;
+
+    /* hidapi has no pollable descriptor, so hidapi_fd() starts a thread
+     * that moves raw frames from the device into a pipe. */
+    int reader_started;
+    int stop;
+    pthread_t reader;
+    int pipe_fds[2];
+};
+
+static struct hidapi_device *
+hidapi_device(co2mon_device dev)
+{
+    return (struct hidapi_device *)dev;
+}
+
+static const struct device_ops hidapi_ops;
+
+int
+backend_init()
+{
+    int r = hid_init();
+    if (r < 0)
+    {
+        fprintf(stderr, "hid_init: error\n");
+    }
+    return r;
+}
+
+int
+backend_exit()
+{
+    int r = hid_exit();
+    if (r < 0)
+    {
+        fprintf(stderr, "hid_exit: error\n");
+    }
+    return r;
+}
+
+co2mon_device
+backend_open(const char *path, int *release_number)
+{
+    hid_device *hid;
+    if (path)
+    {
+        hid = hid_open_path(path);
+        if (!hid)
+        {
+            fprintf(stderr, "hid_open_path: error\n");
+            return NULL;
+        }
+    }
+    else
+    {
+        hid = hid_open(CO2MON_VENDOR_ID, CO2MON_PRODUCT_ID, NULL);
+        if (!hid)
+        {
+            fprintf(stderr, "hid_open: error\n");
+            return NULL;
+        }
+    }
+
+    struct hidapi_device *dev = calloc(1, sizeof(*dev));
+    if (!dev)
+    {
+        perror("calloc");
+        hid_close(hid);
+        return NULL;
+    }
+    dev->hid = hid;
+    dev->base.ops = &hidapi_ops;
+
+    struct hid_device_info *hdi = hid_get_device_info(hid);
+    *release_number = hdi ? hdi->release_number : -1;
+    if (!path && hdi)
+    {
+        path = hdi->path;
+    }
+    if (path)
+    {
+        snprintf(dev->base.path, sizeof(dev->base.path), "%s", path);
+    }
+    return &dev->base;
+}
+
+static void
+hidapi_close(co2mon_device base)
+{
+    struct hidapi_device *dev = hidapi_device(base);
+    if (dev->reader_started)
+    {
+        __atomic_store_n(&dev->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(dev->reader, NULL);
+        close(dev->pipe_fds[0]);
+    }
+    hid_close(dev->hid);
+    free(dev);
+}
+
+int
+backend_enumerate(co2mon_enumerate_cb cb, void *arg)
+{
+    struct hid_device_info *devs = hid_enumerate(CO2MON_VENDOR_ID, CO2MON_PRODUCT_ID);
+    int count = 0;
+    for (struct hid_device_info *cur = devs; cur; cur = cur->next)
+    {
+        if (cur->path)
+        {
+            cb(cur->path, arg);
+            count++;
+        }
+    }
+    hid_free_enumeration(devs);
+    return count;
+}
+
+static int
+hidapi_send_feature_report(co2mon_device dev, const unsigned char *data, size_t length)
+{
+    int r = hid_send_feature_report(hidapi_device(dev)->hid, data, length);
+    if (r < 0)
+    {
+        fprintf(stderr, "hid_send_feature_report: error\n");
+    }
+    return r;
+}
+
+static int
+hidapi_read(co2mon_device dev, co2mon_data_t data, int timeout_ms)
+{
+    int r = hid_read_timeout(hidapi_device(dev)->hid, data, sizeof(co2mon_data_t), timeout_ms);
+    if (r < 0)
+    {
+        fprintf(stderr, "hid_read_timeout: error\n");
+    }
+    return r;
+}
+
+static void *
+reader_thread(void *arg)
+{
+    struct hidapi_device *dev = arg;
+    co2mon_data_t data;
+
+    while (!__atomic_load_n(&dev->stop, __ATOMIC_RELAXED))
+    {
+        int actual_length = hidapi_read(&dev->base, data, READER_TIMEOUT_MS);
+        if (actual_length < 0)
+        {
+            break;
+        }
+        if (actual_length != sizeof(co2mon_data_t))
+        {
+            continue;
+        }
+        // Frames are smaller than PIPE_BUF, so they are never split. If
+        // nobody drains the pipe, new frames are dropped.
+        if (write(dev->pipe_fds[1], data, sizeof(data)) < 0 && errno != EAGAIN)
+        {
+            perror("write");
+            break;
+        }
+    }
+
+    // EOF on the pipe tells the reading side that the device is gone.
+    close(dev->pipe_fds[1]);
+    return NULL;
+}
+
+static int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static int
+hidapi_fd(co2mon_device base)
+{
+    struct hidapi_device *dev = hidapi_device(base);
+    if (dev->reader_started)
+    {
+        return dev->pipe_fds[0];
+    }
+
+    if (pipe(dev->pipe_fds) != 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+    if (!set_nonblocking(dev->pipe_fds[0]) || !set_nonblocking(dev->pipe_fds[1]) ||
+        fcntl(dev->pipe_fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(dev->pipe_fds[1], F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl");
+        close(dev->pipe_fds[0]);
+        close(dev->pipe_fds[1]);
+        return -1;
+    }
+
+    if (pthread_create(&dev->reader, NULL, reader_thread, dev) != 0)
+    {
+        fprintf(stderr, "pthread_create: error\n");
+        close(dev->pipe_fds[0]);
+        close(dev->pipe_fds[1]);
+        return -1;
+    }
+    dev->reader_started = 1;
+    return dev->pipe_fds[0];
+}
+
+static int
+hidapi_read_available(co2mon_device dev, co2mon_data_t *frames, int max)
+{
+    int fd = hidapi_fd(dev);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = read(fd, frames, (size_t)max * sizeof(co2mon_data_t));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        perror("read");
+        return -1;
+    }
+    if (n == 0)
+    {
+        return -1;
+    }
+    return n / sizeof(co2mon_data_t);
+}
+
+static const struct device_ops hidapi_ops = {
+    hidapi_close,
+    hidapi_send_feature_report,
+    hidapi_read,
+    hidapi_fd,
+    hidapi_read_available,
+};
+
+#endif
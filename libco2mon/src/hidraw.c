@@ -0,0 +1,320 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef CO2MON_BACKEND_HIDRAW
+
+#define _XOPEN_SOURCE 700 /* realpath */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "device.h"
+
+/*
+ * Linux hidraw backend: the device node is used directly, without hidapi,
+ * libusb and their reader thread. Devices are found and identified through
+ * sysfs.
+ */
+
+#define SYSFS_HIDRAW "/sys/class/hidraw"
+
+struct hidraw_device {
+    struct co2mon_device_ base;
+    int fd;
+};
+
+static struct hidraw_device *
+hidraw_device(co2mon_device dev)
+{
+    return (struct hidraw_device *)dev;
+}
+
+static const struct device_ops hidraw_ops;
+
+int
+backend_init()
+{
+    return 0;
+}
+
+int
+backend_exit()
+{
+    return 0;
+}
+
+// Checks HID_ID=<bus>:<vendor>:<product> of /sys/class/hidraw/<name>.
+static int
+matches(const char *name)
+{
+    char filename[DEVICE_PATH_MAX];
+    snprintf(filename, sizeof(filename), SYSFS_HIDRAW "/%s/device/uevent", name);
+
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        return 0;
+    }
+
+    int result = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned int bus, vendor, product;
+        if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+        {
+            result = vendor == CO2MON_VENDOR_ID && product == CO2MON_PRODUCT_ID;
+            break;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+// The hidraw node belongs to a HID device, whose parent is the USB
+// interface, whose parent is the USB device with bcdDevice.
+static int
+release_number(const char *name)
+{
+    char filename[DEVICE_PATH_MAX];
+    snprintf(filename, sizeof(filename), SYSFS_HIDRAW "/%s/device", name);
+
+    char *hid = realpath(filename, NULL);
+    if (!hid)
+    {
+        return -1;
+    }
+
+    int result = -1;
+    char *slash = strrchr(hid, '/');
+    if (slash)
+    {
+        *slash = '\0';
+        slash = strrchr(hid, '/');
+    }
+    if (slash)
+    {
+        *slash = '\0';
+        snprintf(filename, sizeof(filename), "%s/bcdDevice", hid);
+        FILE *f = fopen(filename, "r");
+        if (f)
+        {
+            unsigned int bcd;
+            if (fscanf(f, "%x", &bcd) == 1)
+            {
+                result = bcd;
+            }
+            fclose(f);
+        }
+    }
+    free(hid);
+    return result;
+}
+
+int
+backend_enumerate(co2mon_enumerate_cb cb, void *arg)
+{
+    DIR *dir = opendir(SYSFS_HIDRAW);
+    if (!dir)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "hidraw", 6) == 0 && matches(entry->d_name))
+        {
+            char path[sizeof("/dev/") + sizeof(entry->d_name)];
+            snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+            cb(path, arg);
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+static void
+remember_first(const char *path, void *arg)
+{
+    char *first = arg;
+    if (!first[0])
+    {
+        snprintf(first, DEVICE_PATH_MAX, "%s", path);
+    }
+}
+
+co2mon_device
+backend_open(const char *path, int *release)
+{
+    char first[DEVICE_PATH_MAX] = "";
+    if (!path)
+    {
+        backend_enumerate(remember_first, first);
+        if (!first[0])
+        {
+            fprintf(stderr, "hidraw: no matching device\n");
+            return NULL;
+        }
+        path = first;
+    }
+
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    struct hidraw_device *dev = calloc(1, sizeof(*dev));
+    if (!dev)
+    {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+    dev->fd = fd;
+    dev->base.ops = &hidraw_ops;
+    snprintf(dev->base.path, sizeof(dev->base.path), "%s", path);
+
+    // The path may be a symlink created by udev.
+    *release = -1;
+    char *node = realpath(path, NULL);
+    if (node)
+    {
+        const char *name = strrchr(node, '/');
+        *release = release_number(name ? name + 1 : node);
+        free(node);
+    }
+    return &dev->base;
+}
+
+static void
+hidraw_close(co2mon_device dev)
+{
+    close(hidraw_device(dev)->fd);
+    free(dev);
+}
+
+static int
+hidraw_send_feature_report(co2mon_device dev, const unsigned char *data, size_t length)
+{
+    // Same convention as hidapi: the first byte is the report number.
+    int r = ioctl(hidraw_device(dev)->fd, HIDIOCSFEATURE(length), data);
+    if (r < 0)
+    {
+        perror("HIDIOCSFEATURE");
+    }
+    return r;
+}
+
+static int
+hidraw_read(co2mon_device dev, co2mon_data_t data, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = hidraw_device(dev)->fd;
+    pfd.events = POLLIN;
+
+    int r;
+    do
+    {
+        r = poll(&pfd, 1, timeout_ms);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+    {
+        perror("poll");
+        return -1;
+    }
+    if (r == 0)
+    {
+        return 0;
+    }
+
+    ssize_t n = read(pfd.fd, data, sizeof(co2mon_data_t));
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return 0;
+        }
+        perror("read");
+        return -1;
+    }
+    return n;
+}
+
+static int
+hidraw_fd(co2mon_device dev)
+{
+    return hidraw_device(dev)->fd;
+}
+
+static int
+hidraw_read_available(co2mon_device dev, co2mon_data_t *frames, int max)
+{
+    int count = 0;
+    while (count < max)
+    {
+        // hidraw returns one report per read().
+        ssize_t n = read(hidraw_device(dev)->fd, frames[count], sizeof(co2mon_data_t));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            perror("read");
+            return -1;
+        }
+        if (n == 0)
+        {
+            return -1;
+        }
+        if (n == sizeof(co2mon_data_t))
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+static const struct device_ops hidraw_ops = {
+    hidraw_close,
+    hidraw_send_feature_report,
+    hidraw_read,
+    hidraw_fd,
+    hidraw_read_available,
+};
+
+#endif
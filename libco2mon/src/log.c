@@ -0,0 +1,557 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* pread, ftruncate, fseeko */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "co2mon.h"
+
+/*
+ * File layout:
+ *
+ *   "CO2LOG\0\1"
+ *   block*
+ *
+ * Block layout (integers are little-endian):
+ *
+ *   "CO2B" | uint32 payload length | uint32 record count | uint32 CRC-32 of payload
+ *   payload
+ *
+ * Payload record, varints are LEB128 and signed ones are zigzag encoded:
+ *
+ *   time     first record: varint milliseconds since the Epoch,
+ *            second record: signed varint delta,
+ *            others: signed varint delta of deltas
+ *   code     1 byte
+ *   value    varint value XOR previous value of the same code in the block
+ */
+
+static const unsigned char file_magic[8] = { 'C', 'O', '2', 'L', 'O', 'G', 0, 1 };
+static const unsigned char block_magic[4] = { 'C', 'O', '2', 'B' };
+
+#define BLOCK_HEADER 16
+#define RECORD_MAX 14 /* 10 bytes of time, 1 of code, 3 of value */
+
+struct block_state {
+    unsigned int count;
+    int64_t prev_time;
+    int64_t prev_delta;
+    uint16_t prev_value[256];
+};
+
+struct co2mon_log_ {
+    int fd;
+    int flush_interval_ms;
+    off_t end; /* where the next block is written */
+    int64_t block_start;
+    struct block_state state;
+    size_t len;
+    unsigned char block[BLOCK_HEADER + CO2MON_LOG_BLOCK_MAX];
+};
+
+struct co2mon_log_reader_ {
+    FILE *f;
+    struct block_state state;
+    unsigned int remaining;
+    size_t pos;
+    size_t len;
+    unsigned char payload[CO2MON_LOG_BLOCK_MAX];
+};
+
+static uint32_t
+crc32(const unsigned char *data, size_t len)
+{
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < len; ++i)
+    {
+        crc ^= data[i];
+        for (int k = 0; k < 8; ++k)
+        {
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static size_t
+put_varint(unsigned char *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+static int
+get_varint(const unsigned char *p, size_t len, size_t *pos, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7)
+    {
+        unsigned char c = p[(*pos)++];
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t
+zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Returns 1 if the block at `offset` is complete and intact.
+static int
+check_block(int fd, off_t offset, off_t size, off_t *next)
+{
+    unsigned char header[BLOCK_HEADER];
+    unsigned char payload[CO2MON_LOG_BLOCK_MAX];
+
+    if (size - offset < BLOCK_HEADER ||
+        pread(fd, header, BLOCK_HEADER, offset) != BLOCK_HEADER ||
+        memcmp(header, block_magic, sizeof(block_magic)) != 0)
+    {
+        return 0;
+    }
+    uint32_t len = get_u32(header + 4);
+    if (len > CO2MON_LOG_BLOCK_MAX || size - offset - BLOCK_HEADER < (off_t)len ||
+        pread(fd, payload, len, offset + BLOCK_HEADER) != (ssize_t)len ||
+        crc32(payload, len) != get_u32(header + 12))
+    {
+        return 0;
+    }
+    *next = offset + BLOCK_HEADER + len;
+    return 1;
+}
+
+// Returns the offset of the first intact block after `offset`, or -1.
+static off_t
+find_block(int fd, off_t offset, off_t size)
+{
+    unsigned char buf[4096];
+    while (size - offset >= BLOCK_HEADER)
+    {
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+        if (n < (ssize_t)sizeof(block_magic))
+        {
+            return -1;
+        }
+        for (ssize_t i = 0; i + (ssize_t)sizeof(block_magic) <= n; ++i)
+        {
+            off_t next;
+            if (memcmp(buf + i, block_magic, sizeof(block_magic)) == 0 &&
+                check_block(fd, offset + i, size, &next))
+            {
+                return offset + i;
+            }
+        }
+        offset += n - (sizeof(block_magic) - 1);
+    }
+    return -1;
+}
+
+static int
+write_all(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+co2mon_log
+co2mon_log_open(const char *path, int flush_interval_ms)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size == 0)
+    {
+        if (!write_all(fd, file_magic, sizeof(file_magic)))
+        {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+    }
+    else
+    {
+        unsigned char magic[sizeof(file_magic)];
+        if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+            memcmp(magic, file_magic, sizeof(magic)) != 0)
+        {
+            fprintf(stderr, "%s: not a co2mon log\n", path);
+            close(fd);
+            return NULL;
+        }
+
+        // Blocks are written with a single write(), so a crash can only
+        // tear the last one. A corrupt block followed by intact ones is
+        // skipped, the reader does the same.
+        off_t end = sizeof(file_magic);
+        while (end < st.st_size)
+        {
+            if (check_block(fd, end, st.st_size, &end))
+            {
+                continue;
+            }
+            off_t next = find_block(fd, end + 1, st.st_size);
+            if (next == -1)
+            {
+                break;
+            }
+            fprintf(stderr, "%s: skipping %lld corrupt bytes at offset %lld\n",
+                path, (long long)(next - end), (long long)end);
+            end = next;
+        }
+        if (end != st.st_size)
+        {
+            fprintf(stderr, "%s: dropping %lld bytes of a torn block\n",
+                path, (long long)(st.st_size - end));
+            if (ftruncate(fd, end) != 0)
+            {
+                perror(path);
+                close(fd);
+                return NULL;
+            }
+        }
+        if (lseek(fd, end, SEEK_SET) == -1)
+        {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    co2mon_log log = calloc(1, sizeof(*log));
+    if (!log)
+    {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+    log->fd = fd;
+    log->end = lseek(fd, 0, SEEK_CUR);
+    log->flush_interval_ms = flush_interval_ms;
+    return log;
+}
+
+int
+co2mon_log_flush(co2mon_log log)
+{
+    if (log->state.count == 0)
+    {
+        return 1;
+    }
+
+    memcpy(log->block, block_magic, sizeof(block_magic));
+    put_u32(log->block + 4, log->len);
+    put_u32(log->block + 8, log->state.count);
+    put_u32(log->block + 12, crc32(log->block + BLOCK_HEADER, log->len));
+
+    int r = write_all(log->fd, log->block, BLOCK_HEADER + log->len);
+    if (r)
+    {
+        log->end += BLOCK_HEADER + log->len;
+    }
+    else
+    {
+        perror("co2mon_log_flush");
+        // Don't leave a partial block for the next one to be appended to.
+        if (ftruncate(log->fd, log->end) != 0 || lseek(log->fd, log->end, SEEK_SET) == -1)
+        {
+            perror("co2mon_log_flush");
+        }
+    }
+
+    memset(&log->state, 0, sizeof(log->state));
+    log->len = 0;
+    return r;
+}
+
+int
+co2mon_log_append(co2mon_log log, const struct co2mon_log_record *record)
+{
+    if (log->state.count > 0 &&
+        (log->len + RECORD_MAX > CO2MON_LOG_BLOCK_MAX ||
+         record->time - log->block_start >= log->flush_interval_ms))
+    {
+        if (!co2mon_log_flush(log))
+        {
+            return 0;
+        }
+    }
+
+    struct block_state *state = &log->state;
+    unsigned char *p = log->block + BLOCK_HEADER + log->len;
+    size_t n;
+
+    if (state->count == 0)
+    {
+        log->block_start = record->time;
+        n = put_varint(p, record->time);
+    }
+    else
+    {
+        int64_t delta = record->time - state->prev_time;
+        n = put_varint(p, zigzag(state->count == 1 ? delta : delta - state->prev_delta));
+        state->prev_delta = delta;
+    }
+    state->prev_time = record->time;
+
+    p[n++] = record->code;
+    n += put_varint(p + n, record->value ^ state->prev_value[record->code]);
+    state->prev_value[record->code] = record->value;
+
+    state->count++;
+    log->len += n;
+    return 1;
+}
+
+void
+co2mon_log_close(co2mon_log log)
+{
+    co2mon_log_flush(log);
+    close(log->fd);
+    free(log);
+}
+
+co2mon_log_reader
+co2mon_log_reader_open(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    unsigned char magic[sizeof(file_magic)];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, file_magic, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a co2mon log\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    co2mon_log_reader reader = calloc(1, sizeof(*reader));
+    if (!reader)
+    {
+        perror("calloc");
+        fclose(f);
+        return NULL;
+    }
+    reader->f = f;
+    return reader;
+}
+
+static int
+read_block_at(co2mon_log_reader reader)
+{
+    unsigned char header[BLOCK_HEADER];
+    size_t n = fread(header, 1, BLOCK_HEADER, reader->f);
+    if (n == 0 && feof(reader->f))
+    {
+        return 0;
+    }
+    if (n != BLOCK_HEADER || memcmp(header, block_magic, sizeof(block_magic)) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t len = get_u32(header + 4);
+    if (len > CO2MON_LOG_BLOCK_MAX ||
+        fread(reader->payload, 1, len, reader->f) != len ||
+        crc32(reader->payload, len) != get_u32(header + 12))
+    {
+        return -1;
+    }
+
+    memset(&reader->state, 0, sizeof(reader->state));
+    reader->remaining = get_u32(header + 8);
+    reader->pos = 0;
+    reader->len = len;
+    return 1;
+}
+
+// Moves to the next block magic after `offset`. Returns 0 if there is none.
+static int
+seek_magic(FILE *f, off_t offset)
+{
+    if (fseeko(f, offset, SEEK_SET) != 0)
+    {
+        return 0;
+    }
+    size_t matched = 0;
+    int c;
+    while ((c = getc(f)) != EOF)
+    {
+        if (c == block_magic[matched])
+        {
+            matched++;
+        }
+        else
+        {
+            matched = c == block_magic[0];
+        }
+        if (matched == sizeof(block_magic))
+        {
+            return fseeko(f, -(off_t)sizeof(block_magic), SEEK_CUR) == 0;
+        }
+    }
+    return 0;
+}
+
+static int
+read_block(co2mon_log_reader reader)
+{
+    off_t offset = ftello(reader->f);
+    int r;
+    while ((r = read_block_at(reader)) < 0)
+    {
+        // Skip a corrupt block in the middle of the log, as
+        // co2mon_log_open() does. A torn block at the end stays an error.
+        if (offset == -1 || !seek_magic(reader->f, offset + 1))
+        {
+            return -1;
+        }
+        offset = ftello(reader->f);
+    }
+    return r;
+}
+
+int
+co2mon_log_read(co2mon_log_reader reader, struct co2mon_log_record *record)
+{
+    while (reader->remaining == 0)
+    {
+        int r = read_block(reader);
+        if (r <= 0)
+        {
+            return r;
+        }
+    }
+
+    struct block_state *state = &reader->state;
+    uint64_t v;
+
+    if (!get_varint(reader->payload, reader->len, &reader->pos, &v))
+    {
+        return -1;
+    }
+    if (state->count == 0)
+    {
+        record->time = v;
+    }
+    else
+    {
+        int64_t delta = unzigzag(v);
+        if (state->count > 1)
+        {
+            delta += state->prev_delta;
+        }
+        record->time = state->prev_time + delta;
+        state->prev_delta = delta;
+    }
+    state->prev_time = record->time;
+
+    if (reader->pos >= reader->len)
+    {
+        return -1;
+    }
+    record->code = reader->payload[reader->pos++];
+
+    if (!get_varint(reader->payload, reader->len, &reader->pos, &v) || v > 0xffff)
+    {
+        return -1;
+    }
+    record->value = v ^ state->prev_value[record->code];
+    state->prev_value[record->code] = record->value;
+
+    state->count++;
+    reader->remaining--;
+    return 1;
+}
+
+void
+co2mon_log_reader_close(co2mon_log_reader reader)
+{
+    fclose(reader->f);
+    free(reader);
+}
@@ -0,0 +1,228 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700 /* ftruncate */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "co2mon.h"
+
+#define SHM_VERSION 1
+#define READ_ATTEMPTS 1000
+
+static const char shm_magic[8] = { 'C', 'O', '2', 'S', 'H', 'M', 0, 0 };
+
+struct shm_device {
+    uint32_t seq; /* odd while the writer updates the snapshot */
+    uint32_t reserved;
+    struct co2mon_snapshot snapshot;
+};
+
+struct shm_layout {
+    char magic[8];
+    uint32_t version;
+    uint32_t devices_count;
+    struct shm_device devices[CO2MON_SHM_DEVICES];
+};
+
+struct co2mon_shm_ {
+    struct shm_layout *layout;
+    int writable;
+};
+
+static co2mon_shm
+shm_map(const char *path, int writable)
+{
+    int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    if (writable)
+    {
+        if (ftruncate(fd, sizeof(struct shm_layout)) != 0)
+        {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct shm_layout))
+        {
+            fprintf(stderr, "%s: not a co2mon shared memory segment\n", path);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void *addr = mmap(NULL, sizeof(struct shm_layout),
+        writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    co2mon_shm shm = calloc(1, sizeof(*shm));
+    if (!shm)
+    {
+        perror("calloc");
+        munmap(addr, sizeof(struct shm_layout));
+        return NULL;
+    }
+    shm->layout = addr;
+    shm->writable = writable;
+    return shm;
+}
+
+co2mon_shm
+co2mon_shm_create(const char *path)
+{
+    co2mon_shm shm = shm_map(path, 1);
+    if (!shm)
+    {
+        return NULL;
+    }
+
+    // The segment is reset in place, so readers that still have it mapped
+    // see the devices disappear instead of keeping stale values.
+    struct shm_layout *layout = shm->layout;
+    __atomic_store_n(&layout->devices_count, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < CO2MON_SHM_DEVICES; ++i)
+    {
+        struct shm_device *device = &layout->devices[i];
+        // Odd while the snapshot is cleared, as in co2mon_shm_write_begin().
+        uint32_t seq = device->seq | 1;
+        __atomic_store_n(&device->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memset(&device->snapshot, 0, sizeof(device->snapshot));
+        __atomic_store_n(&device->seq, seq + 1, __ATOMIC_RELEASE);
+    }
+    layout->version = SHM_VERSION;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(layout->magic, shm_magic, sizeof(shm_magic));
+    return shm;
+}
+
+int
+co2mon_shm_add_device(co2mon_shm shm, const char *name)
+{
+    struct shm_layout *layout = shm->layout;
+    uint32_t index = layout->devices_count;
+    if (index >= CO2MON_SHM_DEVICES)
+    {
+        return -1;
+    }
+
+    struct co2mon_snapshot *snapshot = co2mon_shm_write_begin(shm, index);
+    memset(snapshot, 0, sizeof(*snapshot));
+    snprintf(snapshot->name, sizeof(snapshot->name), "%s", name);
+    co2mon_shm_write_end(shm, index);
+    __atomic_store_n(&layout->devices_count, index + 1, __ATOMIC_RELEASE);
+    return index;
+}
+
+struct co2mon_snapshot *
+co2mon_shm_write_begin(co2mon_shm shm, int index)
+{
+    struct shm_device *device = &shm->layout->devices[index];
+    __atomic_store_n(&device->seq, device->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return &device->snapshot;
+}
+
+void
+co2mon_shm_write_end(co2mon_shm shm, int index)
+{
+    struct shm_device *device = &shm->layout->devices[index];
+    __atomic_store_n(&device->seq, device->seq + 1, __ATOMIC_RELEASE);
+}
+
+co2mon_shm
+co2mon_shm_open(const char *path)
+{
+    co2mon_shm shm = shm_map(path, 0);
+    if (!shm)
+    {
+        return NULL;
+    }
+
+    if (memcmp(shm->layout->magic, shm_magic, sizeof(shm_magic)) != 0 ||
+        shm->layout->version != SHM_VERSION)
+    {
+        fprintf(stderr, "%s: not a co2mon shared memory segment\n", path);
+        co2mon_shm_close(shm);
+        return NULL;
+    }
+    return shm;
+}
+
+int
+co2mon_shm_devices(co2mon_shm shm)
+{
+    uint32_t count = __atomic_load_n(&shm->layout->devices_count, __ATOMIC_ACQUIRE);
+    return count > CO2MON_SHM_DEVICES ? CO2MON_SHM_DEVICES : (int)count;
+}
+
+int
+co2mon_shm_read(co2mon_shm shm, int index, struct co2mon_snapshot *snapshot)
+{
+    if (index < 0 || index >= co2mon_shm_devices(shm))
+    {
+        return 0;
+    }
+
+    const struct shm_device *device = &shm->layout->devices[index];
+    for (int attempt = 0; attempt < READ_ATTEMPTS; ++attempt)
+    {
+        uint32_t seq0 = __atomic_load_n(&device->seq, __ATOMIC_ACQUIRE);
+        if (seq0 & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(snapshot, &device->snapshot, sizeof(*snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&device->seq, __ATOMIC_RELAXED) == seq0)
+        {
+            snapshot->name[sizeof(snapshot->name) - 1] = '\0';
+            return 1;
+        }
+    }
+    return -1;
+}
+
+void
+co2mon_shm_close(co2mon_shm shm)
+{
+    munmap(shm->layout, sizeof(struct shm_layout));
+    free(shm);
+}
@@ -0,0 +1,116 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+/* The kernels are static, so the decoder is built into the test. */
+#include "../../libco2mon/src/decode.c"
+
+/* Every kernel the CPU supports is checked against decode_scalar() on
+ * random frames, for every count up to FRAMES_MAX so that all the tail
+ * lengths are covered, out of place and in place. */
+
+#define FRAMES_MAX 37
+#define ROUNDS 200
+
+struct kernel {
+    const char *name;
+    decode_fn fn;
+};
+
+static int
+check(const struct kernel *kernel, const unsigned char *magic_table, const unsigned char *in, size_t count)
+{
+    unsigned char expected[8 * FRAMES_MAX];
+    unsigned char out[8 * FRAMES_MAX + 8];
+    unsigned char inplace[8 * FRAMES_MAX];
+
+    decode_scalar(magic_table, in, expected, count);
+
+    // The byte after the output must not be touched.
+    memset(out, 0xa5, sizeof(out));
+    kernel->fn(magic_table, in, out, count);
+    if (memcmp(out, expected, 8 * count) != 0 || out[8 * count] != 0xa5)
+    {
+        fprintf(stderr, "%s: %zu frames decoded differently\n", kernel->name, count);
+        return 0;
+    }
+
+    memcpy(inplace, in, 8 * count);
+    kernel->fn(magic_table, inplace, inplace, count);
+    if (memcmp(inplace, expected, 8 * count) != 0)
+    {
+        fprintf(stderr, "%s: %zu frames decoded differently in place\n", kernel->name, count);
+        return 0;
+    }
+    return 1;
+}
+
+int
+main()
+{
+    struct kernel kernels[4];
+    int kernels_count = 0;
+
+    kernels[kernels_count++] = (struct kernel){ "scalar", decode_scalar };
+#ifdef DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        kernels[kernels_count++] = (struct kernel){ "sse2", decode_sse2 };
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels[kernels_count++] = (struct kernel){ "avx2", decode_avx2 };
+    }
+#endif
+    kernels[kernels_count++] = (struct kernel){ "co2mon_decode_frames", co2mon_decode_frames };
+
+    srand(1);
+    int ok = 1;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        unsigned char magic_table[8];
+        unsigned char in[8 * FRAMES_MAX];
+        for (size_t i = 0; i < sizeof(magic_table); ++i)
+        {
+            magic_table[i] = rand();
+        }
+        for (size_t i = 0; i < sizeof(in); ++i)
+        {
+            in[i] = rand();
+        }
+
+        for (int k = 0; k < kernels_count; ++k)
+        {
+            for (size_t count = 0; count <= FRAMES_MAX; ++count)
+            {
+                ok &= check(&kernels[k], magic_table, in, count);
+            }
+        }
+    }
+
+    for (int k = 0; k < kernels_count; ++k)
+    {
+        printf("%s\n", kernels[k].name);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The event parsing is static, so hotplug.c is built into the test. */
+#include "../../co2mond/src/hotplug.c"
+
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <err.h>
+
+/* Events are fed to read_events() through a datagram socketpair, in the
+ * formats of the kernel and of udevd. */
+
+#define HIDRAW_PATH "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1:1.0/0003:04D9:A052.0001/hidraw/hidraw0"
+#define OTHER_PATH "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/0003:046D:C52B.0002/hidraw/hidraw1"
+
+static int fds[2];
+
+// Properties are given as one string, with '|' for the NUL separators.
+static void
+send_kernel(const char *action, const char *props)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    int n = snprintf(buf, sizeof(buf), "%s@/devices/test|ACTION=%s|%s|", action, action, props);
+    for (int i = 0; i < n; ++i)
+    {
+        if (buf[i] == '|')
+        {
+            buf[i] = '\0';
+        }
+    }
+    if (send(fds[1], buf, n, 0) != n)
+    {
+        err(1, "send");
+    }
+}
+
+static void
+send_udev(const char *action, const char *props, unsigned int properties_off)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    struct udev_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.prefix, "libudev", 8);
+    header.magic = htonl(0xfeedcafe);
+    header.header_size = sizeof(header);
+    header.properties_off = properties_off;
+
+    char *p = buf + sizeof(header);
+    int n = snprintf(p, sizeof(buf) - sizeof(header), "ACTION=%s|%s|", action, props);
+    for (int i = 0; i < n; ++i)
+    {
+        if (p[i] == '|')
+        {
+            p[i] = '\0';
+        }
+    }
+    header.properties_len = n;
+    memcpy(buf, &header, sizeof(header));
+    if (send(fds[1], buf, sizeof(header) + n, 0) != (ssize_t)(sizeof(header) + n))
+    {
+        err(1, "send");
+    }
+}
+
+static int failures;
+
+static void
+expect(const char *what, int expected)
+{
+    int r = read_events(fds[0]);
+    if (r != expected)
+    {
+        fprintf(stderr, "%s: read_events returned %d, expected %d\n", what, r, expected);
+        failures++;
+    }
+}
+
+int
+main()
+{
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0)
+    {
+        err(1, "socketpair");
+    }
+
+    expect("no events", 0);
+
+    send_kernel("add", "SUBSYSTEM=hidraw|" HIDRAW_PATH);
+    expect("kernel hidraw add", 1);
+
+    send_udev("add", "SUBSYSTEM=usb|PRODUCT=4d9/a052/100", sizeof(struct udev_header));
+    expect("udev usb add", 1);
+
+    send_kernel("add", "SUBSYSTEM=hidraw|" OTHER_PATH);
+    send_udev("add", "SUBSYSTEM=usb|PRODUCT=46d/c52b/1211", sizeof(struct udev_header));
+    expect("other devices", 0);
+
+    send_kernel("bind", "SUBSYSTEM=hidraw|" HIDRAW_PATH);
+    expect("other actions", 0);
+
+    send_kernel("add", "SUBSYSTEM=hidraw|" HIDRAW_PATH);
+    send_kernel("remove", "SUBSYSTEM=hidraw|" HIDRAW_PATH);
+    expect("add then remove", 0);
+
+    send_udev("remove", "SUBSYSTEM=usb|PRODUCT=4d9/a052/100", sizeof(struct udev_header));
+    send_udev("add", "SUBSYSTEM=usb|PRODUCT=4d9/a052/100", sizeof(struct udev_header));
+    expect("remove then add", 1);
+
+    send_udev("add", "SUBSYSTEM=usb|PRODUCT=4d9/a052/100", UEVENT_BUFFER_SIZE);
+    expect("udev header out of bounds", 0);
+
+    send_kernel("add", "SUBSYSTEM=hidraw|" HIDRAW_PATH);
+    if (hotplug_wait(fds[0]) != 1)
+    {
+        fprintf(stderr, "hotplug_wait did not return the added device\n");
+        failures++;
+    }
+    expect("drained by hotplug_wait", 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    return failures ? 1 : 0;
+}
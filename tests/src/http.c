@@ -0,0 +1,166 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+
+/* Malformed requests are sent to a co2mond started with -P, which must
+ * answer them with 400 and keep serving. The device is missing, so
+ * /metrics answers 503. */
+
+static struct sockaddr_in addr;
+
+// A port the kernel has just handed out is very likely still free.
+static int
+free_port()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a;
+    socklen_t len = sizeof(a);
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&a, &len) != 0)
+    {
+        err(1, "bind");
+    }
+    close(fd);
+    return ntohs(a.sin_port);
+}
+
+static int
+connect_daemon()
+{
+    for (int attempt = 0; attempt < 100; ++attempt)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+        {
+            err(1, "socket");
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        close(fd);
+        const struct timespec pause = { 0, 50000000 };
+        nanosleep(&pause, NULL);
+    }
+    errx(1, "co2mond does not accept connections");
+}
+
+// Returns 1 if the response starts with the expected status line.
+static int
+request(const char *what, const char *data, size_t len, const char *status)
+{
+    int fd = connect_daemon();
+    if (send(fd, data, len, 0) != (ssize_t)len)
+    {
+        err(1, "send");
+    }
+
+    char response[4096];
+    size_t n = 0;
+    while (n < sizeof(response) - 1)
+    {
+        ssize_t r = recv(fd, response + n, sizeof(response) - 1 - n, 0);
+        if (r <= 0)
+        {
+            break;
+        }
+        n += r;
+    }
+    response[n] = '\0';
+    close(fd);
+
+    if (strncmp(response, status, strlen(status)) != 0)
+    {
+        fprintf(stderr, "%s: expected \"%s\", got \"%.40s\"\n", what, status, response);
+        return 0;
+    }
+    return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: test_http path/to/co2mond\n");
+        return 2;
+    }
+
+    char listen[32];
+    const int port = free_port();
+    snprintf(listen, sizeof(listen), "127.0.0.1:%d", port);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        err(1, "fork");
+    }
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+        execl(argv[1], "co2mond", "-P", listen, "-f", "/nonexistent", (char *)NULL);
+        _exit(127);
+    }
+
+    static const char nul_first[] = "\0\r\n\r\n";
+    static const char nul_in_line[] = "GET /met\0rics HTTP/1.1\r\n\r\n";
+    static const char nul_in_headers[] = "GET /metrics HTTP/1.1\r\nHost: \0\r\n\r\n";
+    static const char empty_line[] = "\r\n\r\n";
+
+    int ok = 1;
+    ok &= request("NUL before the CRLF", nul_first, sizeof(nul_first) - 1, "HTTP/1.0 400");
+    ok &= request("NUL in the request line", nul_in_line, sizeof(nul_in_line) - 1, "HTTP/1.0 400");
+    ok &= request("NUL in a header", nul_in_headers, sizeof(nul_in_headers) - 1, "HTTP/1.0 400");
+    ok &= request("empty request line", empty_line, sizeof(empty_line) - 1, "HTTP/1.0 400");
+
+    static const char metrics[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    ok &= request("/metrics afterwards", metrics, sizeof(metrics) - 1, "HTTP/1.0 503");
+
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != 0)
+    {
+        fprintf(stderr, "co2mond exited\n");
+        return 1;
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+/*
+ * co2mon - programming interface to CO2 sensor.
+ * Copyright (C) 2015  Oleg Bulatov <oleg@bulatov.me>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "co2mond.h"
+
+/* A writer records readings of a changing set of codes while readers copy
+ * the state. Every copy must be one the writer published as a whole. */
+
+#define WRITES 2000000
+#define READERS 3
+#define CODES 24
+
+static struct device device;
+static volatile int done;
+
+static void *
+writer(void *arg)
+{
+    (void)arg;
+    unsigned int x = 1;
+    for (uint64_t n = 1; n <= WRITES; ++n)
+    {
+        x = x * 1103515245 + 12345;
+        unsigned char code = 0x40 + (x >> 16) % CODES;
+        const struct code_state *c = state_code(&device.state, code);
+        uint64_t count = c ? c->count + 1 : 1;
+
+        state_write_begin(&device);
+        device.state.heatbeat = n;
+        state_set_code(&device.state, code, (uint16_t)count, count, count * 3);
+        state_write_end(&device);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *
+reader(void *arg)
+{
+    unsigned long *copies = arg;
+    struct co2mon_state copy;
+    unsigned int last = 0;
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+    {
+        unsigned int seq = state_read(&device, &copy);
+        if (seq & 1)
+        {
+            errx(1, "odd sequence number %u", seq);
+        }
+        if (seq < last)
+        {
+            errx(1, "sequence number went back from %u to %u", last, seq);
+        }
+        last = seq;
+
+        uint64_t total = 0;
+        for (int i = 0; i < copy.codes_count; ++i)
+        {
+            const struct code_state *c = &copy.codes[i];
+            if (i > 0 && copy.codes[i - 1].code >= c->code)
+            {
+                errx(1, "codes are not sorted at %d", i);
+            }
+            if (c->value != (uint16_t)c->count || c->time_ns != (int64_t)c->count || c->time_ms != (int64_t)c->count * 3)
+            {
+                errx(1, "torn copy of code 0x%02x: value %u, count %llu",
+                    c->code, c->value, (unsigned long long)c->count);
+            }
+            total += c->count;
+        }
+        if (total != (uint64_t)copy.heatbeat)
+        {
+            errx(1, "torn copy: %llu readings, %llu writes",
+                (unsigned long long)total, (unsigned long long)copy.heatbeat);
+        }
+        (*copies)++;
+    }
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t w, r[READERS];
+    unsigned long copies[READERS] = {0};
+
+    for (int i = 0; i < READERS; ++i)
+    {
+        if (pthread_create(&r[i], NULL, reader, &copies[i]))
+        {
+            errx(1, "pthread_create failed");
+        }
+    }
+    if (pthread_create(&w, NULL, writer, NULL))
+    {
+        errx(1, "pthread_create failed");
+    }
+
+    pthread_join(w, NULL);
+    for (int i = 0; i < READERS; ++i)
+    {
+        pthread_join(r[i], NULL);
+        printf("reader %d: %lu copies\n", i, copies[i]);
+    }
+    return 0;
+}